@@ -12,7 +12,6 @@
 
 #ifdef __KERNEL__
 #include <linux/string.h>
-#include <linux/slab.h> // kfree
 #else
 #include <string.h>
 #include <stdio.h>
@@ -42,6 +41,10 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
     if ((buffer == NULL) || (entry_offset_byte_rtn == NULL))
         return NULL;
 
+    // Nothing to find in an empty buffer
+    if (!buffer->full && (buffer->in_offs == buffer->out_offs))
+        return NULL;
+
     // Loop through all entries until matching offset is found
     offset = buffer->out_offs; // Start with next entry to be popped
     do
@@ -49,7 +52,7 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
         last_size = total_size;
         total_size += buffer->entry[offset].size;
 
-        if (char_offset <= (total_size - 1))
+        if (char_offset < total_size)
         {
             *entry_offset_byte_rtn = char_offset - last_size;
             return &buffer->entry[offset];
@@ -67,7 +70,8 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
 /**
 * Adds entry @param add_entry to @param buffer in the location specified in buffer->in_offs.
 * If the buffer was already full, overwrites the oldest entry and advances buffer->out_offs to the
-* new start location.
+* new start location.  Returns the buffptr of the overwritten entry so the caller can free it, or
+* NULL if nothing was overwritten or the overwritten record was stored inline.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
 */
@@ -82,14 +86,15 @@ const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
     // Check if buffer is already full
     if (buffer->full)
     {
-        // Save memory address pointed to by the out offset
-        pBuf = buffer->entry[buffer->out_offs].buffptr;
+        // Save memory address pointed to by the out offset, inline records have nothing to free
+        if (!aesd_buffer_entry_is_inline(&buffer->entry[buffer->out_offs]))
+            pBuf = buffer->entry[buffer->out_offs].buffptr;
         if ((++buffer->out_offs) >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
             buffer->out_offs = 0;
     }
 
     // Add new entry to buffer
-    buffer->entry[buffer->in_offs] = *add_entry;
+    aesd_buffer_entry_copy(&buffer->entry[buffer->in_offs], add_entry);
     if ((++buffer->in_offs) >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
         buffer->in_offs = 0;
 
@@ -107,6 +112,7 @@ void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
     memset(buffer, 0, sizeof(struct aesd_circular_buffer));
 }
 
+#ifndef __KERNEL__
 // See aesd-circular-buffer.h for documentation
 void aesd_circular_buffer_deinit(struct aesd_circular_buffer *buffer)
 {
@@ -116,16 +122,151 @@ void aesd_circular_buffer_deinit(struct aesd_circular_buffer *buffer)
     // Loop through each slot and free allocated memory
     AESD_CIRCULAR_BUFFER_FOREACH(pEntry, buffer, index)
     {
-        if (pEntry->buffptr == NULL)
-            continue; // Memory already freed
-
-// Use kernel to determine if kfree or free is needed
-#ifdef __KERNEL__
-        // Kernel space
-        kfree(pEntry->buffptr);
-#else
-        // User space
+        if ((pEntry->buffptr == NULL) || aesd_buffer_entry_is_inline(pEntry))
+            continue; // Memory already freed or stored inline
         free((void*)pEntry->buffptr);
+    }
+}
 #endif
+
+/**
+ * @brief Initialize @param ring to store records in the @param capacity bytes at @param data.
+ *  The storage stays owned by the caller.
+ *
+ * @return false if capacity is not a non zero power of two
+ */
+bool aesd_byte_ring_init(struct aesd_byte_ring *ring, char *data, size_t capacity)
+{
+    if ((ring == NULL) || (data == NULL) || (capacity == 0) || ((capacity & (capacity - 1)) != 0))
+        return false;
+
+    memset(ring, 0, sizeof(struct aesd_byte_ring));
+    ring->data = data;
+    ring->capacity = capacity;
+    return true;
+}
+
+/**
+ * @brief Drop the oldest record of @param ring
+ *
+ * @return size of the dropped record
+ */
+static size_t aesd_byte_ring_drop(struct aesd_byte_ring *ring)
+{
+    size_t size = ring->index[ring->out_offs].size;
+
+    ring->head += size;
+    if ((++ring->out_offs) >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+        ring->out_offs = 0;
+    ring->full = false;
+    return size;
+}
+
+/**
+ * @brief Copy the @param size byte record at @param buf to the end of @param ring.
+ *  The oldest records are dropped until both an index slot and the bytes are free.
+ *  The number of bytes dropped is stored at @param evicted_rtn if not NULL.  An
+ *  empty record is not stored and drops nothing.  Any necessary locking must be
+ *  handled by the caller.
+ *
+ * @return false if the record is larger than the ring
+ */
+bool aesd_byte_ring_add(struct aesd_byte_ring *ring, const char *buf, size_t size, size_t *evicted_rtn)
+{
+    size_t evicted = 0;
+    size_t start;
+    size_t chunk;
+
+    // Validate arguments
+    if ((ring == NULL) || ((buf == NULL) && (size != 0)) || (size > ring->capacity))
+        return false;
+    if (size == 0)
+    {
+        if (evicted_rtn != NULL)
+            *evicted_rtn = 0;
+        return true;
     }
+
+    // Make room for the index slot and the bytes
+    if (ring->full)
+        evicted += aesd_byte_ring_drop(ring);
+    while ((ring->capacity - aesd_byte_ring_size(ring)) < size)
+        evicted += aesd_byte_ring_drop(ring);
+
+    // Copy the bytes, wrapping at the end of the storage
+    start = ring->tail & (ring->capacity - 1);
+    chunk = ring->capacity - start;
+    if (chunk > size)
+        chunk = size;
+    memcpy(&ring->data[start], buf, chunk);
+    memcpy(ring->data, buf + chunk, size - chunk);
+
+    // Add the record to the index
+    ring->index[ring->in_offs].offs = ring->tail;
+    ring->index[ring->in_offs].size = size;
+    ring->tail += size;
+    if ((++ring->in_offs) >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+        ring->in_offs = 0;
+    ring->full = (ring->in_offs == ring->out_offs);
+
+    if (evicted_rtn != NULL)
+        *evicted_rtn = evicted;
+    return true;
+}
+
+/**
+ * @brief Same as aesd_circular_buffer_find_entry_offset_for_fpos() for @param ring
+ *
+ * @return the index of the record holding char_offset or NULL if not enough data is written
+ */
+struct aesd_byte_ring_index *aesd_byte_ring_find_index_for_fpos(struct aesd_byte_ring *ring,
+                                                                size_t char_offset, size_t *entry_offset_byte_rtn)
+{
+    uint8_t offset;
+    size_t pos;
+
+    // Validate arguments
+    if ((ring == NULL) || (entry_offset_byte_rtn == NULL) || (char_offset >= aesd_byte_ring_size(ring)))
+        return NULL;
+
+    // Records are back to back in the stream, walk the index to the one holding pos
+    pos = ring->head + char_offset;
+    offset = ring->out_offs;
+    while (pos >= (ring->index[offset].offs + ring->index[offset].size))
+    {
+        if ((++offset) >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+            offset = 0;
+    }
+
+    *entry_offset_byte_rtn = pos - ring->index[offset].offs;
+    return &ring->index[offset];
+}
+
+/**
+ * @brief Copy up to @param count bytes of the concatenated records of @param ring,
+ *  starting at @param char_offset, to @param dst.  Any necessary locking must be
+ *  handled by the caller.
+ *
+ * @return number of bytes copied, 0 if char_offset is at or past the end of the data
+ */
+size_t aesd_byte_ring_read(const struct aesd_byte_ring *ring, size_t char_offset, char *dst, size_t count)
+{
+    size_t start;
+    size_t chunk;
+
+    // Validate arguments
+    if ((ring == NULL) || (dst == NULL) || (char_offset >= aesd_byte_ring_size(ring)))
+        return 0;
+
+    if (count > (aesd_byte_ring_size(ring) - char_offset))
+        count = aesd_byte_ring_size(ring) - char_offset;
+
+    // At most two copies, the second one when the range wraps
+    start = (ring->head + char_offset) & (ring->capacity - 1);
+    chunk = ring->capacity - start;
+    if (chunk > count)
+        chunk = count;
+    memcpy(dst, &ring->data[start], chunk);
+    memcpy(dst + chunk, ring->data, count - chunk);
+    return count;
 }
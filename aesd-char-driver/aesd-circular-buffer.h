@@ -10,26 +10,85 @@
 
 #ifdef __KERNEL__
 #include <linux/types.h>
+#include <linux/string.h>
 #else
 #include <stddef.h> // size_t
 #include <stdint.h> // uintx_t
 #include <stdbool.h>
+#include <string.h> // memcpy
 #endif
 
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
 
+// Size of struct aesd_buffer_entry, one cache line
+#define AESD_BUFFER_ENTRY_SIZE 64
+
+// Records of up to this many bytes can be stored inside the entry itself
+#define AESD_BUFFER_ENTRY_INLINE_SIZE (AESD_BUFFER_ENTRY_SIZE - sizeof(const char *) - sizeof(size_t))
+
 struct aesd_buffer_entry
 {
 	/**
-	 * A location where the buffer contents in buffptr are stored
+	 * A location where the buffer contents in buffptr are stored.  Points at
+	 * inline_data of this same entry when the record is stored inline, which is
+	 * what tells inline from external storage.
 	 */
 	const char *buffptr;
 	/**
 	 * Number of bytes stored in buffptr
 	 */
 	size_t size;
+	/**
+	 * Storage for records of up to AESD_BUFFER_ENTRY_INLINE_SIZE bytes, see
+	 * aesd_buffer_entry_set()
+	 */
+	char inline_data[AESD_BUFFER_ENTRY_INLINE_SIZE];
 };
 
+/**
+ * True if the record of @param entry is stored inside the entry rather than in
+ * memory owned by the caller
+ */
+#define aesd_buffer_entry_is_inline(entry) ((entry)->buffptr == (entry)->inline_data)
+
+/**
+ * @brief Store the @param size byte record at @param data in @param entry.  A record
+ *  which fits in AESD_BUFFER_ENTRY_INLINE_SIZE bytes is copied inline, a longer
+ *  one is referenced and must stay allocated by the caller.
+ *
+ * @return true if the record was copied inline
+ */
+static inline bool aesd_buffer_entry_set(struct aesd_buffer_entry *entry, const char *data, size_t size)
+{
+	entry->size = size;
+	if (size <= AESD_BUFFER_ENTRY_INLINE_SIZE)
+	{
+		memcpy(entry->inline_data, data, size);
+		entry->buffptr = entry->inline_data;
+		return true;
+	}
+	entry->buffptr = data;
+	return false;
+}
+
+/**
+ * @brief Copy @param src to @param dst.  Entries must be copied with this rather than
+ *  by assignment so an inline record ends up pointing at the copy's own storage.
+ */
+static inline void aesd_buffer_entry_copy(struct aesd_buffer_entry *dst, const struct aesd_buffer_entry *src)
+{
+	if (aesd_buffer_entry_is_inline(src))
+	{
+		memcpy(dst->inline_data, src->inline_data, src->size);
+		dst->buffptr = dst->inline_data;
+	}
+	else
+	{
+		dst->buffptr = src->buffptr;
+	}
+	dst->size = src->size;
+}
+
 struct aesd_circular_buffer
 {
 	/**
@@ -51,6 +110,56 @@ struct aesd_circular_buffer
 	bool full;
 };
 
+/**
+ * Location of one record in a struct aesd_byte_ring
+ */
+struct aesd_byte_ring_index
+{
+	/**
+	 * Position of the first byte of the record in the byte stream written to the
+	 * ring, the byte is stored at data[offs & (capacity - 1)]
+	 */
+	size_t offs;
+	/**
+	 * Number of bytes in the record
+	 */
+	size_t size;
+};
+
+/**
+ * Alternate circular buffer storing record bytes back to back in one contiguous
+ * power of two sized byte ring instead of separate allocations.  Adding a record
+ * is a memcpy and reading consecutive records is at most two copies.  The ring
+ * holds at most AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED records, older records are
+ * dropped as needed to make room for both the index slot and the bytes.
+ */
+struct aesd_byte_ring
+{
+	/**
+	 * Caller provided storage of capacity bytes
+	 */
+	char *data;
+	/**
+	 * Size of data, a power of two
+	 */
+	size_t capacity;
+	/**
+	 * Stream position of the first byte of the oldest record
+	 */
+	size_t head;
+	/**
+	 * Stream position one past the last byte of the newest record
+	 */
+	size_t tail;
+	/**
+	 * Records in the same in_offs/out_offs/full layout as struct aesd_circular_buffer
+	 */
+	struct aesd_byte_ring_index index[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+	uint8_t in_offs;
+	uint8_t out_offs;
+	bool full;
+};
+
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
 			size_t char_offset, size_t *entry_offset_byte_rtn );
 
@@ -58,13 +167,31 @@ extern const char * aesd_circular_buffer_add_entry(struct aesd_circular_buffer *
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+#ifndef __KERNEL__
 /**
- * @brief Free all memory usage by the circular buffer
+ * @brief Free all memory usage by the circular buffer.  Inline records need no freeing.
+ *  User space only, where records are malloc()ed.  The driver allocates records
+ *  several ways and frees them with aesd_record_free().
  * 
  * @param buffer - Pointer to circular buffer
  */
 void aesd_circular_buffer_deinit(struct aesd_circular_buffer *buffer);
+#endif
+
 
+extern bool aesd_byte_ring_init(struct aesd_byte_ring *ring, char *data, size_t capacity);
+
+extern bool aesd_byte_ring_add(struct aesd_byte_ring *ring, const char *buf, size_t size, size_t *evicted_rtn);
+
+extern struct aesd_byte_ring_index *aesd_byte_ring_find_index_for_fpos(struct aesd_byte_ring *ring,
+			size_t char_offset, size_t *entry_offset_byte_rtn);
+
+extern size_t aesd_byte_ring_read(const struct aesd_byte_ring *ring, size_t char_offset, char *dst, size_t count);
+
+/**
+ * Number of record bytes held by @param ring
+ */
+#define aesd_byte_ring_size(ring) ((ring)->tail - (ring)->head)
 
 /**
  * Create a for loop to iterate over each member of the circular buffer.
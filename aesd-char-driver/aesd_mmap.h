@@ -0,0 +1,75 @@
+/*
+ * aesd_mmap.h
+ *
+ *  @brief Layout of the read only mapping returned by mmap() on aesd char devices
+ *
+ *  The mapping starts with a header page followed by AESD_MMAP_DATA_SIZE bytes of
+ *  record data.  Every committed record is copied into the data area as a byte
+ *  stream, byte k of the stream lives at data[k % AESD_MMAP_DATA_SIZE].  Stream
+ *  bytes older than head - AESD_MMAP_DATA_SIZE have been overwritten.  A record
+ *  larger than the data area is not copied, it can only be read().  The data area
+ *  is a struct aesd_byte_ring.
+ *
+ *  The header is updated under a sequence counter: seq is odd while the driver
+ *  is updating the mapping.  Readers sample seq, copy what they need and retry
+ *  if seq was odd or has changed.
+ */
+
+#ifndef AESD_MMAP_H
+#define AESD_MMAP_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+
+#include "aesd-circular-buffer.h"
+
+// Size of the header page at offset 0 of the mapping
+#define AESD_MMAP_HEADER_SIZE 4096
+
+// Size of the record data area following the header, a power of two
+#define AESD_MMAP_DATA_SIZE (64 * 4096)
+
+// Total size of the mapping
+#define AESD_MMAP_SIZE (AESD_MMAP_HEADER_SIZE + AESD_MMAP_DATA_SIZE)
+
+struct aesd_mmap_record
+{
+	/**
+	 * Stream offset of the first byte of the record
+	 */
+	uint64_t start;
+	/**
+	 * Number of bytes in the record, 0 if the slot is empty or the record was too
+	 * large to copy into the data area
+	 */
+	uint64_t size;
+};
+
+struct aesd_mmap_header
+{
+	/**
+	 * Sequence counter, odd while an update is in progress
+	 */
+	uint32_t seq;
+	/**
+	 * Copies of the circular buffer indices, see struct aesd_circular_buffer
+	 */
+	uint8_t in_offs;
+	uint8_t out_offs;
+	uint8_t full;
+	uint8_t reserved;
+	/**
+	 * Stream offset one past the last byte written to the data area
+	 */
+	uint64_t head;
+	/**
+	 * Location of each circular buffer entry in the byte stream, indexed like
+	 * struct aesd_circular_buffer entry[]
+	 */
+	struct aesd_mmap_record record[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+};
+
+#endif /* AESD_MMAP_H */
@@ -11,7 +11,7 @@
 // Access to struct aesd_circular_buffer and struct aesd_buffer_entry entry
 #include "aesd-circular-buffer.h" 
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+//#define AESD_DEBUG 1  //Remove comment on this line to enable debug, see also aesdchar_trace.h
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -26,14 +26,93 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+// Default number of devices (minors), see the aesd_nr_devs module parameter
+#define AESD_NR_DEVS 1
+
+// Initial size of a per-file staging buffer, grown by doubling
+#define AESD_STAGING_MIN_SIZE 64
+
+// Staging buffers larger than this are released once their record is committed
+#define AESD_STAGING_KEEP_SIZE (4 * PAGE_SIZE)
+
+// Identifies a backing file written by aesd_backing_save()
+#define AESD_BACKING_MAGIC "AESDRING"
+#define AESD_BACKING_VERSION 1
+
+// Records up to this size come from the aesd_record slab cache, larger ones from pages
+#define AESD_RECORD_SMALL_SIZE 256
+
+/**
+ * Header of the backing file given by the aesd_backing_file module parameter.
+ * It is followed, for each of nr_devs devices, by a u32 record count and that
+ * many records, oldest first, each stored as a u32 size and the record bytes.
+ * All values are in native byte order.
+ */
+struct aesd_backing_header
+{
+	char magic[8];
+	u32 version;
+	u32 nr_devs;
+};
+
+/**
+ * A completed record queued on a per CPU list, waiting to be committed to the
+ * circular buffer in a batch.
+ */
+struct aesd_pending
+{
+	struct llist_node node;
+	struct aesd_buffer_entry entry;
+};
+
+/**
+ * Counters exposed in debugfs under aesdchar/aesdchar<minor>/.  Updated with
+ * drv_mutex held.
+ */
+struct aesd_stats
+{
+	u64 records;      // records committed
+	u64 bytes;        // bytes committed
+	u64 evictions;    // records dropped to make room for newer ones
+	u64 lock_wait_ns; // time spent waiting for drv_mutex when it was contended
+	u64 bytes_held;   // bytes currently held in the circular buffer
+};
+
 struct aesd_dev
 {
 	struct cdev cdev;	  /* Char device structure		*/
+	unsigned int minor;   // index of this device
 	
 	// KJ\ Added extra structure members
 	struct aesd_circular_buffer cb; // aesd circular buffer
-	struct aesd_buffer_entry entry; // aesd circular buffer entry
+	struct aesd_buffer_entry entry; // partial write left behind by a released file
 	struct mutex drv_mutex;  // structure mutex
+	void *mmap_area;         // header page and record data exposed through mmap()
+	struct aesd_byte_ring mmap_ring; // record data of mmap_area, after the header page
+	wait_queue_head_t read_wq; // readers waiting for the next record
+	u64 commits;             // number of records committed so far
+	u64 evicted;             // number of bytes dropped from the oldest end of the buffer
+	struct llist_head __percpu *pending; // completed records waiting to be committed, per CPU
+	struct aesd_stats stats; // counters shown in debugfs
+	struct dentry *debugfs;  // debugfs directory of this device
+};
+
+/**
+ * Per open file state, saved in filp->private_data.  Each file accumulates its
+ * own partial (not yet newline terminated) write so writers using different
+ * file descriptors never interleave into the same record.
+ */
+struct aesd_file
+{
+	struct aesd_dev *dev;     // device this file was opened on
+	struct mutex lock;        // serializes writers sharing this file
+	char *staging;            // partial write accumulated so far
+	size_t staging_size;      // number of valid bytes in staging
+	size_t staging_scanned;   // leading bytes of staging known to hold no newline
+	size_t staging_capacity;  // allocated size of staging
+	struct aesd_buffer_entry spare; // evicted record kept for reuse by the next commit
+	u64 evicted_seen;         // value of dev->evicted when the file position was last updated
+	bool follow;              // reads at the end wait for new records, see AESDCHAR_IOCFOLLOW
 };
 
 
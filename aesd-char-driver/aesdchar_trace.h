@@ -0,0 +1,105 @@
+/*
+ * aesdchar_trace.h
+ *
+ *  @brief Tracepoints for the aesd char driver, enable them with
+ *         echo 1 > /sys/kernel/tracing/events/aesdchar/enable
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(aesd_file_event,
+
+	TP_PROTO(unsigned int minor),
+
+	TP_ARGS(minor),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+	),
+
+	TP_printk("minor=%u", __entry->minor)
+);
+
+DEFINE_EVENT(aesd_file_event, aesd_open,
+	TP_PROTO(unsigned int minor),
+	TP_ARGS(minor)
+);
+
+DEFINE_EVENT(aesd_file_event, aesd_release,
+	TP_PROTO(unsigned int minor),
+	TP_ARGS(minor)
+);
+
+DECLARE_EVENT_CLASS(aesd_rw_event,
+
+	TP_PROTO(unsigned int minor, size_t count, loff_t pos, ssize_t ret),
+
+	TP_ARGS(minor, count, pos, ret),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(size_t, count)
+		__field(loff_t, pos)
+		__field(ssize_t, ret)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->count = count;
+		__entry->pos = pos;
+		__entry->ret = ret;
+	),
+
+	TP_printk("minor=%u count=%zu pos=%lld ret=%zd",
+		  __entry->minor, __entry->count, __entry->pos, __entry->ret)
+);
+
+DEFINE_EVENT(aesd_rw_event, aesd_read,
+	TP_PROTO(unsigned int minor, size_t count, loff_t pos, ssize_t ret),
+	TP_ARGS(minor, count, pos, ret)
+);
+
+DEFINE_EVENT(aesd_rw_event, aesd_write,
+	TP_PROTO(unsigned int minor, size_t count, loff_t pos, ssize_t ret),
+	TP_ARGS(minor, count, pos, ret)
+);
+
+TRACE_EVENT(aesd_commit,
+
+	TP_PROTO(unsigned int minor, size_t size, size_t evicted),
+
+	TP_ARGS(minor, size, evicted),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(size_t, size)
+		__field(size_t, evicted)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->size = size;
+		__entry->evicted = evicted;
+	),
+
+	TP_printk("minor=%u size=%zu evicted=%zu",
+		  __entry->minor, __entry->size, __entry->evicted)
+);
+
+#endif /* AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE aesdchar_trace
+#include <trace/define_trace.h>
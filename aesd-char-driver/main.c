@@ -17,174 +17,800 @@
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
+#include <linux/uio.h> // iov_iter
 #include <linux/mutex.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/llist.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
 #include <asm/uaccess.h>
 #include "aesdchar.h"
 #include "aesd-circular-buffer.h"
+#include "aesd_ioctl.h"
+#include "aesd_mmap.h"
+
+#define CREATE_TRACE_POINTS
+#include "aesdchar_trace.h"
 
 int aesd_major = 0; // use dynamic major
 int aesd_minor = 0;
+unsigned int aesd_nr_devs = AESD_NR_DEVS; // number of minors, each with its own buffer
+
+module_param(aesd_nr_devs, uint, 0444);
+MODULE_PARM_DESC(aesd_nr_devs, "Number of aesdchar devices, each with an independent circular buffer");
+
+char *aesd_backing_file = NULL; // history is saved here on unload and restored on load
+module_param(aesd_backing_file, charp, 0444);
+MODULE_PARM_DESC(aesd_backing_file, "File keeping the history of every device across module reloads");
 
 MODULE_AUTHOR("Kenneth A. Jones");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+struct aesd_dev *aesd_devices; // array of aesd_nr_devs devices
+
+// debugfs directory holding one directory of counters per device
+static struct dentry *aesd_debugfs_root;
+
+// Cache for records of up to AESD_RECORD_SMALL_SIZE bytes
+static struct kmem_cache *aesd_record_cache;
+
+// Cache for struct aesd_pending queue nodes
+static struct kmem_cache *aesd_pending_cache;
+
+/**
+ * @brief Release storage returned by aesd_record_alloc() for a record of @param size bytes
+ */
+static void aesd_record_free(const char *pBuf, size_t size)
+{
+	if (pBuf == NULL)
+		return;
+
+	if (size <= AESD_RECORD_SMALL_SIZE)
+		kmem_cache_free(aesd_record_cache, (void *)pBuf);
+	else if (get_order(size) > PAGE_ALLOC_COSTLY_ORDER)
+		kvfree(pBuf);
+	else
+		free_pages((unsigned long)pBuf, get_order(size));
+}
+
+/**
+ * @brief Release the storage of the record held by @param pEntry, if any.  Inline
+ *  records live in the entry itself and need no freeing.
+ */
+static void aesd_record_put(const struct aesd_buffer_entry *pEntry)
+{
+	if (!aesd_buffer_entry_is_inline(pEntry))
+		aesd_record_free(pEntry->buffptr, pEntry->size);
+}
+
+/**
+ * @brief Allocate storage for a committed record of @param size bytes.
+ *  Small records come from the aesd_record slab cache and large records from
+ *  whole pages.  Records too large for the page allocator to provide contiguous
+ *  pages cheaply come from kvmalloc().  None is zeroed since the record is always
+ *  fully copied over.  The sizes are the user's, so failures don't warn.  The
+ *  spare record of @param pFile, if not NULL, is reused when it is of the same
+ *  class and page order.
+ *
+ * @return pointer to the record storage or NULL if out of memory
+ */
+static char *aesd_record_alloc(struct aesd_file *pFile, size_t size)
+{
+	char *pBuf = (pFile != NULL) ? (char *)pFile->spare.buffptr : NULL;
+
+	if (pBuf != NULL)
+	{
+		pFile->spare.buffptr = NULL;
+		if ((size <= AESD_RECORD_SMALL_SIZE) && (pFile->spare.size <= AESD_RECORD_SMALL_SIZE))
+			return pBuf;
+		if ((size > AESD_RECORD_SMALL_SIZE) && (pFile->spare.size > AESD_RECORD_SMALL_SIZE) &&
+			(get_order(size) <= PAGE_ALLOC_COSTLY_ORDER) && (get_order(size) == get_order(pFile->spare.size)))
+			return pBuf;
+		aesd_record_free(pBuf, pFile->spare.size);
+	}
+
+	if (size <= AESD_RECORD_SMALL_SIZE)
+		return kmem_cache_alloc(aesd_record_cache, GFP_KERNEL);
+
+	if (get_order(size) > PAGE_ALLOC_COSTLY_ORDER)
+		return kvmalloc(size, GFP_KERNEL | __GFP_NOWARN);
+
+	return (char *)__get_free_pages(GFP_KERNEL | __GFP_NOWARN, get_order(size));
+}
+
+/**
+ * @brief Keep an evicted record as the spare of @param pFile, or free it if a spare is already held
+ */
+static void aesd_record_recycle(struct aesd_file *pFile, const struct aesd_buffer_entry *pEvicted)
+{
+	if (aesd_buffer_entry_is_inline(pEvicted))
+		return;
+	if (pFile->spare.buffptr == NULL)
+		pFile->spare = *pEvicted;
+	else
+		aesd_record_free(pEvicted->buffptr, pEvicted->size);
+}
+
+/**
+ * @brief Acquire drv_mutex of @param pDev, accounting any time spent waiting for it
+ */
+static void aesd_lock(struct aesd_dev *pDev)
+{
+	u64 start;
+
+	if (mutex_trylock(&pDev->drv_mutex))
+		return;
+
+	start = ktime_get_ns();
+	mutex_lock(&pDev->drv_mutex);
+	pDev->stats.lock_wait_ns += ktime_get_ns() - start;
+}
+
+/**
+ * @brief Interruptible version of aesd_lock()
+ *
+ * @return 0 once the lock is held, -ERESTARTSYS if interrupted
+ */
+static int aesd_lock_interruptible(struct aesd_dev *pDev)
+{
+	u64 start;
+
+	if (mutex_trylock(&pDev->drv_mutex))
+		return 0;
+
+	start = ktime_get_ns();
+	if (mutex_lock_interruptible(&pDev->drv_mutex) != 0)
+		return -ERESTARTSYS;
+	pDev->stats.lock_wait_ns += ktime_get_ns() - start;
+	return 0;
+}
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
 	struct aesd_dev *pDev;
-
-	PDEBUG("open");
+	struct aesd_file *pFile;
 
 	// Get pointer to structure
 	pDev = container_of(inode->i_cdev, struct aesd_dev, cdev);
 
+	// Allocate the per file state
+	pFile = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);
+	if (pFile == NULL)
+		return -ENOMEM;
+
+	pFile->dev = pDev;
+	mutex_init(&pFile->lock);
+
 	// Save pointer in private_data
-	filp->private_data = pDev;
+	filp->private_data = pFile;
 
+	trace_aesd_open(pDev->minor);
 	return 0;
 }
 
 int aesd_release(struct inode *inode, struct file *filp)
 {
-	PDEBUG("release");
-	//KJ\ Nothing to do here ?!
+	struct aesd_file *pFile = (struct aesd_file *)filp->private_data;
+	struct aesd_dev *pDev = pFile->dev;
+	char *pBuf;
+
+	trace_aesd_release(pDev->minor);
+
+	// Hand any unterminated write to the device so the next writer continues it
+	if (pFile->staging_size != 0)
+	{
+		aesd_lock(pDev);
+		if (pDev->entry.size == 0)
+		{
+			pDev->entry.buffptr = pFile->staging;
+			pDev->entry.size = pFile->staging_size;
+			pFile->staging = NULL;
+		}
+		else
+		{
+			pBuf = krealloc(pDev->entry.buffptr, pDev->entry.size + pFile->staging_size, GFP_KERNEL);
+			if (pBuf != NULL)
+			{
+				memcpy(&pBuf[pDev->entry.size], pFile->staging, pFile->staging_size);
+				pDev->entry.buffptr = pBuf;
+				pDev->entry.size += pFile->staging_size;
+			}
+			else if (pFile->staging_capacity >= (pDev->entry.size + pFile->staging_size))
+			{
+				// Out of memory, but the staging buffer has room for both parts
+				memmove(&pFile->staging[pDev->entry.size], pFile->staging, pFile->staging_size);
+				memcpy(pFile->staging, pDev->entry.buffptr, pDev->entry.size);
+				kfree(pDev->entry.buffptr);
+				pDev->entry.buffptr = pFile->staging;
+				pDev->entry.size += pFile->staging_size;
+				pFile->staging = NULL;
+			}
+			else
+			{
+				printk(KERN_WARNING "aesdchar: no memory to keep %zu bytes of an unterminated write\n",
+					   pFile->staging_size);
+			}
+		}
+		mutex_unlock(&pDev->drv_mutex);
+	}
+
+	kfree(pFile->staging);
+	aesd_record_free(pFile->spare.buffptr, pFile->spare.size);
+	kfree(pFile);
+	return 0;
+}
+
+/**
+ * @brief Make sure the staging buffer of @param pFile has room for @param count more bytes.
+ *  The buffer grows geometrically so a record written in many pieces is only
+ *  reallocated a logarithmic number of times.
+ *
+ * @return 0 on success, -ENOMEM if the buffer could not be grown
+ */
+static int aesd_staging_reserve(struct aesd_file *pFile, size_t count)
+{
+	size_t needed = pFile->staging_size + count;
+	size_t capacity = pFile->staging_capacity;
+	char *pBuf;
+
+	if (needed <= capacity)
+		return 0;
+
+	if (capacity < AESD_STAGING_MIN_SIZE)
+		capacity = AESD_STAGING_MIN_SIZE;
+	while (capacity < needed)
+		capacity *= 2;
+
+	pBuf = krealloc(pFile->staging, capacity, GFP_KERNEL | __GFP_NOWARN);
+	if (pBuf == NULL)
+		return -ENOMEM;
+
+	pFile->staging = pBuf;
+	pFile->staging_capacity = capacity;
 	return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-						loff_t *f_pos)
+/**
+ * @brief Continue a partial write left behind by a released file, if any.
+ *  Only called on a record boundary, i.e. when the staging buffer is empty.
+ */
+static void aesd_staging_adopt(struct aesd_file *pFile)
+{
+	struct aesd_dev *pDev = pFile->dev;
+
+	aesd_lock(pDev);
+	if (pDev->entry.size != 0)
+	{
+		kfree(pFile->staging);
+		pFile->staging = (char *)pDev->entry.buffptr;
+		pFile->staging_size = pDev->entry.size;
+		pFile->staging_scanned = 0;
+		pFile->staging_capacity = pDev->entry.size;
+		pDev->entry.buffptr = NULL;
+		pDev->entry.size = 0;
+	}
+	mutex_unlock(&pDev->drv_mutex);
+}
+
+/**
+ * @brief Mirror a record just added at circular buffer entry @param slot into the
+ *  mmap() data area and update the header.  Caller must hold drv_mutex.
+ */
+static void aesd_mmap_commit(struct aesd_dev *pDev, uint8_t slot, const struct aesd_buffer_entry *pEntry)
+{
+	struct aesd_mmap_header *pHdr = (struct aesd_mmap_header *)pDev->mmap_area;
+	size_t start = pDev->mmap_ring.tail;
+	bool mirrored;
+
+	WRITE_ONCE(pHdr->seq, pHdr->seq + 1);
+	smp_wmb();
+
+	// A record larger than the whole data area is only available through read()
+	mirrored = aesd_byte_ring_add(&pDev->mmap_ring, pEntry->buffptr, pEntry->size, NULL);
+
+	pHdr->record[slot].start = start;
+	pHdr->record[slot].size = mirrored ? pEntry->size : 0;
+	pHdr->head = pDev->mmap_ring.tail;
+	pHdr->in_offs = pDev->cb.in_offs;
+	pHdr->out_offs = pDev->cb.out_offs;
+	pHdr->full = pDev->cb.full;
+
+	smp_wmb();
+	WRITE_ONCE(pHdr->seq, pHdr->seq + 1);
+}
+
+/**
+ * @brief Keep the file position @param pPos of @param pFile on the same byte after
+ *  older records have been evicted.  Caller must hold drv_mutex.
+ */
+static void aesd_sync_pos(struct aesd_file *pFile, loff_t *pPos)
+{
+	struct aesd_dev *pDev = pFile->dev;
+	u64 dropped = pDev->evicted - pFile->evicted_seen;
+
+	*pPos = (*pPos > dropped) ? (*pPos - dropped) : 0;
+	pFile->evicted_seen = pDev->evicted;
+}
+
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
 	ssize_t retval = 0;
-	ssize_t offset;
-	ssize_t nRead;
+	size_t count = iov_iter_count(to);
+	size_t offset;
+	size_t nRead;
+	size_t nCopied = 0;
+	u64 commits;
+	loff_t pos = iocb->ki_pos;
 	struct aesd_buffer_entry *pEntry = NULL;
-	struct aesd_dev *pDev = (struct aesd_dev *)filp->private_data; // Get access to device driver
+	struct aesd_file *pFile = (struct aesd_file *)iocb->ki_filp->private_data;
+	struct aesd_dev *pDev = pFile->dev; // Get access to device driver
 
-	PDEBUG("read %zu bytes with offset %lld", count, *f_pos);
-	
 	// Acquire device mutex
-	if (mutex_lock_interruptible(&pDev->drv_mutex) != 0)
+	if (aesd_lock_interruptible(pDev) != 0)
 	{
 		PDEBUG("Failed to acquire lock");
 		return -ERESTARTSYS;
 	}
 
-	// Find the corresponding offset
-	pEntry = aesd_circular_buffer_find_entry_offset_for_fpos(&pDev->cb,*f_pos, &offset );
-	if (pEntry == NULL)
-		goto done; // No matching entry not found
+	// Find the corresponding offset, waiting for new records in follow mode
+	while (1)
+	{
+		aesd_sync_pos(pFile, &pos);
+		pEntry = aesd_circular_buffer_find_entry_offset_for_fpos(&pDev->cb, pos, &offset );
+		if (pEntry != NULL)
+			break;
 
-	// Calculate the number of bytes read
-	nRead = pEntry->size - offset;
-	if( count < nRead)
-		nRead = count;
+		if (!pFile->follow)
+			goto done; // No matching entry not found
 
-	// Copy data from kernel space to user space
-	if(copy_to_user(buf, (pEntry->buffptr + offset), nRead) != 0 )
-	{
-		PDEBUG("Failed to copy %ld bytes from kernel space to user space", nRead);
-		retval = -EFAULT;
-		goto done;
+		if ((iocb->ki_flags & IOCB_NOWAIT) || (iocb->ki_filp->f_flags & O_NONBLOCK))
+		{
+			retval = -EAGAIN;
+			goto done;
+		}
+
+		commits = pDev->commits;
+		mutex_unlock(&pDev->drv_mutex);
+
+		// The position synced above must still be stored, so relock before giving up
+		if (wait_event_interruptible(pDev->read_wq, READ_ONCE(pDev->commits) != commits) != 0)
+		{
+			aesd_lock(pDev);
+			retval = -ERESTARTSYS;
+			goto done;
+		}
+		aesd_lock(pDev);
 	}
 
-	// Update position
-	*f_pos += nRead;
+	// Fill the user buffers from as many records as fit, under one lock acquisition
+	while ((pEntry != NULL) && (iov_iter_count(to) != 0))
+	{
+		nRead = min_t(size_t, pEntry->size - offset, iov_iter_count(to));
+		if (copy_to_iter(pEntry->buffptr + offset, nRead, to) != nRead)
+		{
+			PDEBUG("Failed to copy %zu bytes from kernel space to user space", nRead);
+			if (nCopied == 0)
+				retval = -EFAULT;
+			break;
+		}
+
+		// Update position
+		nCopied += nRead;
+		pos += nRead;
+		pEntry = aesd_circular_buffer_find_entry_offset_for_fpos(&pDev->cb, pos, &offset);
+	}
 
 	// Return number of bytes read
-	retval = nRead;
+	if (nCopied != 0)
+		retval = nCopied;
 
 done:
+	// evicted_seen has moved on, the position must move with it on every path
+	iocb->ki_pos = pos;
 	mutex_unlock(&pDev->drv_mutex);
+	trace_aesd_read(pDev->minor, count, pos, retval);
 	return retval; 
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-						 loff_t *f_pos)
+/**
+ * @brief Add one queued record to the circular buffer of @param pDev.  On return
+ *  @param pPending holds the record it evicted, or a NULL buffptr if nothing was
+ *  evicted.  Caller must hold drv_mutex.
+ */
+static void aesd_commit_locked(struct aesd_dev *pDev, struct aesd_pending *pPending)
+{
+	struct aesd_buffer_entry entry;
+	uint8_t slot;
+
+	aesd_buffer_entry_copy(&entry, &pPending->entry);
+	pPending->entry.buffptr = NULL;
+	pPending->entry.size = 0;
+	if (pDev->cb.full)
+	{
+		aesd_buffer_entry_copy(&pPending->entry, &pDev->cb.entry[pDev->cb.out_offs]);
+		pDev->evicted += pPending->entry.size;
+		pDev->stats.evictions++;
+		pDev->stats.bytes_held -= pPending->entry.size;
+	}
+	slot = pDev->cb.in_offs;
+	aesd_circular_buffer_add_entry(&pDev->cb, &entry);
+	aesd_mmap_commit(pDev, slot, &entry);
+	WRITE_ONCE(pDev->commits, pDev->commits + 1);
+
+	pDev->stats.records++;
+	pDev->stats.bytes += entry.size;
+	pDev->stats.bytes_held += entry.size;
+	trace_aesd_commit(pDev->minor, entry.size, pPending->entry.size);
+}
+
+/**
+ * @brief Queue the completed records @param pFirst to @param pLast, linked newest
+ *  first, on this CPU's pending list of the device, then commit every queued
+ *  record to the circular buffer.
+ *
+ *  Writers only meet on the device lock for the batch commit, which does no
+ *  allocation or user copies.  A writer whose records were already committed by
+ *  another writer's batch finds its queues empty.  Either way the records are in
+ *  the circular buffer when this returns.  Evicted records are recycled into the
+ *  spare of @param pFile or freed after the lock is released.
+ */
+static void aesd_commit(struct aesd_file *pFile, struct aesd_pending *pFirst, struct aesd_pending *pLast)
+{
+	struct aesd_dev *pDev = pFile->dev;
+	struct llist_node *pBatch;
+	struct llist_node *pDone = NULL;
+	struct aesd_pending *pItem;
+	struct aesd_pending *pTmp;
+	int cpu;
+
+	llist_add_batch(&pFirst->node, &pLast->node, raw_cpu_ptr(pDev->pending));
+
+	aesd_lock(pDev);
+	for_each_possible_cpu(cpu)
+	{
+		// Queues are LIFO, reverse to commit in arrival order
+		pBatch = llist_reverse_order(llist_del_all(per_cpu_ptr(pDev->pending, cpu)));
+		llist_for_each_entry_safe(pItem, pTmp, pBatch, node)
+		{
+			aesd_commit_locked(pDev, pItem);
+			pItem->node.next = pDone;
+			pDone = &pItem->node;
+		}
+	}
+	mutex_unlock(&pDev->drv_mutex);
+
+	// Wake readers waiting for a new record
+	if (pDone != NULL)
+		wake_up_interruptible(&pDev->read_wq);
+
+	// Reuse or free the evicted records and the queue nodes
+	llist_for_each_entry_safe(pItem, pTmp, pDone, node)
+	{
+		if (pItem->entry.buffptr != NULL)
+			aesd_record_recycle(pFile, &pItem->entry);
+		kmem_cache_free(aesd_pending_cache, pItem);
+	}
+}
+
+/**
+ * @brief Copy the record of @param size bytes at @param pStart into its own storage
+ *  and link it in front of the list headed by @param ppFirst.  Records that fit
+ *  in the queue node's entry are stored inline and need no record allocation.
+ *
+ * @return true on success, false if out of memory
+ */
+static bool aesd_queue_record(struct aesd_file *pFile, const char *pStart, size_t size,
+							  struct aesd_pending **ppFirst)
+{
+	struct aesd_pending *pPending;
+	char *pRecord;
+
+	pPending = kmem_cache_alloc(aesd_pending_cache, GFP_KERNEL);
+	if (pPending == NULL)
+		return false;
+	if (!aesd_buffer_entry_set(&pPending->entry, pStart, size))
+	{
+		pRecord = aesd_record_alloc(pFile, size);
+		if (pRecord == NULL)
+		{
+			kmem_cache_free(aesd_pending_cache, pPending);
+			return false;
+		}
+		memcpy(pRecord, pStart, size);
+		pPending->entry.buffptr = pRecord;
+	}
+
+	pPending->node.next = (*ppFirst != NULL) ? &(*ppFirst)->node : NULL;
+	*ppFirst = pPending;
+	return true;
+}
+
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
 	ssize_t retval = -ENOMEM;
-	struct aesd_dev *pDev = (struct aesd_dev *)filp->private_data; // Get access to device driver
-	ssize_t nWrite;
-	const char* pFree_entry = NULL;
-	PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
-	
-	// Acquire device mutex
-	retval = mutex_lock_interruptible(&pDev->drv_mutex);
+	struct aesd_file *pFile = (struct aesd_file *)iocb->ki_filp->private_data;
+	struct aesd_dev *pDev = pFile->dev; // Get access to device driver
+	struct aesd_pending *pFirst = NULL;
+	struct aesd_pending *pLast = NULL;
+	size_t count = iov_iter_count(from);
+	size_t staged;
+	size_t nWrite;
+	char *pStart;
+	char *pScan;
+	char *pEnd;
+	char *pEol;
+
+	// Acquire file mutex, the device mutex is only needed to commit records
+	retval = mutex_lock_interruptible(&pFile->lock);
 	if (retval < 0)
 	{
 		PDEBUG("Failed to acquire lock");
 		return retval;
 	}
 
-	// Check the current size of memory and allocate/reallocate as necessary
-	if(pDev->entry.size == 0)
+	if (count == 0)
+		goto done;
+
+	// Continue a partial write left by a file which has been closed
+	if ((pFile->staging_size == 0) && (READ_ONCE(pDev->entry.size) != 0))
+		aesd_staging_adopt(pFile);
+
+	// Make room for the new bytes
+	retval = aesd_staging_reserve(pFile, count);
+	if (retval < 0)
+		goto done;
+
+	// Copy every iovec from user space to kernel space
+	nWrite = copy_from_iter(&pFile->staging[pFile->staging_size], count, from);
+	if (nWrite == 0)
 	{
-		// Allocate memory
-		pDev->entry.buffptr = kzalloc((sizeof(char) * count), GFP_KERNEL);
+		retval = -EFAULT;
+		goto done;
+	}
 
-		// Check for allocation fail
-		if (pDev->entry.buffptr == 0)
+	// Update staging size
+	staged = pFile->staging_size;
+	pFile->staging_size += nWrite;
+	retval = nWrite;
+
+	// Each newline terminates a record, only bytes not scanned before are searched
+	pStart = pFile->staging;
+	pScan = &pFile->staging[pFile->staging_scanned];
+	pEnd = &pFile->staging[pFile->staging_size];
+	while ((pEol = memchr(pScan, '\n', pEnd - pScan)) != NULL)
+	{
+		if (!aesd_queue_record(pFile, pStart, pEol + 1 - pStart, &pFirst))
+			break;
+		if (pLast == NULL)
+			pLast = pFirst;
+		pStart = pScan = pEol + 1;
+	}
+
+	// Out of memory, only accept the bytes of this write up to the last record queued
+	if (pEol != NULL)
+	{
+		if ((size_t)(pStart - pFile->staging) > staged)
+		{
+			retval = (pStart - pFile->staging) - staged;
+			pEnd = pStart;
+		}
+		else
 		{
-			// Failled to allocate memory
 			retval = -ENOMEM;
-			goto done;
+			pEnd = &pFile->staging[staged];
 		}
 	}
-	else
+
+	if (pFirst != NULL)
+		aesd_commit(pFile, pFirst, pLast);
+
+	// Keep the unterminated tail at the start of the staging buffer
+	pFile->staging_size = pEnd - pStart;
+	pFile->staging_scanned = (pEol == NULL) ? pFile->staging_size : 0;
+	if (pStart != pFile->staging)
+		memmove(pFile->staging, pStart, pFile->staging_size);
+
+	// Drop the staging buffer if a large record grew it
+	if ((pFile->staging_size == 0) && (pFile->staging_capacity > AESD_STAGING_KEEP_SIZE))
 	{
-		// Re-allocate memory
-		pDev->entry.buffptr = krealloc(pDev->entry.buffptr, (pDev->entry.size + count), GFP_KERNEL);
+		kfree(pFile->staging);
+		pFile->staging = NULL;
+		pFile->staging_capacity = 0;
+	}
 
-		// Check for re-allocation fail
-		if (pDev->entry.buffptr == 0)
-		{
-			goto done;
-		}
+done:
+	mutex_unlock(&pFile->lock);
+	trace_aesd_write(pDev->minor, count, iocb->ki_pos, retval);
+	return retval;
+}
+
+/**
+ * @brief Number of records held in the circular buffer of @param pDev.
+ *  Caller must hold drv_mutex.
+ */
+static uint8_t aesd_buffer_count(struct aesd_dev *pDev)
+{
+	if (pDev->cb.full)
+		return AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+
+	return (pDev->cb.in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - pDev->cb.out_offs) %
+		   AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+ * @brief Total number of bytes held in the circular buffer of @param pDev.
+ *  Caller must hold drv_mutex.
+ */
+static size_t aesd_buffer_size(struct aesd_dev *pDev)
+{
+	uint8_t index;
+	size_t total = 0;
+	struct aesd_buffer_entry *pEntry;
+
+	AESD_CIRCULAR_BUFFER_FOREACH(pEntry, &pDev->cb, index)
+	{
+		total += pEntry->size;
 	}
+	return total;
+}
 
-	// Copy from user space to kernel space
-	nWrite = copy_from_user((void *)(&pDev->entry.buffptr[pDev->entry.size]), buf, count);
+loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
+{
+	loff_t retval;
+	struct aesd_file *pFile = (struct aesd_file *)filp->private_data;
+	struct aesd_dev *pDev = pFile->dev;
+
+	PDEBUG("llseek %lld whence %d", offset, whence);
 
-	// Calculate the number of bytes of byte remaining to write
-	retval = count - nWrite;
+	if (aesd_lock_interruptible(pDev) != 0)
+		return -ERESTARTSYS;
 
-	// Update entry size
-	pDev->entry.size += retval;
+	// SEEK_SET, SEEK_CUR and SEEK_END over the bytes currently buffered
+	aesd_sync_pos(pFile, &filp->f_pos);
+	retval = fixed_size_llseek(filp, offset, whence, aesd_buffer_size(pDev));
 
-	// Check for termination
-	if (memchr(pDev->entry.buffptr, '\n', pDev->entry.size) != NULL)
+	mutex_unlock(&pDev->drv_mutex);
+	return retval;
+}
+
+/**
+ * @brief Move the file position of @param filp to byte @param write_cmd_offset of
+ *  record @param write_cmd, both zero referenced from the oldest record held.
+ *
+ * @return 0 on success, -EINVAL if the record or offset is not in the buffer
+ */
+static long aesd_adjust_file_offset(struct file *filp, uint32_t write_cmd, uint32_t write_cmd_offset)
+{
+	long retval = 0;
+	struct aesd_file *pFile = (struct aesd_file *)filp->private_data;
+	struct aesd_dev *pDev = pFile->dev;
+	uint8_t offset;
+	uint32_t i;
+	loff_t pos = 0;
+
+	if (aesd_lock_interruptible(pDev) != 0)
+		return -ERESTARTSYS;
+
+	if (write_cmd >= aesd_buffer_count(pDev))
 	{
-		// Add new entry
-		pFree_entry = aesd_circular_buffer_add_entry(&pDev->cb, &pDev->entry);
+		retval = -EINVAL;
+		goto done;
+	}
 
-		// Free memory returned
-		if (pFree_entry != NULL)
-			kfree(pFree_entry);
+	// Sum the records before the requested one
+	offset = pDev->cb.out_offs;
+	for (i = 0; i < write_cmd; i++)
+	{
+		pos += pDev->cb.entry[offset].size;
+		if ((++offset) >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+			offset = 0;
+	}
 
-		// Reset size and buffer pointer
-		pDev->entry.size = 0;
-		pDev->entry.buffptr = 0;
+	if (write_cmd_offset >= pDev->cb.entry[offset].size)
+	{
+		retval = -EINVAL;
+		goto done;
 	}
 
-	// Reset position
-	*f_pos = 0;
+	filp->f_pos = pos + write_cmd_offset;
+	pFile->evicted_seen = pDev->evicted;
 
 done:
 	mutex_unlock(&pDev->drv_mutex);
 	return retval;
 }
+
+long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct aesd_seekto seekto;
+	struct aesd_file *pFile = (struct aesd_file *)filp->private_data;
+	uint32_t follow;
+
+	PDEBUG("ioctl cmd %u", cmd);
+
+	if ((_IOC_TYPE(cmd) != AESD_IOC_MAGIC) || (_IOC_NR(cmd) > AESDCHAR_IOC_MAXNR))
+		return -ENOTTY;
+
+	switch (cmd)
+	{
+	case AESDCHAR_IOCSEEKTO:
+		if (copy_from_user(&seekto, (const void __user *)arg, sizeof(seekto)) != 0)
+			return -EFAULT;
+		return aesd_adjust_file_offset(filp, seekto.write_cmd, seekto.write_cmd_offset);
+
+	case AESDCHAR_IOCFOLLOW:
+		if (get_user(follow, (uint32_t __user *)arg) != 0)
+			return -EFAULT;
+		pFile->follow = (follow != 0);
+		return 0;
+
+	default:
+		return -ENOTTY;
+	}
+}
+
+__poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM; // Writes never block
+	struct aesd_file *pFile = (struct aesd_file *)filp->private_data;
+	struct aesd_dev *pDev = pFile->dev;
+	loff_t pos = filp->f_pos;
+	u64 dropped;
+
+	poll_wait(filp, &pDev->read_wq, wait);
+
+	// Readable when there is data past the file position
+	aesd_lock(pDev);
+	dropped = pDev->evicted - pFile->evicted_seen;
+	pos = (pos > dropped) ? (pos - dropped) : 0;
+	if (pos < aesd_buffer_size(pDev))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	mutex_unlock(&pDev->drv_mutex);
+
+	return mask;
+}
+
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct aesd_file *pFile = (struct aesd_file *)filp->private_data;
+	struct aesd_dev *pDev = pFile->dev;
+
+	PDEBUG("mmap %lu bytes at page %lu", vma->vm_end - vma->vm_start, vma->vm_pgoff);
+
+	// The mapping is read only, records are only added through write()
+	if (vma->vm_flags & VM_WRITE)
+		return -EACCES;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	return remap_vmalloc_range(vma, pDev->mmap_area, vma->vm_pgoff);
+}
+
 struct file_operations aesd_fops = {
 	 .owner = THIS_MODULE,
-	 .read = aesd_read,
-	 .write = aesd_write,
+	 .llseek = aesd_llseek,
+	 .read_iter = aesd_read_iter,
+	 .write_iter = aesd_write_iter,
 	 .open = aesd_open,
 	 .release = aesd_release,
+	 .unlocked_ioctl = aesd_unlocked_ioctl,
+	 .poll = aesd_poll,
+	 .mmap = aesd_mmap,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_setup_cdev(struct aesd_dev *dev, int index)
 {
-	int err, devno = MKDEV(aesd_major, aesd_minor);
+	int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
 	cdev_init(&dev->cdev, &aesd_fops);
 	dev->cdev.owner = THIS_MODULE;
@@ -192,16 +818,287 @@ static int aesd_setup_cdev(struct aesd_dev *dev)
 	err = cdev_add(&dev->cdev, devno, 1);
 	if (err)
 	{
-		printk(KERN_ERR "Error %d adding aesd cdev", err);
+		printk(KERN_ERR "Error %d adding aesd cdev %d", err, index);
 	}
 	return err;
 }
 
+/**
+ * @brief Create the debugfs directory holding the counters of @param pDev
+ */
+static void aesd_debugfs_create(struct aesd_dev *pDev)
+{
+	char name[16];
+
+	snprintf(name, sizeof(name), "aesdchar%u", pDev->minor);
+	pDev->debugfs = debugfs_create_dir(name, aesd_debugfs_root);
+	debugfs_create_u64("records", 0444, pDev->debugfs, &pDev->stats.records);
+	debugfs_create_u64("bytes", 0444, pDev->debugfs, &pDev->stats.bytes);
+	debugfs_create_u64("evictions", 0444, pDev->debugfs, &pDev->stats.evictions);
+	debugfs_create_u64("lock_wait_ns", 0444, pDev->debugfs, &pDev->stats.lock_wait_ns);
+	debugfs_create_u64("bytes_held", 0444, pDev->debugfs, &pDev->stats.bytes_held);
+}
+
+/**
+ * @brief Initialize device @param index, including its circular buffer, lock and mmap area,
+ *  and make it live.
+ *
+ * @return 0 on success or a negative errno
+ */
+static int aesd_setup_dev(struct aesd_dev *pDev, int index)
+{
+	int result;
+	int cpu;
+
+	pDev->minor = aesd_minor + index;
+
+	// Initialize the mutex and the queue of waiting readers
+	mutex_init(&pDev->drv_mutex);
+	init_waitqueue_head(&pDev->read_wq);
+
+	// Initialize the circular buffer
+	aesd_circular_buffer_init(&pDev->cb);
+
+	// Allocate the per CPU queues of records waiting to be committed
+	pDev->pending = alloc_percpu(struct llist_head);
+	if (pDev->pending == NULL)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu)
+		init_llist_head(per_cpu_ptr(pDev->pending, cpu));
+
+	// Allocate the zeroed, user mappable area mirroring the circular buffer
+	pDev->mmap_area = vmalloc_user(AESD_MMAP_SIZE);
+	if (pDev->mmap_area == NULL)
+	{
+		free_percpu(pDev->pending);
+		return -ENOMEM;
+	}
+	aesd_byte_ring_init(&pDev->mmap_ring, (char *)pDev->mmap_area + AESD_MMAP_HEADER_SIZE, AESD_MMAP_DATA_SIZE);
+
+	result = aesd_setup_cdev(pDev, index);
+	if (result)
+	{
+		vfree(pDev->mmap_area);
+		free_percpu(pDev->pending);
+		return result;
+	}
+
+	aesd_debugfs_create(pDev);
+	return 0;
+}
+
+/**
+ * @brief Remove a device set up by aesd_setup_dev() and free everything it holds
+ */
+static void aesd_teardown_dev(struct aesd_dev *pDev)
+{
+	uint8_t index;
+	struct aesd_buffer_entry *pEntry;
+
+	debugfs_remove_recursive(pDev->debugfs);
+	cdev_del(&pDev->cdev);
+
+	// Free all allocated memory in the circular buffer
+	AESD_CIRCULAR_BUFFER_FOREACH(pEntry, &pDev->cb, index)
+	{
+		aesd_record_put(pEntry);
+	}
+	kfree(pDev->entry.buffptr);
+	vfree(pDev->mmap_area);
+	free_percpu(pDev->pending);
+}
+
+/**
+ * @brief Add a record restored from the backing file to @param pDev
+ *
+ * @return true on success, false if out of memory
+ */
+static bool aesd_backing_restore_record(struct aesd_dev *pDev, const char *pData, size_t size)
+{
+	struct aesd_pending pending;
+	char *pRecord;
+
+	if (!aesd_buffer_entry_set(&pending.entry, pData, size))
+	{
+		pRecord = aesd_record_alloc(NULL, size);
+		if (pRecord == NULL)
+			return false;
+		memcpy(pRecord, pData, size);
+		pending.entry.buffptr = pRecord;
+	}
+
+	aesd_lock(pDev);
+	aesd_commit_locked(pDev, &pending);
+	mutex_unlock(&pDev->drv_mutex);
+
+	// Free the record evicted, if any
+	aesd_record_put(&pending.entry);
+	return true;
+}
+
+/**
+ * @brief Read a u32 at *@param pOffs of the @param size byte buffer @param pBuf and advance past it
+ *
+ * @return false if the buffer is too short
+ */
+static bool aesd_backing_get_u32(const char *pBuf, size_t size, size_t *pOffs, u32 *pValue)
+{
+	if ((size < sizeof(u32)) || (*pOffs > size - sizeof(u32)))
+		return false;
+
+	memcpy(pValue, &pBuf[*pOffs], sizeof(u32));
+	*pOffs += sizeof(u32);
+	return true;
+}
+
+/**
+ * @brief Restore the history of every device from aesd_backing_file, if set.
+ *  The file is read in a single call and a missing file is not an error.
+ */
+static void aesd_backing_restore(void)
+{
+	struct file *pBacking;
+	const struct aesd_backing_header *pHdr;
+	char *pBuf = NULL;
+	loff_t size;
+	loff_t pos = 0;
+	size_t offs;
+	u32 dev;
+	u32 nRecords;
+	u32 recSize;
+
+	if (aesd_backing_file == NULL)
+		return;
+
+	pBacking = filp_open(aesd_backing_file, O_RDONLY, 0);
+	if (IS_ERR(pBacking))
+	{
+		if (PTR_ERR(pBacking) != -ENOENT)
+			printk(KERN_WARNING "aesdchar: can't open %s, error %ld\n", aesd_backing_file, PTR_ERR(pBacking));
+		return;
+	}
+
+	size = i_size_read(file_inode(pBacking));
+	if (size < (loff_t)sizeof(struct aesd_backing_header))
+		goto corrupt;
+
+	pBuf = kvmalloc(size, GFP_KERNEL | __GFP_NOWARN);
+	if (pBuf == NULL)
+	{
+		printk(KERN_WARNING "aesdchar: no memory to restore %lld bytes of history\n", size);
+		goto done;
+	}
+	if (kernel_read(pBacking, pBuf, size, &pos) != size)
+		goto corrupt;
+
+	pHdr = (const struct aesd_backing_header *)pBuf;
+	if ((memcmp(pHdr->magic, AESD_BACKING_MAGIC, sizeof(pHdr->magic)) != 0) ||
+		(pHdr->version != AESD_BACKING_VERSION))
+		goto corrupt;
+
+	// Devices beyond aesd_nr_devs are dropped
+	offs = sizeof(struct aesd_backing_header);
+	for (dev = 0; (dev < pHdr->nr_devs) && (dev < aesd_nr_devs); dev++)
+	{
+		if (!aesd_backing_get_u32(pBuf, size, &offs, &nRecords))
+			goto corrupt;
+
+		while (nRecords-- > 0)
+		{
+			if (!aesd_backing_get_u32(pBuf, size, &offs, &recSize) || (recSize == 0) || (recSize > size - offs))
+				goto corrupt;
+			if (!aesd_backing_restore_record(&aesd_devices[dev], &pBuf[offs], recSize))
+				goto done;
+			offs += recSize;
+		}
+	}
+	goto done;
+
+corrupt:
+	printk(KERN_WARNING "aesdchar: ignoring invalid backing file %s\n", aesd_backing_file);
+done:
+	kvfree(pBuf);
+	filp_close(pBacking, NULL);
+}
+
+/**
+ * @brief Write @param size bytes at @param pData to @param pBacking at *@param pPos
+ *
+ * @return false on a write error
+ */
+static bool aesd_backing_write(struct file *pBacking, loff_t *pPos, const void *pData, size_t size)
+{
+	return kernel_write(pBacking, pData, size, pPos) == (ssize_t)size;
+}
+
+/**
+ * @brief Save the history of every device to aesd_backing_file, if set.
+ *  Called on unload when no file is open any more.
+ */
+static void aesd_backing_save(void)
+{
+	struct file *pBacking;
+	struct aesd_backing_header hdr;
+	struct aesd_dev *pDev;
+	loff_t pos = 0;
+	unsigned int i;
+	u32 nRecords;
+	u32 recSize;
+	uint8_t offset;
+
+	if (aesd_backing_file == NULL)
+		return;
+
+	pBacking = filp_open(aesd_backing_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (IS_ERR(pBacking))
+	{
+		printk(KERN_WARNING "aesdchar: can't create %s, error %ld\n", aesd_backing_file, PTR_ERR(pBacking));
+		return;
+	}
+
+	memcpy(hdr.magic, AESD_BACKING_MAGIC, sizeof(hdr.magic));
+	hdr.version = AESD_BACKING_VERSION;
+	hdr.nr_devs = aesd_nr_devs;
+	if (!aesd_backing_write(pBacking, &pos, &hdr, sizeof(hdr)))
+		goto fail;
+
+	for (i = 0; i < aesd_nr_devs; i++)
+	{
+		pDev = &aesd_devices[i];
+		nRecords = aesd_buffer_count(pDev);
+		if (!aesd_backing_write(pBacking, &pos, &nRecords, sizeof(nRecords)))
+			goto fail;
+
+		// Oldest record first
+		for (offset = pDev->cb.out_offs; nRecords > 0; nRecords--)
+		{
+			recSize = pDev->cb.entry[offset].size;
+			if (!aesd_backing_write(pBacking, &pos, &recSize, sizeof(recSize)) ||
+				!aesd_backing_write(pBacking, &pos, pDev->cb.entry[offset].buffptr, recSize))
+				goto fail;
+			if ((++offset) >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+				offset = 0;
+		}
+	}
+
+	filp_close(pBacking, NULL);
+	return;
+
+fail:
+	printk(KERN_WARNING "aesdchar: failed to write %s\n", aesd_backing_file);
+	filp_close(pBacking, NULL);
+}
+
 int aesd_init_module(void)
 {
 	dev_t dev = 0;
 	int result;
-	result = alloc_chrdev_region(&dev, aesd_minor, 1,
+	unsigned int i;
+
+	if (aesd_nr_devs == 0)
+		return -EINVAL;
+
+	result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devs,
 										  "aesdchar");
 	aesd_major = MAJOR(dev);
 	if (result < 0)
@@ -209,33 +1106,78 @@ int aesd_init_module(void)
 		printk(KERN_WARNING "Can't get major %d\n", aesd_major);
 		return result;
 	}
-	memset(&aesd_device, 0, sizeof(struct aesd_dev));
 
-	// Initialize the mutex
-	mutex_init(&aesd_device.drv_mutex);
+	aesd_devices = kcalloc(aesd_nr_devs, sizeof(struct aesd_dev), GFP_KERNEL);
+	if (aesd_devices == NULL)
+	{
+		unregister_chrdev_region(dev, aesd_nr_devs);
+		return -ENOMEM;
+	}
 
-	// Initialize the circular buffer
-	aesd_circular_buffer_init(&aesd_device.cb);
+	// Create the cache used for small records
+	BUILD_BUG_ON(sizeof(struct aesd_mmap_header) > AESD_MMAP_HEADER_SIZE);
+	aesd_record_cache = kmem_cache_create_usercopy("aesd_record", AESD_RECORD_SMALL_SIZE, 0, 0,
+												   0, AESD_RECORD_SMALL_SIZE, NULL);
+	if (aesd_record_cache == NULL)
+	{
+		result = -ENOMEM;
+		goto fail_cache;
+	}
+
+	// Create the cache used for queued records
+	aesd_pending_cache = KMEM_CACHE(aesd_pending, 0);
+	if (aesd_pending_cache == NULL)
+	{
+		result = -ENOMEM;
+		goto fail_pending_cache;
+	}
 
-	result = aesd_setup_cdev(&aesd_device);
+	// Counters are optional, debugfs failures are not fatal
+	aesd_debugfs_root = debugfs_create_dir("aesdchar", NULL);
 
-	if (result)
+	// Each minor gets its own buffer, lock and mmap area
+	for (i = 0; i < aesd_nr_devs; i++)
 	{
-		unregister_chrdev_region(dev, 1);
+		result = aesd_setup_dev(&aesd_devices[i], i);
+		if (result)
+			goto fail_dev;
 	}
+
+	// Reload the history saved by the previous unload
+	aesd_backing_restore();
+
+	return 0;
+
+fail_dev:
+	while (i-- > 0)
+		aesd_teardown_dev(&aesd_devices[i]);
+	debugfs_remove_recursive(aesd_debugfs_root);
+	kmem_cache_destroy(aesd_pending_cache);
+fail_pending_cache:
+	kmem_cache_destroy(aesd_record_cache);
+fail_cache:
+	kfree(aesd_devices);
+	unregister_chrdev_region(dev, aesd_nr_devs);
 	return result;
 }
 
 void aesd_cleanup_module(void)
 {
 	dev_t devno = MKDEV(aesd_major, aesd_minor);
+	unsigned int i;
 
-	cdev_del(&aesd_device.cdev);
+	// Keep the history for the next load
+	aesd_backing_save();
 
-	// Free all allocated memory in the circular buffer
-	aesd_circular_buffer_deinit(&aesd_device.cb);
+	for (i = 0; i < aesd_nr_devs; i++)
+		aesd_teardown_dev(&aesd_devices[i]);
+
+	debugfs_remove_recursive(aesd_debugfs_root);
+	kfree(aesd_devices);
+	kmem_cache_destroy(aesd_pending_cache);
+	kmem_cache_destroy(aesd_record_cache);
 	
-	unregister_chrdev_region(devno, 1);
+	unregister_chrdev_region(devno, aesd_nr_devs);
 }
 
 module_init(aesd_init_module);
@@ -0,0 +1,191 @@
+/**
+ * @file aesd-record-queue.c
+ * @author Kenneth A. Jones
+ * @date 2022-03-20
+ *
+ * @brief Lock-free single and multi producer record queues.
+ *
+ *      The multi producer queue follows Dmitry Vyukov's bounded MPMC queue
+ *      (https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue)
+ *      restricted to a single consumer.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+// ============================================================================
+// INCLUDES
+// ============================================================================
+#include <stdlib.h>
+#include <string.h>
+
+#include "aesd-record-queue.h"
+
+// ============================================================================
+// STATIC FUNCTION PROTOTYPES
+// ============================================================================
+
+/**
+ * @brief Round @param capacity up to a power of two, at least 2
+ */
+static size_t round_capacity(size_t capacity);
+
+// ============================================================================
+// GLOBAL FUNCTIONS
+// ============================================================================
+
+bool aesd_spsc_queue_init(struct aesd_spsc_queue *queue, size_t capacity)
+{
+    capacity = round_capacity(capacity);
+
+    memset(queue, 0, sizeof(*queue));
+    queue->entry = (struct aesd_buffer_entry *)calloc(capacity, sizeof(struct aesd_buffer_entry));
+    if (queue->entry == NULL)
+        return false;
+
+    queue->mask = capacity - 1;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    return true;
+}
+
+void aesd_spsc_queue_deinit(struct aesd_spsc_queue *queue)
+{
+    free(queue->entry);
+    queue->entry = NULL;
+}
+
+bool aesd_spsc_queue_push(struct aesd_spsc_queue *queue, const struct aesd_buffer_entry *entry)
+{
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+    // Only look at the consumer's index when the cached one says the queue is full
+    if ((tail - queue->head_cache) > queue->mask)
+    {
+        queue->head_cache = atomic_load_explicit(&queue->head, memory_order_acquire);
+        if ((tail - queue->head_cache) > queue->mask)
+            return false;
+    }
+
+    aesd_buffer_entry_copy(&queue->entry[tail & queue->mask], entry);
+
+    // Publish the entry
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+bool aesd_spsc_queue_pop(struct aesd_spsc_queue *queue, struct aesd_buffer_entry *entry)
+{
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+    // Only look at the producer's index when the cached one says the queue is empty
+    if (head == queue->tail_cache)
+    {
+        queue->tail_cache = atomic_load_explicit(&queue->tail, memory_order_acquire);
+        if (head == queue->tail_cache)
+            return false;
+    }
+
+    aesd_buffer_entry_copy(entry, &queue->entry[head & queue->mask]);
+
+    // Hand the slot back to the producer
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return true;
+}
+
+bool aesd_mpsc_queue_init(struct aesd_mpsc_queue *queue, size_t capacity)
+{
+    size_t i;
+
+    capacity = round_capacity(capacity);
+
+    memset(queue, 0, sizeof(*queue));
+    queue->slot = (struct aesd_mpsc_slot *)calloc(capacity, sizeof(struct aesd_mpsc_slot));
+    if (queue->slot == NULL)
+        return false;
+
+    // Slot i is free for the producer claiming index i
+    for (i = 0; i < capacity; i++)
+        atomic_init(&queue->slot[i].seq, i);
+
+    queue->mask = capacity - 1;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    return true;
+}
+
+void aesd_mpsc_queue_deinit(struct aesd_mpsc_queue *queue)
+{
+    free(queue->slot);
+    queue->slot = NULL;
+}
+
+bool aesd_mpsc_queue_push(struct aesd_mpsc_queue *queue, const struct aesd_buffer_entry *entry)
+{
+    struct aesd_mpsc_slot *slot;
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t seq;
+    ptrdiff_t diff;
+
+    while (1)
+    {
+        slot = &queue->slot[tail & queue->mask];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        diff = (ptrdiff_t)seq - (ptrdiff_t)tail;
+
+        if (diff == 0)
+        {
+            // Slot is free, try to claim index tail
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &tail, tail + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+            // tail was reloaded by the failed exchange
+        }
+        else if (diff < 0)
+        {
+            // Slot still holds an entry from the previous lap, the queue is full
+            return false;
+        }
+        else
+        {
+            // Another producer claimed this index, catch up
+            tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+    }
+
+    aesd_buffer_entry_copy(&slot->entry, entry);
+
+    // Publish the entry to the consumer
+    atomic_store_explicit(&slot->seq, tail + 1, memory_order_release);
+    return true;
+}
+
+bool aesd_mpsc_queue_pop(struct aesd_mpsc_queue *queue, struct aesd_buffer_entry *entry)
+{
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    struct aesd_mpsc_slot *slot = &queue->slot[head & queue->mask];
+
+    // The slot is ready once its producer has published it
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != head + 1)
+        return false;
+
+    aesd_buffer_entry_copy(entry, &slot->entry);
+
+    // Free the slot for the producer of the next lap
+    atomic_store_explicit(&slot->seq, head + queue->mask + 1, memory_order_release);
+    atomic_store_explicit(&queue->head, head + 1, memory_order_relaxed);
+    return true;
+}
+
+// ============================================================================
+// STATIC FUNCTIONS
+// ============================================================================
+
+size_t round_capacity(size_t capacity)
+{
+    size_t rounded = 2;
+
+    while (rounded < capacity)
+        rounded <<= 1;
+    return rounded;
+}
@@ -0,0 +1,157 @@
+/**
+ * @file aesd-record-queue.h
+ * @author Kenneth A. Jones
+ * @date 2022-03-20
+ *
+ * @brief Lock-free userspace record queues built on struct aesd_buffer_entry.
+ *
+ *      Two bounded queue variants are provided, both with a single consumer:
+ *      - aesd_spsc_queue: single producer
+ *      - aesd_mpsc_queue: any number of concurrent producers
+ *
+ *      Entries are copied in and out with aesd_buffer_entry_copy(), so inline
+ *      records travel with the entry and ownership of the memory pointed to by an
+ *      external buffptr moves from the producer to the consumer.  The
+ *      producer and consumer indices live on separate cache lines so the two
+ *      sides do not false share.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef AESD_RECORD_QUEUE_H
+#define AESD_RECORD_QUEUE_H
+
+// ============================================================================
+// INCLUDES
+// ============================================================================
+#include <stdatomic.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+
+// ============================================================================
+// PUBLIC MACROS AND DEFINES
+// ============================================================================
+
+// Assumed cache line size used to separate producer and consumer state
+#define AESD_RECORD_QUEUE_CACHE_LINE 64
+
+// ============================================================================
+// PUBLIC TYPEDEFS
+// ============================================================================
+
+struct aesd_spsc_queue
+{
+    /**
+     * Index of the next entry to pop, written by the consumer only
+     */
+    alignas(AESD_RECORD_QUEUE_CACHE_LINE) atomic_size_t head;
+    /**
+     * Consumer's last seen value of tail, avoids reading the producer's line on every pop
+     */
+    size_t tail_cache;
+    /**
+     * Index of the next entry to push, written by the producer only
+     */
+    alignas(AESD_RECORD_QUEUE_CACHE_LINE) atomic_size_t tail;
+    /**
+     * Producer's last seen value of head, avoids reading the consumer's line on every push
+     */
+    size_t head_cache;
+    /**
+     * Read only after initialization
+     */
+    alignas(AESD_RECORD_QUEUE_CACHE_LINE) size_t mask;
+    struct aesd_buffer_entry *entry;
+};
+
+struct aesd_mpsc_slot
+{
+    /**
+     * Slot sequence number, tells producers and the consumer whose turn the slot is
+     */
+    atomic_size_t seq;
+    struct aesd_buffer_entry entry;
+};
+
+struct aesd_mpsc_queue
+{
+    /**
+     * Index of the next slot to pop, written by the consumer only
+     */
+    alignas(AESD_RECORD_QUEUE_CACHE_LINE) atomic_size_t head;
+    /**
+     * Index of the next slot to claim, shared by all producers
+     */
+    alignas(AESD_RECORD_QUEUE_CACHE_LINE) atomic_size_t tail;
+    /**
+     * Read only after initialization
+     */
+    alignas(AESD_RECORD_QUEUE_CACHE_LINE) size_t mask;
+    struct aesd_mpsc_slot *slot;
+};
+
+// ============================================================================
+// PUBLIC FUNCTIONS
+// ============================================================================
+
+/**
+ * @brief Initialize an empty single producer queue
+ *
+ * @param queue - Queue to initialize
+ * @param capacity - Number of entries, rounded up to a power of two
+ * @return true on success, false if memory could not be allocated
+ */
+bool aesd_spsc_queue_init(struct aesd_spsc_queue *queue, size_t capacity);
+
+/**
+ * @brief Free the memory used by @param queue.  Entries still queued are not freed.
+ */
+void aesd_spsc_queue_deinit(struct aesd_spsc_queue *queue);
+
+/**
+ * @brief Append a copy of @param entry.  Only one thread may push.
+ *
+ * @return true if the entry was queued, false if the queue is full
+ */
+bool aesd_spsc_queue_push(struct aesd_spsc_queue *queue, const struct aesd_buffer_entry *entry);
+
+/**
+ * @brief Remove the oldest entry into @param entry.  Only one thread may pop.
+ *
+ * @return true if an entry was returned, false if the queue is empty
+ */
+bool aesd_spsc_queue_pop(struct aesd_spsc_queue *queue, struct aesd_buffer_entry *entry);
+
+/**
+ * @brief Initialize an empty multi producer queue
+ *
+ * @param queue - Queue to initialize
+ * @param capacity - Number of entries, rounded up to a power of two
+ * @return true on success, false if memory could not be allocated
+ */
+bool aesd_mpsc_queue_init(struct aesd_mpsc_queue *queue, size_t capacity);
+
+/**
+ * @brief Free the memory used by @param queue.  Entries still queued are not freed.
+ */
+void aesd_mpsc_queue_deinit(struct aesd_mpsc_queue *queue);
+
+/**
+ * @brief Append a copy of @param entry.  Any number of threads may push concurrently.
+ *
+ * @return true if the entry was queued, false if the queue is full
+ */
+bool aesd_mpsc_queue_push(struct aesd_mpsc_queue *queue, const struct aesd_buffer_entry *entry);
+
+/**
+ * @brief Remove the oldest entry into @param entry.  Only one thread may pop.
+ *
+ * @return true if an entry was returned, false if the queue is empty
+ */
+bool aesd_mpsc_queue_pop(struct aesd_mpsc_queue *queue, struct aesd_buffer_entry *entry);
+
+#endif /* AESD_RECORD_QUEUE_H */
@@ -0,0 +1,240 @@
+/**
+ * @file rq-bench.c
+ * @author Kenneth A. Jones
+ * @date 2022-03-20
+ *
+ * @brief Throughput benchmark of the lock-free record queues against a mutex
+ *      guarded ring of struct aesd_buffer_entry.
+ *
+ *      Usage: rq-bench [records per producer] [producers]
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+// ============================================================================
+// INCLUDES
+// ============================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+
+#include "aesd-record-queue.h"
+
+// ============================================================================
+// PRIVATE MACROS AND DEFINES
+// ============================================================================
+
+#define DEFAULT_RECORDS 1000000
+#define DEFAULT_PRODUCERS 4
+#define QUEUE_CAPACITY 1024
+
+// ============================================================================
+// PRIVATE TYPEDEFS
+// ============================================================================
+
+// Mutex guarded ring used as the baseline
+typedef struct
+{
+    pthread_mutex_t mutex;
+    struct aesd_buffer_entry entry[QUEUE_CAPACITY];
+    size_t head;
+    size_t tail;
+} LOCKED_QUEUE_T;
+
+typedef enum
+{
+    QUEUE_SPSC = 0,
+    QUEUE_MPSC,
+    QUEUE_LOCKED
+} QUEUE_TYPE_T;
+
+typedef struct
+{
+    QUEUE_TYPE_T type;
+    void *queue;
+    size_t records;
+} PRODUCER_PARAMS_T;
+
+// ============================================================================
+// STATIC VARIABLES
+// ============================================================================
+
+// Every record points at the same payload, only sizes are checked
+static const char payload[] = "AESDCHAR benchmark record\n";
+
+// ============================================================================
+// STATIC FUNCTION PROTOTYPES
+// ============================================================================
+
+static bool locked_push(LOCKED_QUEUE_T *queue, const struct aesd_buffer_entry *entry);
+static bool locked_pop(LOCKED_QUEUE_T *queue, struct aesd_buffer_entry *entry);
+static bool queue_push(QUEUE_TYPE_T type, void *queue, const struct aesd_buffer_entry *entry);
+static bool queue_pop(QUEUE_TYPE_T type, void *queue, struct aesd_buffer_entry *entry);
+static void *producer(void *args);
+static double run(const char *name, QUEUE_TYPE_T type, void *queue, size_t records, int producers);
+
+// ============================================================================
+// GLOBAL FUNCTIONS
+// ============================================================================
+
+int main(int argc, char **argv)
+{
+    size_t records = DEFAULT_RECORDS;
+    int producers = DEFAULT_PRODUCERS;
+    struct aesd_spsc_queue spsc;
+    struct aesd_mpsc_queue mpsc;
+    LOCKED_QUEUE_T locked;
+
+    if (argc >= 2)
+        records = strtoul(argv[1], NULL, 0);
+    if (argc >= 3)
+        producers = atoi(argv[2]);
+    if ((records == 0) || (producers <= 0))
+    {
+        fprintf(stderr, "Usage: %s [records per producer] [producers]\n", argv[0]);
+        return 1;
+    }
+
+    if (!aesd_spsc_queue_init(&spsc, QUEUE_CAPACITY) || !aesd_mpsc_queue_init(&mpsc, QUEUE_CAPACITY))
+    {
+        fprintf(stderr, "Error: could not allocate queues\n");
+        return 1;
+    }
+    memset(&locked, 0, sizeof(locked));
+    pthread_mutex_init(&locked.mutex, NULL);
+
+    printf("%zu records per producer, queue capacity %d\n", records, QUEUE_CAPACITY);
+    run("mutex 1 producer", QUEUE_LOCKED, &locked, records, 1);
+    run("spsc", QUEUE_SPSC, &spsc, records, 1);
+    run("mutex N producers", QUEUE_LOCKED, &locked, records, producers);
+    run("mpsc N producers", QUEUE_MPSC, &mpsc, records, producers);
+
+    pthread_mutex_destroy(&locked.mutex);
+    aesd_mpsc_queue_deinit(&mpsc);
+    aesd_spsc_queue_deinit(&spsc);
+    return 0;
+}
+
+// ============================================================================
+// STATIC FUNCTIONS
+// ============================================================================
+
+bool locked_push(LOCKED_QUEUE_T *queue, const struct aesd_buffer_entry *entry)
+{
+    bool pushed = false;
+
+    pthread_mutex_lock(&queue->mutex);
+    if ((queue->tail - queue->head) < QUEUE_CAPACITY)
+    {
+        queue->entry[queue->tail % QUEUE_CAPACITY] = *entry;
+        queue->tail++;
+        pushed = true;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return pushed;
+}
+
+bool locked_pop(LOCKED_QUEUE_T *queue, struct aesd_buffer_entry *entry)
+{
+    bool popped = false;
+
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->tail != queue->head)
+    {
+        *entry = queue->entry[queue->head % QUEUE_CAPACITY];
+        queue->head++;
+        popped = true;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return popped;
+}
+
+bool queue_push(QUEUE_TYPE_T type, void *queue, const struct aesd_buffer_entry *entry)
+{
+    switch (type)
+    {
+    case QUEUE_SPSC:
+        return aesd_spsc_queue_push((struct aesd_spsc_queue *)queue, entry);
+    case QUEUE_MPSC:
+        return aesd_mpsc_queue_push((struct aesd_mpsc_queue *)queue, entry);
+    default:
+        return locked_push((LOCKED_QUEUE_T *)queue, entry);
+    }
+}
+
+bool queue_pop(QUEUE_TYPE_T type, void *queue, struct aesd_buffer_entry *entry)
+{
+    switch (type)
+    {
+    case QUEUE_SPSC:
+        return aesd_spsc_queue_pop((struct aesd_spsc_queue *)queue, entry);
+    case QUEUE_MPSC:
+        return aesd_mpsc_queue_pop((struct aesd_mpsc_queue *)queue, entry);
+    default:
+        return locked_pop((LOCKED_QUEUE_T *)queue, entry);
+    }
+}
+
+void *producer(void *args)
+{
+    PRODUCER_PARAMS_T *pParams = (PRODUCER_PARAMS_T *)args;
+    struct aesd_buffer_entry entry;
+    size_t i;
+
+    entry.buffptr = payload;
+    for (i = 0; i < pParams->records; i++)
+    {
+        // Vary the size so the consumer can check nothing was lost or duplicated
+        entry.size = (i % (sizeof(payload) - 1)) + 1;
+        while (!queue_push(pParams->type, pParams->queue, &entry))
+            sched_yield(); // Queue full, let the consumer run
+    }
+    return NULL;
+}
+
+double run(const char *name, QUEUE_TYPE_T type, void *queue, size_t records, int producers)
+{
+    pthread_t thread[producers];
+    PRODUCER_PARAMS_T params = {type, queue, records};
+    struct aesd_buffer_entry entry;
+    struct timespec start;
+    struct timespec end;
+    size_t total = records * producers;
+    size_t expected = 0;
+    size_t sum = 0;
+    size_t i;
+    double seconds;
+
+    for (i = 0; i < records; i++)
+        expected += (i % (sizeof(payload) - 1)) + 1;
+    expected *= producers;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < (size_t)producers; i++)
+        pthread_create(&thread[i], NULL, producer, &params);
+
+    // This thread is the single consumer
+    for (i = 0; i < total;)
+    {
+        if (queue_pop(type, queue, &entry))
+        {
+            sum += entry.size;
+            i++;
+        }
+        else
+            sched_yield(); // Queue empty, let producers run
+    }
+
+    for (i = 0; i < (size_t)producers; i++)
+        pthread_join(thread[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%-20s %2d producer(s): %8.2f Mrecords/s%s\n", name, producers, total / seconds / 1e6,
+           (sum == expected) ? "" : "  ERROR: records lost or duplicated");
+    return seconds;
+}
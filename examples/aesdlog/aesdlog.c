@@ -0,0 +1,260 @@
+/**
+ * @file aesdlog.c
+ * @author Kenneth A. Jones
+ * @date 2022-03-28
+ *
+ * @brief Process wide logging to syslog, see aesdlog.h.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+// ============================================================================
+// INCLUDES
+// ============================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "aesdlog.h"
+
+// ============================================================================
+// PRIVATE MACROS AND DEFINES
+// ============================================================================
+
+// Messages the async sink can hold before new ones are dropped
+#define AESDLOG_QUEUE_SLOTS 256
+
+// Longest message kept by the async sink, longer ones are truncated
+#define AESDLOG_MAX_MESSAGE 512
+
+// ============================================================================
+// PRIVATE TYPEDEFS
+// ============================================================================
+
+struct aesdlog_message
+{
+   int level;
+   char text[AESDLOG_MAX_MESSAGE];
+};
+
+// ============================================================================
+// STATIC VARIABLES
+// ============================================================================
+
+static pthread_once_t setupOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t configLock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool shutDown;
+
+// Configuration, set by the first aesdlog_init() or by the first message logged
+static bool configured;
+static const char *configIdent;
+static int configFacility = LOG_USER;
+static int configLevel = LOG_DEBUG;
+static unsigned int configFlags;
+
+// Async sink, messages are accepted at queued and passed to syslog at written
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueNotEmpty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queueDrained = PTHREAD_COND_INITIALIZER;
+static struct aesdlog_message *queue;
+static unsigned long queued;
+static unsigned long taken;
+static unsigned long written;
+static unsigned long dropped;
+static bool sinkStop;
+static atomic_bool sinkRunning;
+static pthread_t sinkThread;
+
+// ============================================================================
+// GLOBAL VARIABLES
+// ============================================================================
+
+atomic_int aesdlog_level = LOG_DEBUG;
+
+// ============================================================================
+// STATIC FUNCTIONS
+// ============================================================================
+
+/**
+* Pass queued messages to syslog until asked to stop with the queue empty
+*/
+static void *aesdlog_sink(void *arg)
+{
+   struct aesdlog_message message;
+   unsigned long lost;
+
+   (void)arg;
+   pthread_mutex_lock(&queueLock);
+   while (true)
+   {
+      while ((taken == queued) && !sinkStop)
+         pthread_cond_wait(&queueNotEmpty, &queueLock);
+      if (taken == queued)
+         break;
+
+      message = queue[taken % AESDLOG_QUEUE_SLOTS];
+      taken++;
+      lost = dropped;
+      dropped = 0;
+      pthread_mutex_unlock(&queueLock);
+
+      if (lost > 0)
+         syslog(LOG_WARNING, "aesdlog: dropped %lu messages", lost);
+      syslog(message.level, "%s", message.text);
+
+      pthread_mutex_lock(&queueLock);
+      written++;
+      pthread_cond_broadcast(&queueDrained);
+   }
+   pthread_mutex_unlock(&queueLock);
+   return NULL;
+}
+
+/**
+* Open the syslog connection and start the sink thread, run once per process
+*/
+static void aesdlog_setup(void)
+{
+   sigset_t all;
+   sigset_t old;
+   bool async;
+
+   pthread_mutex_lock(&configLock);
+   configured = true;
+   openlog(configIdent, (configFlags & AESDLOG_STDERR) ? LOG_PERROR : 0, configFacility);
+   atomic_store(&aesdlog_level, configLevel);
+   async = (configFlags & AESDLOG_ASYNC) != 0;
+   pthread_mutex_unlock(&configLock);
+
+   if (async)
+   {
+      queue = malloc(AESDLOG_QUEUE_SLOTS * sizeof(struct aesdlog_message));
+
+      // The sink must not take signals meant for the program's own threads
+      sigfillset(&all);
+      pthread_sigmask(SIG_SETMASK, &all, &old);
+      sinkRunning = (queue != NULL) && (pthread_create(&sinkThread, NULL, aesdlog_sink, NULL) == 0);
+      pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+      // Fall back to logging from the caller
+      if (!sinkRunning)
+      {
+         free(queue);
+         queue = NULL;
+         syslog(LOG_WARNING, "aesdlog: async sink unavailable, logging synchronously");
+      }
+   }
+
+   atexit(aesdlog_shutdown);
+}
+
+// ============================================================================
+// GLOBAL FUNCTIONS
+// ============================================================================
+
+bool aesdlog_init(const char *ident, int facility, int level, unsigned int flags)
+{
+   bool applied = false;
+
+   pthread_mutex_lock(&configLock);
+   if (!configured)
+   {
+      configured = true;
+      configIdent = ident;
+      configFacility = facility;
+      configLevel = level;
+      configFlags = flags;
+      applied = true;
+   }
+   pthread_mutex_unlock(&configLock);
+
+   pthread_once(&setupOnce, aesdlog_setup);
+   return applied;
+}
+
+void aesdlog(int level, const char *format, ...)
+{
+   char text[AESDLOG_MAX_MESSAGE];
+   va_list args;
+
+   pthread_once(&setupOnce, aesdlog_setup);
+   if (!aesdlog_enabled(level))
+      return;
+
+   va_start(args, format);
+   if (!sinkRunning)
+   {
+      vsyslog(level, format, args);
+      va_end(args);
+      return;
+   }
+   vsnprintf(text, sizeof(text), format, args);
+   va_end(args);
+
+   // Hand the formatted message to the sink, never block the caller on a full queue
+   pthread_mutex_lock(&queueLock);
+   if ((NULL == queue) || sinkStop)
+   {
+      // Shut down while this message was being formatted
+   }
+   else if ((queued - taken) >= AESDLOG_QUEUE_SLOTS)
+   {
+      dropped++;
+   }
+   else
+   {
+      queue[queued % AESDLOG_QUEUE_SLOTS].level = level;
+      strcpy(queue[queued % AESDLOG_QUEUE_SLOTS].text, text);
+      queued++;
+      pthread_cond_signal(&queueNotEmpty);
+   }
+   pthread_mutex_unlock(&queueLock);
+}
+
+void aesdlog_set_level(int level)
+{
+   pthread_once(&setupOnce, aesdlog_setup);
+   if (!atomic_load(&shutDown))
+      atomic_store(&aesdlog_level, level);
+}
+
+void aesdlog_flush(void)
+{
+   if (!sinkRunning)
+      return;
+
+   pthread_mutex_lock(&queueLock);
+   while (written < queued)
+      pthread_cond_wait(&queueDrained, &queueLock);
+   pthread_mutex_unlock(&queueLock);
+}
+
+void aesdlog_shutdown(void)
+{
+   if (atomic_exchange(&shutDown, true))
+      return;
+
+   // Drop anything logged from here on
+   atomic_store(&aesdlog_level, -1);
+
+   if (sinkRunning)
+   {
+      pthread_mutex_lock(&queueLock);
+      sinkStop = true;
+      pthread_cond_signal(&queueNotEmpty);
+      pthread_mutex_unlock(&queueLock);
+      pthread_join(sinkThread, NULL);
+
+      pthread_mutex_lock(&queueLock);
+      sinkRunning = false;
+      free(queue);
+      queue = NULL;
+      pthread_mutex_unlock(&queueLock);
+   }
+
+   closelog();
+}
@@ -0,0 +1,74 @@
+/**
+ * @file aesdlog.h
+ * @author Kenneth A. Jones
+ * @date 2022-03-28
+ *
+ * @brief Process wide logging to syslog shared by the assignment programs.
+ *
+ *    The syslog connection is opened once, on first use or by aesdlog_init(), and
+ *    closed at exit.  AESD_LOG() checks the level before its arguments are evaluated
+ *    or formatted, so disabled messages cost one load.  With AESDLOG_ASYNC messages
+ *    are formatted by the caller and handed to a sink thread which does the syslog()
+ *    calls, keeping them out of hot loops.  All functions are thread safe.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef AESDLOG_H
+#define AESDLOG_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <syslog.h>
+
+// aesdlog_init() flags
+#define AESDLOG_ASYNC   0x1 // Send messages to syslog from a sink thread
+#define AESDLOG_STDERR  0x2 // Also print messages to stderr, as openlog() LOG_PERROR
+
+// Least important level logged, a syslog priority such as LOG_INFO.  Use aesdlog_set_level() to change.
+extern atomic_int aesdlog_level;
+
+/**
+* Configure logging, @param ident and @param facility are as for openlog(), messages less
+* important than @param level are dropped, @param flags is a mask of AESDLOG_ flags.
+* Only the first configuration of the process takes effect, logging without calling
+* this first configures it as aesdlog_init(NULL, LOG_USER, LOG_DEBUG, 0).
+* @return true if this call configured logging
+*/
+bool aesdlog_init(const char *ident, int facility, int level, unsigned int flags);
+
+/**
+* Log a message with syslog priority @param level.  Prefer AESD_LOG(), which skips the
+* call entirely for disabled levels.
+*/
+void aesdlog(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+* Change the least important level logged to @param level
+*/
+void aesdlog_set_level(int level);
+
+/**
+* Wait until every message logged so far has been passed to syslog
+*/
+void aesdlog_flush(void);
+
+/**
+* Flush, stop the sink thread and close the syslog connection.  Registered with atexit(),
+* calling it earlier is allowed and logging afterwards reopens nothing, messages are dropped.
+*/
+void aesdlog_shutdown(void);
+
+/**
+* True if messages of syslog priority @param level are logged
+*/
+#define aesdlog_enabled(level) ((level) <= atomic_load_explicit(&aesdlog_level, memory_order_relaxed))
+
+/**
+* Log a printf style message at syslog priority @param level if that level is enabled
+*/
+#define AESD_LOG(level, ...) \
+   do { if (aesdlog_enabled(level)) aesdlog((level), __VA_ARGS__); } while (0)
+
+#endif /* AESDLOG_H */
@@ -0,0 +1,510 @@
+/**
+ * @file lockprof.c
+ * @author Kenneth A. Jones
+ * @date 2022-04-02
+ *
+ * @brief Mutex contention profiling, see lockprof.h.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+// ============================================================================
+// INCLUDES
+// ============================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <time.h>
+
+#ifndef LOCKPROF
+#define LOCKPROF
+#endif
+#include "lockprof.h"
+
+// ============================================================================
+// PRIVATE MACROS AND DEFINES
+// ============================================================================
+
+// log2 nanosecond buckets, the last also counts everything longer
+#define TIME_BUCKETS 32
+
+// Buckets of contenders seen at acquire: 0, 1, 2-3, 4-7, ... and the last for more
+#define CONTENDER_BUCKETS 8
+
+#define NSEC_PER_SEC 1000000000ULL
+
+// Longest dump line
+#define LINE_SIZE 256
+
+// Mutexes one thread can hold at once and have their hold times recorded
+#define MAX_HELD 16
+
+// ============================================================================
+// PRIVATE TYPEDEFS
+// ============================================================================
+
+// Profile of one site.  Each field of a thread's block is written only by that thread,
+// relaxed atomics let the dumper read them while it runs.
+struct site_stats
+{
+   atomic_ulong acquisitions;
+   atomic_ulong contended;             // waited for another thread
+   atomic_ullong waitNs;
+   atomic_ullong holdNs;
+   atomic_ullong waitMaxNs;
+   atomic_ullong holdMaxNs;
+   atomic_ulong waitHist[TIME_BUCKETS];
+   atomic_ulong holdHist[TIME_BUCKETS];
+   atomic_ulong contenderHist[CONTENDER_BUCKETS];
+};
+
+// Mutex held by a thread, kept per mutex so nested locks of one site each get their own
+struct held_lock
+{
+   pthread_mutex_t *mutex;
+   uint64_t acquiredNs;
+};
+
+struct thread_stats
+{
+   struct thread_stats *pNext;
+   struct site_stats sites[LOCKPROF_MAX_SITES];
+   struct held_lock held[MAX_HELD];   // most recently acquired last
+   unsigned int nHeld;
+};
+
+// ============================================================================
+// STATIC VARIABLES
+// ============================================================================
+
+static pthread_once_t setupOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t statsKey;
+static __thread struct thread_stats *pThreadStats;
+
+// Sites by slot, and the blocks of live and exited threads, under registryLock
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static const char *siteNames[LOCKPROF_MAX_SITES];
+static atomic_uint siteContenders[LOCKPROF_MAX_SITES];
+static int nSites;
+static struct thread_stats *pLive;
+static struct thread_stats *pFree;
+static struct thread_stats retired;
+
+// Dumper
+static sem_t dumpSem;
+static pthread_t dumperThread;
+static int dumpSigno;
+static lockprof_output_fn dumpOutput;
+static void *dumpCtx;
+
+// ============================================================================
+// STATIC FUNCTIONS
+// ============================================================================
+
+static inline uint64_t now_ns(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ((uint64_t)ts.tv_sec * NSEC_PER_SEC) + ts.tv_nsec;
+}
+
+static inline unsigned int time_bucket(uint64_t ns)
+{
+   unsigned int bucket = (ns > 0) ? (64 - __builtin_clzll(ns)) : 0;
+
+   return (bucket < TIME_BUCKETS) ? bucket : (TIME_BUCKETS - 1);
+}
+
+static inline unsigned int contender_bucket(unsigned int contenders)
+{
+   unsigned int bucket = (contenders > 0) ? (32 - __builtin_clz(contenders)) : 0;
+
+   return (bucket < CONTENDER_BUCKETS) ? bucket : (CONTENDER_BUCKETS - 1);
+}
+
+// Single writer updates, no locked instructions needed
+static inline void add_ulong(atomic_ulong *pValue, unsigned long add)
+{
+   atomic_store_explicit(pValue, atomic_load_explicit(pValue, memory_order_relaxed) + add, memory_order_relaxed);
+}
+
+static inline void add_ullong(atomic_ullong *pValue, unsigned long long add)
+{
+   atomic_store_explicit(pValue, atomic_load_explicit(pValue, memory_order_relaxed) + add, memory_order_relaxed);
+}
+
+static inline void max_ullong(atomic_ullong *pValue, unsigned long long value)
+{
+   if (value > atomic_load_explicit(pValue, memory_order_relaxed))
+      atomic_store_explicit(pValue, value, memory_order_relaxed);
+}
+
+/**
+ * Add the counts of @param pFrom to @param pTo.  @param pTo is written by the caller
+ * alone, under registryLock.
+ */
+static void stats_add(struct thread_stats *pTo, struct thread_stats *pFrom)
+{
+   struct site_stats *pDst;
+   struct site_stats *pSrc;
+   unsigned int site;
+   unsigned int bucket;
+
+   for (site = 0; site < LOCKPROF_MAX_SITES; site++)
+   {
+      pDst = &pTo->sites[site];
+      pSrc = &pFrom->sites[site];
+      add_ulong(&pDst->acquisitions, atomic_load_explicit(&pSrc->acquisitions, memory_order_relaxed));
+      add_ulong(&pDst->contended, atomic_load_explicit(&pSrc->contended, memory_order_relaxed));
+      add_ullong(&pDst->waitNs, atomic_load_explicit(&pSrc->waitNs, memory_order_relaxed));
+      add_ullong(&pDst->holdNs, atomic_load_explicit(&pSrc->holdNs, memory_order_relaxed));
+      max_ullong(&pDst->waitMaxNs, atomic_load_explicit(&pSrc->waitMaxNs, memory_order_relaxed));
+      max_ullong(&pDst->holdMaxNs, atomic_load_explicit(&pSrc->holdMaxNs, memory_order_relaxed));
+      for (bucket = 0; bucket < TIME_BUCKETS; bucket++)
+      {
+         add_ulong(&pDst->waitHist[bucket], atomic_load_explicit(&pSrc->waitHist[bucket], memory_order_relaxed));
+         add_ulong(&pDst->holdHist[bucket], atomic_load_explicit(&pSrc->holdHist[bucket], memory_order_relaxed));
+      }
+      for (bucket = 0; bucket < CONTENDER_BUCKETS; bucket++)
+         add_ulong(&pDst->contenderHist[bucket],
+                   atomic_load_explicit(&pSrc->contenderHist[bucket], memory_order_relaxed));
+   }
+}
+
+/**
+ * Thread exit, fold the thread's block into the totals and keep it for reuse
+ */
+static void thread_stats_retire(void *arg)
+{
+   struct thread_stats *pStats = (struct thread_stats *)arg;
+   struct thread_stats **ppLink;
+
+   pthread_mutex_lock(&registryLock);
+   stats_add(&retired, pStats);
+   for (ppLink = &pLive; *ppLink != pStats; ppLink = &(*ppLink)->pNext)
+      ;
+   *ppLink = pStats->pNext;
+   pStats->pNext = pFree;
+   pFree = pStats;
+   pthread_mutex_unlock(&registryLock);
+
+   // Later destructors of this thread may still lock, they take a new block
+   pThreadStats = NULL;
+}
+
+static void lockprof_setup(void)
+{
+   pthread_key_create(&statsKey, thread_stats_retire);
+}
+
+/**
+ * Block of the calling thread, taken on its first lock
+ * @return the block or NULL if out of memory
+ */
+static struct thread_stats *thread_stats_get(void)
+{
+   struct thread_stats *pStats = pThreadStats;
+
+   if (pStats != NULL)
+      return pStats;
+
+   pthread_once(&setupOnce, lockprof_setup);
+   pthread_mutex_lock(&registryLock);
+   pStats = pFree;
+   if (pStats != NULL)
+      pFree = pStats->pNext;
+   else
+      pStats = malloc(sizeof(struct thread_stats));
+   if (pStats != NULL)
+   {
+      memset(pStats, 0, sizeof(struct thread_stats));
+      pStats->pNext = pLive;
+      pLive = pStats;
+   }
+   pthread_mutex_unlock(&registryLock);
+
+   if (pStats != NULL)
+   {
+      pthread_setspecific(statsKey, pStats);
+      pThreadStats = pStats;
+   }
+   return pStats;
+}
+
+/**
+ * Profile slot of @param pSite, found by name on its first lock
+ * @return the slot or -1 if every slot is taken by other names
+ */
+static int site_slot(lockprof_site_t *pSite)
+{
+   int slot = atomic_load_explicit(&pSite->slot, memory_order_acquire);
+   int index;
+
+   if (slot != 0)
+      return slot - 1;
+
+   pthread_mutex_lock(&registryLock);
+   slot = -1;
+   for (index = 0; index < nSites; index++)
+   {
+      if (strcmp(siteNames[index], pSite->name) == 0)
+         slot = index;
+   }
+   if ((slot < 0) && (nSites < LOCKPROF_MAX_SITES))
+   {
+      siteNames[nSites] = pSite->name;
+      slot = nSites++;
+   }
+   pthread_mutex_unlock(&registryLock);
+
+   atomic_store_explicit(&pSite->slot, (slot < 0) ? -1 : (slot + 1), memory_order_release);
+   return slot;
+}
+
+static void output_line(lockprof_output_fn output, void *ctx, const char *line)
+{
+   if (output != NULL)
+      output(line, ctx);
+   else
+      fprintf(stderr, "%s\n", line);
+}
+
+/**
+ * Smallest power of 2 nanoseconds at or above @param fraction of the @param total
+ * counts of @param pHist, but no more than the longest time @param maxNs
+ */
+static unsigned long long hist_percentile(atomic_ulong *pHist, unsigned long total, double fraction,
+                                          unsigned long long maxNs)
+{
+   unsigned long long bound;
+   unsigned long long want = (unsigned long long)((total * fraction) + 0.5);
+   unsigned long long seen = 0;
+   unsigned int bucket;
+
+   for (bucket = 0; bucket < TIME_BUCKETS; bucket++)
+   {
+      seen += atomic_load_explicit(&pHist[bucket], memory_order_relaxed);
+      if ((seen >= want) && (seen > 0))
+         break;
+   }
+   bound = (bucket == 0) ? 0 : (1ULL << ((bucket < TIME_BUCKETS) ? bucket : (TIME_BUCKETS - 1)));
+   return (bound < maxNs) ? bound : maxNs;
+}
+
+/**
+ * Append the non-empty buckets of @param pHist to @param line
+ */
+static void hist_format(char *line, size_t size, const char *label, atomic_ulong *pHist, unsigned int nBuckets)
+{
+   size_t used = strlen(line);
+   unsigned long count;
+   unsigned int bucket;
+
+   used += snprintf(&line[used], (used < size) ? (size - used) : 0, "%s", label);
+   for (bucket = 0; bucket < nBuckets; bucket++)
+   {
+      count = atomic_load_explicit(&pHist[bucket], memory_order_relaxed);
+      if ((count > 0) && (used < size))
+         used += snprintf(&line[used], size - used, " %u:%lu", bucket, count);
+   }
+}
+
+static void dump_signal(int signo)
+{
+   (void)signo;
+   sem_post(&dumpSem);
+}
+
+static void *dumper_thread(void *arg)
+{
+   sigset_t set;
+
+   (void)arg;
+   sigemptyset(&set);
+   sigaddset(&set, dumpSigno);
+   pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+   while (true)
+   {
+      if (sem_wait(&dumpSem) == 0)
+         lockprof_dump(dumpOutput, dumpCtx);
+   }
+   return NULL;
+}
+
+// ============================================================================
+// GLOBAL FUNCTIONS
+// ============================================================================
+
+int lockprof_lock(pthread_mutex_t *mutex, lockprof_site_t *site)
+{
+   struct thread_stats *pStats = thread_stats_get();
+   struct site_stats *pSite;
+   unsigned int contenders;
+   uint64_t start;
+   uint64_t acquired;
+   uint64_t wait;
+   bool contended;
+   int slot = site_slot(site);
+   int res;
+
+   if ((pStats == NULL) || (slot < 0))
+      return pthread_mutex_lock(mutex);
+
+   // Threads waiting for or holding a mutex of this site, not counting this one
+   contenders = atomic_fetch_add_explicit(&siteContenders[slot], 1, memory_order_relaxed);
+   start = now_ns();
+   res = pthread_mutex_trylock(mutex);
+   contended = (res == EBUSY);
+   if (contended)
+      res = pthread_mutex_lock(mutex);
+   if (res != 0)
+   {
+      atomic_fetch_sub_explicit(&siteContenders[slot], 1, memory_order_relaxed);
+      return res;
+   }
+   acquired = contended ? now_ns() : start;
+   wait = acquired - start;
+
+   pSite = &pStats->sites[slot];
+   if (pStats->nHeld < MAX_HELD)
+   {
+      pStats->held[pStats->nHeld].mutex = mutex;
+      pStats->held[pStats->nHeld].acquiredNs = acquired;
+      pStats->nHeld++;
+   }
+   add_ulong(&pSite->acquisitions, 1);
+   if (contended)
+      add_ulong(&pSite->contended, 1);
+   add_ullong(&pSite->waitNs, wait);
+   max_ullong(&pSite->waitMaxNs, wait);
+   add_ulong(&pSite->waitHist[time_bucket(wait)], 1);
+   add_ulong(&pSite->contenderHist[contender_bucket(contenders)], 1);
+   return 0;
+}
+
+int lockprof_unlock(pthread_mutex_t *mutex, lockprof_site_t *site)
+{
+   struct thread_stats *pStats = pThreadStats;
+   struct site_stats *pSite;
+   uint64_t hold;
+   unsigned int index;
+   int slot = atomic_load_explicit(&site->slot, memory_order_relaxed) - 1;
+   int res;
+
+   if ((pStats == NULL) || (slot < 0))
+      return pthread_mutex_unlock(mutex);
+
+   // Mutexes may be unlocked in any order, the newest is the likeliest
+   for (index = pStats->nHeld; (index > 0) && (pStats->held[index - 1].mutex != mutex); index--)
+      ;
+   hold = (index > 0) ? (now_ns() - pStats->held[index - 1].acquiredNs) : 0;
+   res = pthread_mutex_unlock(mutex);
+   atomic_fetch_sub_explicit(&siteContenders[slot], 1, memory_order_relaxed);
+
+   // Not recorded when more than MAX_HELD were held
+   if (index == 0)
+      return res;
+   pStats->nHeld--;
+   memmove(&pStats->held[index - 1], &pStats->held[index], (pStats->nHeld - (index - 1)) * sizeof(struct held_lock));
+
+   pSite = &pStats->sites[slot];
+   add_ullong(&pSite->holdNs, hold);
+   max_ullong(&pSite->holdMaxNs, hold);
+   add_ulong(&pSite->holdHist[time_bucket(hold)], 1);
+   return res;
+}
+
+void lockprof_dump(lockprof_output_fn output, void *ctx)
+{
+   static struct thread_stats totals;
+   struct thread_stats *pStats;
+   struct site_stats *pSite;
+   char line[LINE_SIZE];
+   unsigned long count;
+   unsigned long nThreads = 0;
+   int slot;
+
+   // Dumps are serialized by registryLock, so one static block of totals does
+   pthread_mutex_lock(&registryLock);
+   memset(&totals, 0, sizeof(totals));
+   stats_add(&totals, &retired);
+   for (pStats = pLive; pStats != NULL; pStats = pStats->pNext, nThreads++)
+      stats_add(&totals, pStats);
+
+   snprintf(line, sizeof(line), "lockprof: %d sites, %lu live threads", nSites, nThreads);
+   output_line(output, ctx, line);
+   for (slot = 0; slot < nSites; slot++)
+   {
+      pSite = &totals.sites[slot];
+      count = atomic_load_explicit(&pSite->acquisitions, memory_order_relaxed);
+      if (count == 0)
+         continue;
+
+      snprintf(line, sizeof(line),
+               "lockprof: %s: %lu acquisitions, %lu contended, wait avg %llu p99 %llu max %llu ns, "
+               "hold avg %llu p99 %llu max %llu ns",
+               siteNames[slot], count, atomic_load_explicit(&pSite->contended, memory_order_relaxed),
+               atomic_load_explicit(&pSite->waitNs, memory_order_relaxed) / count,
+               hist_percentile(pSite->waitHist, count, 0.99,
+                               atomic_load_explicit(&pSite->waitMaxNs, memory_order_relaxed)),
+               atomic_load_explicit(&pSite->waitMaxNs, memory_order_relaxed),
+               atomic_load_explicit(&pSite->holdNs, memory_order_relaxed) / count,
+               hist_percentile(pSite->holdHist, count, 0.99,
+                               atomic_load_explicit(&pSite->holdMaxNs, memory_order_relaxed)),
+               atomic_load_explicit(&pSite->holdMaxNs, memory_order_relaxed));
+      output_line(output, ctx, line);
+
+      // Bucket b of a time histogram counts times below 2^b ns
+      snprintf(line, sizeof(line), "lockprof: %s:", siteNames[slot]);
+      hist_format(line, sizeof(line), " wait log2ns", pSite->waitHist, TIME_BUCKETS);
+      output_line(output, ctx, line);
+      snprintf(line, sizeof(line), "lockprof: %s:", siteNames[slot]);
+      hist_format(line, sizeof(line), " hold log2ns", pSite->holdHist, TIME_BUCKETS);
+      output_line(output, ctx, line);
+      snprintf(line, sizeof(line), "lockprof: %s:", siteNames[slot]);
+      hist_format(line, sizeof(line), " contenders log2", pSite->contenderHist, CONTENDER_BUCKETS);
+      output_line(output, ctx, line);
+   }
+   pthread_mutex_unlock(&registryLock);
+}
+
+bool lockprof_start_dumper(int signo, lockprof_output_fn output, void *ctx)
+{
+   struct sigaction action;
+   sigset_t set;
+   sigset_t old;
+   bool started;
+
+   if (sem_init(&dumpSem, 0, 0) != 0)
+      return false;
+   dumpOutput = output;
+   dumpCtx = ctx;
+   dumpSigno = signo;
+
+   // sem_post() is the only async signal safe way to wake the dumper
+   memset(&action, 0, sizeof(action));
+   action.sa_handler = dump_signal;
+   action.sa_flags = SA_RESTART;
+   sigemptyset(&action.sa_mask);
+   if (sigaction(signo, &action, NULL) != 0)
+      return false;
+
+   // Block the signal here, and so in the dumper and every later thread, the dumper
+   // then unblocks it to be the only thread taking it
+   sigemptyset(&set);
+   sigaddset(&set, signo);
+   pthread_sigmask(SIG_BLOCK, &set, &old);
+   started = (pthread_create(&dumperThread, NULL, dumper_thread, NULL) == 0);
+   if (!started)
+      pthread_sigmask(SIG_SETMASK, &old, NULL);
+   else
+      pthread_detach(dumperThread);
+   return started;
+}
@@ -0,0 +1,138 @@
+/**
+ * @file lockprof.h
+ * @author Kenneth A. Jones
+ * @date 2022-04-02
+ *
+ * @brief Contention profiling for the pthread mutexes of the assignment programs.
+ *
+ *    Every lock goes through a site, a named profile shared by all mutexes locked
+ *    under that name.  For each site lockprof records how long threads waited to
+ *    acquire, how long they held the mutex and how many other threads were waiting
+ *    for or holding it at the time.  Waits and holds are kept in log2 nanosecond
+ *    histograms owned by the thread that locked, so profiling adds two clock reads
+ *    and no shared writes beyond the contender count.  Blocks of exited threads are
+ *    folded into process totals and reused.
+ *
+ *    lockprof_start_dumper() dumps every site on a signal such as SIGUSR1.
+ *
+ *    Profiling is compiled in with -DLOCKPROF and lockprof.c.  Without it the lock
+ *    calls are inline pthread calls and lockprof.c is not needed.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// Number of distinct site names profiled, locks of any further names are not recorded
+#define LOCKPROF_MAX_SITES 16
+
+// Named profile, @param name must stay valid for the life of the process
+typedef struct
+{
+   const char *name;
+   atomic_int slot;     // profile slot + 1, 0 until first locked, -1 if untracked
+} lockprof_site_t;
+
+#define LOCKPROF_SITE_INITIALIZER(name) {(name), 0}
+
+// Mutex profiled under its own site
+typedef struct
+{
+   pthread_mutex_t mutex;
+   lockprof_site_t site;
+} lockprof_mutex_t;
+
+#define LOCKPROF_MUTEX_INITIALIZER(name) {PTHREAD_MUTEX_INITIALIZER, LOCKPROF_SITE_INITIALIZER(name)}
+
+/**
+* Called by the dumper with each line of a dump, without a newline
+*/
+typedef void (*lockprof_output_fn)(const char *line, void *ctx);
+
+#ifdef LOCKPROF
+
+/**
+* Lock @param mutex, recording the wait under @param site
+* @return as pthread_mutex_lock()
+*/
+int lockprof_lock(pthread_mutex_t *mutex, lockprof_site_t *site);
+
+/**
+* Unlock @param mutex, recording the hold under @param site.  Must be called by the
+* thread that locked it, with the same site.
+* @return as pthread_mutex_unlock()
+*/
+int lockprof_unlock(pthread_mutex_t *mutex, lockprof_site_t *site);
+
+/**
+* Write the profile of every site to @param output, or stderr if NULL
+*/
+void lockprof_dump(lockprof_output_fn output, void *ctx);
+
+/**
+* Start a thread that calls lockprof_dump(@param output, @param ctx) each time @param signo
+* is received.  The signal is blocked in the calling thread and so in threads it creates
+* afterwards, so it never interrupts their system calls.  Call it before creating threads.
+* @return false if the thread could not be started
+*/
+bool lockprof_start_dumper(int signo, lockprof_output_fn output, void *ctx);
+
+#else
+
+static inline int lockprof_lock(pthread_mutex_t *mutex, lockprof_site_t *site)
+{
+   (void)site;
+   return pthread_mutex_lock(mutex);
+}
+
+static inline int lockprof_unlock(pthread_mutex_t *mutex, lockprof_site_t *site)
+{
+   (void)site;
+   return pthread_mutex_unlock(mutex);
+}
+
+static inline void lockprof_dump(lockprof_output_fn output, void *ctx)
+{
+   (void)output;
+   (void)ctx;
+}
+
+static inline bool lockprof_start_dumper(int signo, lockprof_output_fn output, void *ctx)
+{
+   (void)signo;
+   (void)output;
+   (void)ctx;
+   return true;
+}
+
+#endif /* LOCKPROF */
+
+static inline int lockprof_mutex_init(lockprof_mutex_t *mutex, const char *name)
+{
+   mutex->site.name = name;
+   atomic_init(&mutex->site.slot, 0);
+   return pthread_mutex_init(&mutex->mutex, NULL);
+}
+
+static inline int lockprof_mutex_lock(lockprof_mutex_t *mutex)
+{
+   return lockprof_lock(&mutex->mutex, &mutex->site);
+}
+
+static inline int lockprof_mutex_unlock(lockprof_mutex_t *mutex)
+{
+   return lockprof_unlock(&mutex->mutex, &mutex->site);
+}
+
+static inline int lockprof_mutex_destroy(lockprof_mutex_t *mutex)
+{
+   return pthread_mutex_destroy(&mutex->mutex);
+}
+
+#endif /* LOCKPROF_H */
@@ -0,0 +1,117 @@
+/**
+ * @file spawn-bench.c
+ * @author Kenneth A. Jones
+ * @date 2022-03-27
+ *
+ * @brief Spawn latency of do_exec() against a fork() and execv() baseline as the
+ *      resident size of the parent grows.
+ *
+ *      Build: gcc -O2 -Wall spawn-bench.c systemcalls.c ../aesdlog/aesdlog.c -pthread -o spawn-bench
+ *      Usage: spawn-bench [iterations] [parent RSS in MiB ...]
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+// ============================================================================
+// INCLUDES
+// ============================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "systemcalls.h"
+
+// ============================================================================
+// PRIVATE MACROS AND DEFINES
+// ============================================================================
+
+#define DEFAULT_ITERATIONS 200
+#define COMMAND "/bin/true"
+#define MIB (1024UL * 1024UL)
+
+// ============================================================================
+// PRIVATE FUNCTIONS
+// ============================================================================
+
+static double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1e6) + (ts.tv_nsec / 1e3);
+}
+
+// Baseline, the way do_exec() used to start its child
+static void fork_exec(void)
+{
+    char *command[] = {COMMAND, NULL};
+    int status;
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        execv(command[0], command);
+        _exit(EXIT_FAILURE);
+    }
+    if (pid > 0)
+        waitpid(pid, &status, 0);
+}
+
+static void spawn_exec(void)
+{
+    do_exec(1, COMMAND);
+}
+
+static double average_us(void (*run)(void), unsigned long iterations)
+{
+    unsigned long index;
+    double start = now_us();
+
+    for (index = 0; index < iterations; index++)
+        run();
+    return (now_us() - start) / iterations;
+}
+
+// ============================================================================
+// MAIN
+// ============================================================================
+
+int main(int argc, char *argv[])
+{
+    static const char *defaultSizes[] = {"0", "64", "256", "1024"};
+    unsigned long iterations = (argc > 1) ? strtoul(argv[1], NULL, 0) : DEFAULT_ITERATIONS;
+    const char **sizes = (argc > 2) ? (const char **)&argv[2] : defaultSizes;
+    int nSizes = (argc > 2) ? (argc - 2) : (int)(sizeof(defaultSizes) / sizeof(defaultSizes[0]));
+    char *ballast = NULL;
+    size_t held = 0;
+    size_t want;
+    int index;
+
+    printf("%10s %14s %14s\n", "RSS MiB", "fork+execv us", "posix_spawn us");
+    for (index = 0; index < nSizes; index++)
+    {
+        // Grow the parent and touch every page so it is resident
+        want = strtoul(sizes[index], NULL, 0) * MIB;
+        if (want > held)
+        {
+            ballast = realloc(ballast, want);
+            if (ballast == NULL)
+            {
+                perror("realloc");
+                return EXIT_FAILURE;
+            }
+            memset(&ballast[held], 1, want - held);
+            held = want;
+        }
+
+        printf("%10zu %14.1f %14.1f\n", held / MIB, average_us(fork_exec, iterations),
+               average_us(spawn_exec, iterations));
+    }
+
+    free(ballast);
+    return EXIT_SUCCESS;
+}
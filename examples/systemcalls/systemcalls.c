@@ -9,14 +9,30 @@
  * 
  */
 
+#define _GNU_SOURCE // pipe2
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 
 #include "systemcalls.h"
-#include <syslog.h>
+#include "../aesdlog/aesdlog.h"
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <spawn.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+// First allocation made for a capture buffer
+#define CAPTURE_MIN_CAPACITY 256
+
+// Bytes read from a capture pipe at a time
+#define CAPTURE_CHUNK_SIZE 4096
+
+extern char **environ;
 
 /**
  * @param cmd the command to execute with system()
@@ -27,33 +43,153 @@
 */
 bool do_system(const char *cmd)
 {
-   // Create syslog for logging
-   openlog(NULL, 0, LOG_USER);
-
    int rtnVal = system(cmd);
 
    // Reference https://man7.org/linux/man-pages/man3/system.3.html for return values
    if ((NULL == cmd) && (0 == rtnVal))
    {
-      syslog(LOG_ERR, "No shell is available");
+      AESD_LOG(LOG_ERR, "No shell is available");
       return false;
    }
 
    if (-1 == rtnVal)
    {
-      syslog(LOG_ERR, "Child process could not be created");
+      AESD_LOG(LOG_ERR, "Child process could not be created");
       return false;
    }
 
    if (rtnVal > 0)
    {
-      syslog(LOG_ERR, "Shell could not be executed in the child process");
+      AESD_LOG(LOG_ERR, "Shell could not be executed in the child process");
+      return false;
+   }
+
+   return true;
+}
+
+/**
+* @brief Start @param command without waiting for it.  The child is started with
+*   posix_spawn(), which glibc implements with a vfork style clone, so unlike fork()
+*   the cost does not grow with the size of the calling process.
+* @param outputfile - if not NULL, the file to truncate or create and send the
+*   child's standard out to, opened in the child through the spawn file actions
+* @param stdout_fd - if not -1, a descriptor to make the child's standard out instead
+* @param stderr_fd - if not -1, a descriptor to make the child's standard error
+* @param pid - set to the process id of the child
+* @return true if the child was started
+*/
+static bool spawn_child(char *const command[], const char *outputfile, int stdout_fd, int stderr_fd,
+                        pid_t *pid)
+{
+   posix_spawn_file_actions_t actions;
+   int rtnVal;
+
+   rtnVal = posix_spawn_file_actions_init(&actions);
+   if (0 != rtnVal)
+   {
+      AESD_LOG(LOG_ERR, "Failed to create spawn file actions: %s", strerror(rtnVal));
+      return false;
+   }
+
+   if (NULL != outputfile)
+   {
+      rtnVal = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, outputfile,
+                                                O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (0 != rtnVal)
+      {
+         AESD_LOG(LOG_ERR, "Failed to redirect to %s: %s", outputfile, strerror(rtnVal));
+         posix_spawn_file_actions_destroy(&actions);
+         return false;
+      }
+   }
+
+   if (-1 != stdout_fd)
+      rtnVal = posix_spawn_file_actions_adddup2(&actions, stdout_fd, STDOUT_FILENO);
+   if ((0 == rtnVal) && (-1 != stderr_fd))
+      rtnVal = posix_spawn_file_actions_adddup2(&actions, stderr_fd, STDERR_FILENO);
+   if (0 != rtnVal)
+   {
+      AESD_LOG(LOG_ERR, "Failed to redirect output: %s", strerror(rtnVal));
+      posix_spawn_file_actions_destroy(&actions);
+      return false;
+   }
+
+   // Create child process, fails if the output file can't be opened or the command can't be executed
+   rtnVal = posix_spawn(pid, command[0], &actions, NULL, command, environ);
+   posix_spawn_file_actions_destroy(&actions);
+   if (0 != rtnVal)
+   {
+      AESD_LOG(LOG_ERR, "Error running child process %s: %s", command[0], strerror(rtnVal));
+      return false;
+   }
+
+   return true;
+}
+
+/**
+* @brief Wait for child @param pid to finish and store its wait status in @param status
+* @return true if the child was reaped
+*/
+static bool wait_child(pid_t pid, int *status)
+{
+   int rtnVal;
+
+   do
+   {
+      rtnVal = waitpid(pid, status, 0);
+   } while ((-1 == rtnVal) && (EINTR == errno));
+
+   if (-1 == rtnVal)
+   {
+      AESD_LOG(LOG_ERR, "Child process failed");
       return false;
    }
 
    return true;
 }
 
+/**
+* @brief Check the wait @param status of a child
+* @return true if the child exited normally with a zero status
+*/
+static bool child_succeeded(int status)
+{
+   // Check if the child process exited normally
+   if (!WIFEXITED(status))
+   {
+      AESD_LOG(LOG_ERR, "Child process exit it with issues, exit status=%d ", WEXITSTATUS(status));
+      return false;
+   }
+
+   if (WEXITSTATUS(status))
+   {
+      // child process exit with nonzero return
+      AESD_LOG(LOG_INFO, "child process WEXITSTATUS %d", WEXITSTATUS(status));
+      return false;
+   }
+
+   return true;
+}
+
+/**
+* @brief Run @param command and wait for it to finish
+* @param outputfile - see spawn_child()
+* @return true if the command ran and exited with a zero status
+*/
+static bool spawn_and_wait(char *const command[], const char *outputfile)
+{
+   pid_t pid;
+   int status;
+
+   if (!spawn_child(command, outputfile, -1, -1, &pid))
+      return false;
+
+   if (!wait_child(pid, &status))
+      return false;
+
+   return child_succeeded(status);
+}
+
 /**
 * @param count -The numbers of variables passed to the function. The variables are command to execute.
 *   followed by arguments to pass to the command
@@ -63,8 +199,8 @@ bool do_system(const char *cmd)
 *   The first is always the full path to the command to execute with execv()
 *   The remaining arguments are a list of arguments to pass to the command in execv()
 * @return true if the command @param ... with arguments @param arguments were executed successfully
-*   using the execv() call, false if an error occurred, either in invocation of the 
-*   fork, waitpid, or execv() command, or if a non-zero return value was returned
+*   using posix_spawn(), false if an error occurred, either in invocation of the 
+*   posix_spawn or waitpid, or if a non-zero return value was returned
 *   by the command issued in @param arguments with the specified arguments.
 */
 
@@ -82,151 +218,331 @@ bool do_exec(int count, ...)
 
    va_end(args);
 
-   // Create syslog for logging
-   openlog(NULL, 0, LOG_USER);
+   return spawn_and_wait(command, NULL);
+}
+
+/**
+* @param outputfile - The full path to the file to write with command output.  
+*   The file is created if needed and truncated, then closed at completion of the function call.
+* All other parameters, see do_exec above
+*/
+bool do_exec_redirect(const char *outputfile, int count, ...)
+{
+   va_list args;
+   va_start(args, count);
+   char *command[count + 1];
+   int i;
+   for (i = 0; i < count; i++)
+   {
+      command[i] = va_arg(args, char *);
+   }
+   command[count] = NULL;
+
+   va_end(args);
+
+   return spawn_and_wait(command, outputfile);
+}
+
+/**
+* @brief Open a pidfd for child @param pid so its exit can be waited for with poll()
+* @return the pidfd, or -1 if the kernel or C library does not support them
+*/
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+   return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+   (void)pid;
+   errno = ENOSYS;
+   return -1;
+#endif
+}
+
+/**
+* @brief Seconds from @param start to now
+*/
+static double elapsed_sec(const struct timespec *start)
+{
+   struct timespec now;
 
-   // Create child process
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) + ((now.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+// A command started by do_exec_batch() and not yet reaped
+struct batch_child
+{
    pid_t pid;
-   int status;
-   int rtnVal;
+   int pidfd;
+   size_t index;
+   struct timespec start;
+};
+
+/**
+* @brief Reap @param child and record its outcome in @param results
+* @return true if the command succeeded
+*/
+static bool reap_batch_child(struct batch_child *child, struct exec_result results[])
+{
+   struct exec_result *result = &results[child->index];
+
+   if (child->pidfd >= 0)
+      close(child->pidfd);
+
+   if (!wait_child(child->pid, &result->status))
+      result->status = -1;
+   result->elapsed_sec = elapsed_sec(&child->start);
+   result->success = (result->status != -1) && child_succeeded(result->status);
+   return result->success;
+}
+
+/**
+* @param commands - @param count commands to run, each a NULL terminated argument list whose
+*   first entry is the full path to the command, as for do_exec()
+* @param max_parallel - the most commands to run at the same time, 0 is treated as 1
+* @param results - @param count entries set to the outcome of the matching command
+* @return true if every command ran and exited with a zero status
+*
+* Commands are started in order as soon as fewer than max_parallel are running.  Finished
+*   children are waited for with poll() on their pidfds, or with a blocking waitpid() on the
+*   oldest running child where pidfds are not available.  Other children of the caller are
+*   never reaped.
+*/
+bool do_exec_batch(char *const *commands[], size_t count, unsigned int max_parallel,
+                   struct exec_result results[])
+{
+   struct batch_child *running;
+   struct pollfd *fds;
+   size_t nRunning = 0;
+   size_t next = 0;
+   size_t i;
    bool exitVal = true;
+   bool usePidfd = true;
 
-   // Create child process
-   pid = fork();
+   if (0 == max_parallel)
+      max_parallel = 1;
+   if (max_parallel > count)
+      max_parallel = (count > 0) ? count : 1;
 
-   if (-1 == pid)
+   running = calloc(max_parallel, sizeof(struct batch_child));
+   fds = calloc(max_parallel, sizeof(struct pollfd));
+   if ((NULL == running) || (NULL == fds))
    {
-      syslog(LOG_ERR, "No child process is created");
-      exitVal = false;
-   }
-   else if (0 == pid)
-   {
-      // Return in the child process.
-      rtnVal = execv(command[0], command); // Note execv functions return only if an error has occurred
-      syslog(LOG_ERR, "Error running child processes");
-      exit(EXIT_FAILURE); // exit child process
+      AESD_LOG(LOG_ERR, "Out of memory for %u parallel commands", max_parallel);
+      free(running);
+      free(fds);
+      return false;
    }
-   else
-   {
-      // Returned in the parent process, need to wait for child process to finish
-      rtnVal = waitpid(pid, &status, 0);
 
-      if (-1 == rtnVal)
+   while ((next < count) || (nRunning > 0))
+   {
+      // Start commands until the limit is reached
+      while ((next < count) && (nRunning < max_parallel))
       {
-         syslog(LOG_ERR, "Child process failed");
-         exitVal = false;
+         struct batch_child *child = &running[nRunning];
+
+         child->index = next++;
+         clock_gettime(CLOCK_MONOTONIC, &child->start);
+         if (!spawn_child(commands[child->index], NULL, -1, -1, &child->pid))
+         {
+            results[child->index].success = false;
+            results[child->index].status = -1;
+            results[child->index].elapsed_sec = elapsed_sec(&child->start);
+            exitVal = false;
+            continue;
+         }
+
+         child->pidfd = usePidfd ? open_pidfd(child->pid) : -1;
+         if (child->pidfd < 0)
+            usePidfd = false;
+         nRunning++;
       }
 
-      // Check if the child process exited normally
-      if (!WIFEXITED(status))
+      if (0 == nRunning)
+         break;
+
+      // Without pidfds for every running child, block on the oldest one
+      for (i = 0; i < nRunning; i++)
       {
-         syslog(LOG_ERR, "Child process exit it with issues, exit status=%d ", WEXITSTATUS(status));
-         exitVal = false;
+         if (running[i].pidfd < 0)
+            break;
+         fds[i].fd = running[i].pidfd;
+         fds[i].events = POLLIN;
+         fds[i].revents = 0;
       }
-      else
+      if (i < nRunning)
       {
-         if (WEXITSTATUS(status))
+         exitVal &= reap_batch_child(&running[0], results);
+         running[0] = running[--nRunning];
+         continue;
+      }
+
+      if (poll(fds, nRunning, -1) < 0)
+      {
+         if (EINTR == errno)
+            continue;
+         AESD_LOG(LOG_ERR, "poll on pidfds failed: %s", strerror(errno));
+         usePidfd = false;
+         for (i = 0; i < nRunning; i++)
          {
-            // child process exit with nonzero return
-            syslog(LOG_INFO, "child process WEXITSTATUS %d", WEXITSTATUS(status));
-            exitVal = false;
+            close(running[i].pidfd);
+            running[i].pidfd = -1;
          }
+         continue;
+      }
+
+      // Reap every child that exited, walking backwards so removal keeps unvisited slots in place
+      for (i = nRunning; i-- > 0;)
+      {
+         if (0 == fds[i].revents)
+            continue;
+         exitVal &= reap_batch_child(&running[i], results);
+         running[i] = running[--nRunning];
+         fds[i] = fds[nRunning];
       }
    }
 
+   free(running);
+   free(fds);
    return exitVal;
 }
 
 /**
-* @param outputfile - The full path to the file to write with command output.  
-*   This file will be closed at completion of the function call.
-* All other parameters, see do_exec above
+* @brief Append @param size bytes at @param data to @param buffer, growing it geometrically
+*   and keeping the contents NUL terminated
+* @return false if out of memory
 */
-bool do_exec_redirect(const char *outputfile, int count, ...)
+static bool exec_buffer_append(struct exec_buffer *buffer, const char *data, size_t size)
 {
-   va_list args;
-   va_start(args, count);
-   char *command[count + 1];
-   int i;
-   for (i = 0; i < count; i++)
+   size_t capacity;
+   char *grown;
+
+   if ((buffer->size + size + 1) > buffer->capacity)
    {
-      command[i] = va_arg(args, char *);
+      capacity = (buffer->capacity > 0) ? buffer->capacity : CAPTURE_MIN_CAPACITY;
+      while (capacity < (buffer->size + size + 1))
+         capacity *= 2;
+      grown = realloc(buffer->data, capacity);
+      if (NULL == grown)
+         return false;
+      buffer->data = grown;
+      buffer->capacity = capacity;
    }
-   command[count] = NULL;
-
-   va_end(args);
-
-   /*
-    *
-    *   Call execv, but first using https://stackoverflow.com/a/13784315/1446624 as a refernce,
-    *   redirect standard out to a file specified by outputfile.
-    *   The rest of the behaviour is same as do_exec()
-    *
-    */
 
-   // Create syslog for logging
-   openlog(NULL, 0, LOG_USER);
+   memcpy(&buffer->data[buffer->size], data, size);
+   buffer->size += size;
+   buffer->data[buffer->size] = '\0';
+   return true;
+}
 
-   // Create child process
+/**
+* @param command - NULL terminated argument list, the first entry being the full path to
+*   the command to execute
+* @param out - if not NULL, buffer the child's standard out is appended to
+* @param err - if not NULL, buffer the child's standard error is appended to
+* @param callback - if not NULL, called with each chunk read from either stream as it arrives
+* @param context - passed to @param callback
+* @return true if the command ran, exited with a zero status and all of its output was stored
+*
+* A stream with neither a buffer nor a callback is inherited from the caller.  Captured streams
+*   are read over pipes with poll(), so a child filling one pipe can't stall while the other is
+*   being read.  Buffers may start zeroed or hold earlier output, they are grown with realloc()
+*   and must be freed by the caller.
+*/
+bool do_exec_capture(char *const command[], struct exec_buffer *out, struct exec_buffer *err,
+                     exec_output_cb callback, void *context)
+{
+   struct exec_buffer *buffers[2] = {out, err};
+   struct pollfd fds[2];
+   int pipes[2][2] = {{-1, -1}, {-1, -1}};
+   char chunk[CAPTURE_CHUNK_SIZE];
+   ssize_t nRead;
    pid_t pid;
    int status;
-   int rtnVal;
+   int nOpen = 0;
+   int i;
    bool exitVal = true;
-   int fd = open(outputfile, O_WRONLY | O_CREAT);
 
-   if (fd < 0)
+   // Close on exec keeps the pipes out of other children, dup2 in the child clears it
+   for (i = 0; i < 2; i++)
    {
-      syslog(LOG_ERR, "Failed to open");
-      exitVal = false;
+      fds[i].fd = -1;
+      fds[i].events = POLLIN;
+      if ((NULL == buffers[i]) && (NULL == callback))
+         continue;
+      if (pipe2(pipes[i], O_CLOEXEC) < 0)
+      {
+         AESD_LOG(LOG_ERR, "Failed to create pipe: %s", strerror(errno));
+         exitVal = false;
+         goto done;
+      }
    }
 
-   // Create child process
-   pid = fork();
-
-   if (-1 == pid)
+   if (!spawn_child(command, NULL, pipes[0][1], pipes[1][1], &pid))
    {
-      syslog(LOG_ERR, "No child process is created");
       exitVal = false;
+      goto done;
    }
-   else if (0 == pid)
+
+   // Only the child writes to the pipes, closing our ends lets us see EOF
+   for (i = 0; i < 2; i++)
    {
-      // Return in the child process.
-      if (dup2(fd, 1) < 0)
-      {
-         syslog(LOG_ERR, "Failed dup2");
-      }
-      close(fd);
-      rtnVal = execv(command[0], command); // Note execv functions return only if an error has occurred
-      syslog(LOG_ERR, "Error running child processes");
-      exit(EXIT_FAILURE); // exit child process
+      if (-1 == pipes[i][1])
+         continue;
+      close(pipes[i][1]);
+      pipes[i][1] = -1;
+      fds[i].fd = pipes[i][0];
+      nOpen++;
    }
-   else
-   {
-      // Returned in the parent process, need to wait for child process to finish
-      rtnVal = waitpid(pid, &status, 0);
 
-      if (-1 == rtnVal)
+   while (nOpen > 0)
+   {
+      if (poll(fds, 2, -1) < 0)
       {
-         syslog(LOG_ERR, "Child process failed");
+         if (EINTR == errno)
+            continue;
+         AESD_LOG(LOG_ERR, "poll on output pipes failed: %s", strerror(errno));
          exitVal = false;
+         break;
       }
 
-      // Check if the child process exited normally
-      if (!WIFEXITED(status))
+      for (i = 0; i < 2; i++)
       {
-         syslog(LOG_ERR, "Child process exit it with issues, exit status=%d ", WEXITSTATUS(status));
-         exitVal = false;
-      }
-      else
-      {
-         if (WEXITSTATUS(status))
+         if ((-1 == fds[i].fd) || (0 == fds[i].revents))
+            continue;
+
+         nRead = read(fds[i].fd, chunk, sizeof(chunk));
+         if ((nRead < 0) && (EINTR == errno))
+            continue;
+         if (nRead <= 0)
          {
-            // child process exit with nonzero return
-            syslog(LOG_INFO, "child process WEXITSTATUS %d", WEXITSTATUS(status));
+            // End of output, poll() skips negative descriptors
+            fds[i].fd = -1;
+            nOpen--;
+            continue;
+         }
+
+         // Keep draining after running out of memory so the child doesn't block
+         if ((NULL != buffers[i]) && !exec_buffer_append(buffers[i], chunk, nRead))
+         {
+            AESD_LOG(LOG_ERR, "Out of memory capturing output of %s", command[0]);
             exitVal = false;
          }
+         if (NULL != callback)
+            callback((0 == i) ? STDOUT_FILENO : STDERR_FILENO, chunk, nRead, context);
       }
    }
 
+   if (!wait_child(pid, &status) || !child_succeeded(status))
+      exitVal = false;
+
+done:
+   for (i = 0; i < 2; i++)
+   {
+      if (-1 != pipes[i][0])
+         close(pipes[i][0]);
+      if (-1 != pipes[i][1])
+         close(pipes[i][1]);
+   }
    return exitVal;
 }
@@ -1,9 +1,35 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
+
+// Outcome of one command run by do_exec_batch()
+struct exec_result
+{
+   bool success;        // true if the command ran and exited with a zero status
+   int status;          // wait status from waitpid(), -1 if the command could not be run
+   double elapsed_sec;  // time from starting the command to reaping it
+};
+
+// Growable buffer filled by do_exec_capture(), data is kept NUL terminated
+struct exec_buffer
+{
+   char *data;          // allocated with realloc(), freed by the caller
+   size_t size;         // bytes captured, not counting the terminating NUL
+   size_t capacity;     // bytes allocated
+};
+
+// Called by do_exec_capture() with each chunk read from @param stream, STDOUT_FILENO or STDERR_FILENO
+typedef void (*exec_output_cb)(int stream, const char *data, size_t size, void *context);
 
 bool do_system(const char *command);
 
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+bool do_exec_batch(char *const *commands[], size_t count, unsigned int max_parallel,
+                   struct exec_result results[]);
+
+bool do_exec_capture(char *const command[], struct exec_buffer *out, struct exec_buffer *err,
+                     exec_output_cb callback, void *context);
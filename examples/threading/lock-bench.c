@@ -0,0 +1,240 @@
+/**
+ * @file lock-bench.c
+ * @author Kenneth A. Jones
+ * @date 2022-04-03
+ *
+ * @brief Throughput of adaptive_mutex_t and rwlock_t against their pthread counterparts
+ *      as the number of threads grows.  The critical section is ring index bookkeeping
+ *      like the circular buffer's, so it is as short as the locks it protects.
+ *
+ *      Build: gcc -O2 -Wall lock-bench.c threading.c -pthread -o lock-bench
+ *      Usage: lock-bench [operations per thread] [threads ...]
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+// ============================================================================
+// INCLUDES
+// ============================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "threading.h"
+
+// ============================================================================
+// PRIVATE MACROS AND DEFINES
+// ============================================================================
+
+#define DEFAULT_OPERATIONS 200000
+#define MAX_THREADS 64
+#define RING_SIZE 10
+
+// One operation in WRITE_EVERY writes, the rest read, for the rwlocks
+#define WRITE_EVERY 10
+
+// Work between operations, so threads don't only hammer the lock
+#define OUTSIDE_WORK 50
+
+// ============================================================================
+// PRIVATE TYPEDEFS
+// ============================================================================
+
+typedef struct
+{
+    const char *name;
+    void (*lock)(bool write);
+    void (*unlock)(void);
+} lock_ops_t;
+
+// ============================================================================
+// STATIC VARIABLES
+// ============================================================================
+
+static pthread_mutex_t pthreadMutex = PTHREAD_MUTEX_INITIALIZER;
+static adaptive_mutex_t adaptiveMutex = ADAPTIVE_MUTEX_INITIALIZER;
+static pthread_rwlock_t pthreadRwlock = PTHREAD_RWLOCK_INITIALIZER;
+static rwlock_t rwlock = RWLOCK_INITIALIZER;
+
+// Protected state
+static unsigned int inOffs;
+static unsigned int outOffs;
+static unsigned long total;
+
+static const lock_ops_t *pOps;
+static unsigned long operations;
+static pthread_barrier_t startBarrier;
+
+// ============================================================================
+// PRIVATE FUNCTIONS
+// ============================================================================
+
+static void pthread_mutex_op_lock(bool write)
+{
+    (void)write;
+    pthread_mutex_lock(&pthreadMutex);
+}
+
+static void pthread_mutex_op_unlock(void)
+{
+    pthread_mutex_unlock(&pthreadMutex);
+}
+
+static void adaptive_mutex_op_lock(bool write)
+{
+    (void)write;
+    adaptive_mutex_lock(&adaptiveMutex);
+}
+
+static void adaptive_mutex_op_unlock(void)
+{
+    adaptive_mutex_unlock(&adaptiveMutex);
+}
+
+static void pthread_rwlock_op_lock(bool write)
+{
+    if (write)
+        pthread_rwlock_wrlock(&pthreadRwlock);
+    else
+        pthread_rwlock_rdlock(&pthreadRwlock);
+}
+
+static void pthread_rwlock_op_unlock(void)
+{
+    pthread_rwlock_unlock(&pthreadRwlock);
+}
+
+static void rwlock_op_lock(bool write)
+{
+    if (write)
+        rwlock_wrlock(&rwlock);
+    else
+        rwlock_rdlock(&rwlock);
+}
+
+static void rwlock_op_unlock(void)
+{
+    rwlock_unlock(&rwlock);
+}
+
+static const lock_ops_t lockOps[] = {
+    {"pthread_mutex", pthread_mutex_op_lock, pthread_mutex_op_unlock},
+    {"adaptive_mutex", adaptive_mutex_op_lock, adaptive_mutex_op_unlock},
+    {"pthread_rwlock", pthread_rwlock_op_lock, pthread_rwlock_op_unlock},
+    {"rwlock", rwlock_op_lock, rwlock_op_unlock},
+};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void *bench_thread(void *arg)
+{
+    volatile unsigned int work;
+    unsigned long index;
+    unsigned int seen = 0;
+    bool write;
+    int spin;
+
+    (void)arg;
+    pthread_barrier_wait(&startBarrier);
+    for (index = 0; index < operations; index++)
+    {
+        // One in WRITE_EVERY updates the ring, the mutexes make the reads exclusive too
+        write = ((index % WRITE_EVERY) == 0);
+        pOps->lock(write);
+        if (write)
+        {
+            inOffs = (inOffs + 1) % RING_SIZE;
+            if (inOffs == outOffs)
+                outOffs = (outOffs + 1) % RING_SIZE;
+            total++;
+        }
+        else
+        {
+            seen += inOffs + outOffs;
+        }
+        pOps->unlock();
+
+        for (spin = 0, work = seen; spin < OUTSIDE_WORK; spin++)
+            work = work * 31 + spin;
+    }
+    return NULL;
+}
+
+/**
+ * Run @param nThreads threads of the benchmark on the current lock
+ * @return million operations per second
+ */
+static double run(int nThreads)
+{
+    pthread_t threads[MAX_THREADS];
+    double start;
+    int index;
+
+    pthread_barrier_init(&startBarrier, NULL, nThreads + 1);
+    for (index = 0; index < nThreads; index++)
+    {
+        if (pthread_create(&threads[index], NULL, bench_thread, NULL) != 0)
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Timed from before the release, the workers may finish before this thread runs again
+    start = now_sec();
+    pthread_barrier_wait(&startBarrier);
+    for (index = 0; index < nThreads; index++)
+        pthread_join(threads[index], NULL);
+    pthread_barrier_destroy(&startBarrier);
+
+    return (nThreads * operations) / ((now_sec() - start) * 1e6);
+}
+
+// ============================================================================
+// MAIN
+// ============================================================================
+
+int main(int argc, char *argv[])
+{
+    static const char *defaultThreads[] = {"1", "2", "4", "8", "16", "32", "64"};
+    const char **threads = (argc > 2) ? (const char **)&argv[2] : defaultThreads;
+    int nCounts = (argc > 2) ? (argc - 2) : (int)(sizeof(defaultThreads) / sizeof(defaultThreads[0]));
+    unsigned int lock;
+    int nThreads;
+    int index;
+
+    operations = (argc > 1) ? strtoul(argv[1], NULL, 0) : DEFAULT_OPERATIONS;
+
+    printf("%8s", "threads");
+    for (lock = 0; lock < sizeof(lockOps) / sizeof(lockOps[0]); lock++)
+        printf(" %15s", lockOps[lock].name);
+    printf("   (Mops/s, rwlocks write 1 in %d)\n", WRITE_EVERY);
+
+    for (index = 0; index < nCounts; index++)
+    {
+        nThreads = atoi(threads[index]);
+        if ((nThreads < 1) || (nThreads > MAX_THREADS))
+        {
+            fprintf(stderr, "threads must be 1 to %d\n", MAX_THREADS);
+            return EXIT_FAILURE;
+        }
+
+        printf("%8d", nThreads);
+        for (lock = 0; lock < sizeof(lockOps) / sizeof(lockOps[0]); lock++)
+        {
+            pOps = &lockOps[lock];
+            printf(" %15.2f", run(nThreads));
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -4,24 +4,184 @@
  * @date 2022-01-25
  * 
  * @brief Implementation of threading for assignment 4.  Modified original code provide by ECEN 5713 
+ *    and a work stealing thread pool running tasks on reusable threads.
  * 
  * @copyright Copyright (c) 2022
  * 
  */
 
 #include "threading.h"
+#include "../lockprof/lockprof.h"
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// Initial number of tasks each worker's deque holds, it grows as needed
+#define DEQUE_MIN_CAPACITY 64
 
 // Macro to convert to microseconds
 #define MSECTOUSEC(x) (x * 1000)
 
+#define NSEC_PER_SEC 1000000000L
+#define NSEC_PER_MSEC 1000000L
+
+// Slots of a timer wheel, timers further out than this many ticks wait extra turns
+#define WHEEL_SLOTS 256
+
+// Most spins of a contended adaptive_mutex_lock() before it parks
+#define MUTEX_MAX_SPINS 100
+
+// Spins of a contended rwlock before it parks
+#define RWLOCK_SPINS 50
+
+// rwlock_t state while write locked
+#define RWLOCK_WRITER UINT_MAX
+
+// State of a future, the worker never touches it again once it is FUTURE_DONE
+enum future_state
+{
+   FUTURE_PENDING,
+   FUTURE_WAITED,               // a thread is blocked in thread_future_wait()
+   FUTURE_DONE
+};
+
+// Task queued on a pool, and its result
+struct thread_future
+{
+   thread_task_fn task;
+   void *arg;
+   struct thread_pool *pool;
+   atomic_int state;
+   bool thread_complete_success;
+};
+
+// Deque of futures, the owner works at the tail and thieves take from the head
+struct task_deque
+{
+   pthread_mutex_t lock;
+   struct thread_future **items;
+   size_t capacity;             // power of 2
+   size_t head;
+   atomic_size_t count;         // read without the lock to skip empty deques
+};
+
+struct pool_worker
+{
+   pthread_t thread;
+   struct thread_pool *pool;
+   struct task_deque deque;
+};
+
+struct thread_pool
+{
+   struct pool_worker *workers;
+   unsigned int nWorkers;
+   atomic_uint nextWorker;      // deque for the next submission from outside the pool
+   atomic_size_t queued;        // futures in all deques
+   atomic_uint idle;            // workers blocked, or about to block, on workCond
+   atomic_bool stopping;
+   pthread_mutex_t lock;
+   pthread_cond_t workCond;     // work queued or pool stopping
+   pthread_cond_t doneCond;     // a waited on future completed
+};
+
+// Timer waiting in a wheel, it becomes the task of its future once due
+struct timer_entry
+{
+   struct timer_entry *pNext;
+   uint64_t tick;               // first tick at or after deadline
+   struct timespec deadline;
+   thread_task_fn task;
+   void *arg;
+   void (*cancel)(void *arg);   // frees arg if the timer is cancelled, or NULL
+   struct timer_wheel *pWheel;
+   struct thread_future *pFuture;
+};
+
+struct timer_wheel
+{
+   struct thread_pool *pool;
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;         // CLOCK_MONOTONIC, timer added before nextTick or stopping
+   pthread_cond_t idleCond;     // outstanding reached 0
+   struct timespec start;       // time of tick 0
+   long tickNs;
+   uint64_t tick;               // last tick processed
+   uint64_t nextTick;           // earliest tick with a timer, UINT64_MAX if none
+   struct timer_entry *slots[WHEEL_SLOTS];
+   unsigned long pending;       // timers in slots
+   unsigned long outstanding;   // timers scheduled whose task has not finished
+   bool stopping;
+   struct timer_jitter jitter;
+};
+
+// Profile of every thread_data mutex, when built with -DLOCKPROF and lockprof.c
+static lockprof_site_t threadMutexSite = LOCKPROF_SITE_INITIALIZER("thread_mutex");
+
+// Worker the calling thread runs as, NULL outside any pool
+static __thread struct pool_worker *pCurrentWorker;
+
 // Optional: use these functions to add debug or error prints to your application
 #define DEBUG_LOG(msg,...)
 //#define DEBUG_LOG(msg,...) printf("threading: " msg "\n" , ##__VA_ARGS__)
 #define ERROR_LOG(msg,...) printf("threading ERROR: " msg "\n" , ##__VA_ARGS__)
 
+static void timespec_add_ns(struct timespec *pTime, long long ns)
+{
+   ns += pTime->tv_nsec;
+   pTime->tv_sec += ns / NSEC_PER_SEC;
+   pTime->tv_nsec = ns % NSEC_PER_SEC;
+   if (pTime->tv_nsec < 0)
+   {
+      pTime->tv_sec--;
+      pTime->tv_nsec += NSEC_PER_SEC;
+   }
+}
+
+static long long timespec_diff_ns(const struct timespec *pEnd, const struct timespec *pStart)
+{
+   return ((long long)(pEnd->tv_sec - pStart->tv_sec) * NSEC_PER_SEC) + (pEnd->tv_nsec - pStart->tv_nsec);
+}
+
+/**
+ * Sleep until the CLOCK_MONOTONIC time @param pDeadline.  Sleeping to an absolute deadline
+ * neither drifts nor shortens when a signal interrupts it, the sleep just resumes.
+ * @return 0 or the error of clock_nanosleep()
+ */
+static int sleep_until(const struct timespec *pDeadline)
+{
+   int res;
+
+   do
+   {
+      res = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, pDeadline, NULL);
+   } while (EINTR == res);
+
+   return res;
+}
+
+/**
+ * Sleep @param ms milliseconds from now
+ * @return 0 or the error of clock_gettime() or clock_nanosleep()
+ */
+static int sleep_ms(int ms)
+{
+   struct timespec deadline;
+
+   if (0 != clock_gettime(CLOCK_MONOTONIC, &deadline))
+      return errno;
+   timespec_add_ns(&deadline, (long long)ms * NSEC_PER_MSEC);
+   return sleep_until(&deadline);
+}
+
 void* threadfunc(void* thread_param)
 {
    // Wait, obtain mutex, wait, release mutex as described by thread_data structure
@@ -33,7 +193,7 @@ void* threadfunc(void* thread_param)
    struct thread_data *pThreadParams = (struct thread_data *) thread_param;
 
    // Wait predetermined time before acquiring lock
-   res = usleep(pThreadParams->wait_before_lock_ms * 1000);
+   res = sleep_ms(pThreadParams->wait_before_lock_ms);
    if (0 != res)
    {
       ERROR_LOG("Failed to suspend thread for %dms", pThreadParams->wait_before_lock_ms);
@@ -42,7 +202,7 @@ void* threadfunc(void* thread_param)
    }
 
    // Obtain thread mutex lock
-   res = pthread_mutex_lock(pThreadParams->thread_mutex);
+   res = lockprof_lock(pThreadParams->thread_mutex, &threadMutexSite);
    if (0 != res)
    {
       ERROR_LOG("Failed to obtain thread mutex lock");
@@ -51,7 +211,7 @@ void* threadfunc(void* thread_param)
    }
 
    // Wait predetermined time after releasing lock
-   res = usleep(pThreadParams->wait_after_lock_ms * 1000);
+   res = sleep_ms(pThreadParams->wait_after_lock_ms);
    if (0 != res)
    {
       ERROR_LOG("Failed to suspend thread for %dms", pThreadParams->wait_after_lock_ms);
@@ -60,7 +220,7 @@ void* threadfunc(void* thread_param)
    }
 
    // Release thread lock
-   res = pthread_mutex_unlock(pThreadParams->thread_mutex);
+   res = lockprof_unlock(pThreadParams->thread_mutex, &threadMutexSite);
    if (0 != res)
    {
       ERROR_LOG("Failed to release thread mutex lock");
@@ -101,14 +261,1000 @@ bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int
    pThreadDataParam->wait_after_lock_ms = wait_to_release_ms;
    pThreadDataParam->thread_mutex = mutex;
 
+   pThreadDataParam->thread_complete_success = false;
+
    // Create thread using threadfunc() and pThreadDataParam as arguments
    res = pthread_create(thread, NULL, &threadfunc, (void *)pThreadDataParam);
    if (0 != res)
    {
       ERROR_LOG("Failed to create new thread");
+      free(pThreadDataParam);
+      return false;
+   }
+
+   return true;
+}
+
+
+static bool deque_init(struct task_deque *pDeque)
+{
+   pthread_mutex_init(&pDeque->lock, NULL);
+   pDeque->capacity = DEQUE_MIN_CAPACITY;
+   pDeque->head = 0;
+   atomic_init(&pDeque->count, 0);
+   pDeque->items = malloc(pDeque->capacity * sizeof(struct thread_future *));
+   return NULL != pDeque->items;
+}
+
+/**
+ * Add @param pFuture at the tail of @param pDeque, growing it when full
+ * @return false if out of memory
+ */
+static bool deque_push(struct task_deque *pDeque, struct thread_future *pFuture)
+{
+   struct thread_future **pItems;
+   size_t index;
+
+   pthread_mutex_lock(&pDeque->lock);
+   if (pDeque->count == pDeque->capacity)
+   {
+      pItems = malloc(2 * pDeque->capacity * sizeof(struct thread_future *));
+      if (NULL == pItems)
+      {
+         pthread_mutex_unlock(&pDeque->lock);
+         return false;
+      }
+      for (index = 0; index < pDeque->count; index++)
+         pItems[index] = pDeque->items[(pDeque->head + index) & (pDeque->capacity - 1)];
+      free(pDeque->items);
+      pDeque->items = pItems;
+      pDeque->capacity *= 2;
+      pDeque->head = 0;
+   }
+   pDeque->items[(pDeque->head + pDeque->count) & (pDeque->capacity - 1)] = pFuture;
+   atomic_fetch_add(&pDeque->count, 1);
+   pthread_mutex_unlock(&pDeque->lock);
+   return true;
+}
+
+/**
+ * Take a future from the tail of @param pDeque if @param tail, the most recently queued
+ * which is most likely still in cache, otherwise from the head
+ * @return the future or NULL if the deque is empty
+ */
+static struct thread_future *deque_take(struct task_deque *pDeque, bool tail)
+{
+   struct thread_future *pFuture = NULL;
+
+   // Skip empty deques without taking their lock
+   if (0 == atomic_load_explicit(&pDeque->count, memory_order_relaxed))
+      return NULL;
+
+   pthread_mutex_lock(&pDeque->lock);
+   if (pDeque->count > 0)
+   {
+      atomic_fetch_sub(&pDeque->count, 1);
+      if (tail)
+      {
+         pFuture = pDeque->items[(pDeque->head + pDeque->count) & (pDeque->capacity - 1)];
+      }
+      else
+      {
+         pFuture = pDeque->items[pDeque->head];
+         pDeque->head = (pDeque->head + 1) & (pDeque->capacity - 1);
+      }
+   }
+   pthread_mutex_unlock(&pDeque->lock);
+   return pFuture;
+}
+
+/**
+ * Find a queued future for @param pWorker, its own newest first, then the oldest of
+ * the other workers starting from its neighbour
+ * @return the future or NULL if nothing is queued
+ */
+static struct thread_future *pool_next_task(struct thread_pool *pPool, struct pool_worker *pWorker)
+{
+   struct thread_future *pFuture;
+   unsigned int start = pWorker - pPool->workers;
+   unsigned int index;
+
+   pFuture = deque_take(&pWorker->deque, true);
+   for (index = 1; (NULL == pFuture) && (index < pPool->nWorkers); index++)
+      pFuture = deque_take(&pPool->workers[(start + index) % pPool->nWorkers].deque, false);
+
+   if (NULL != pFuture)
+      atomic_fetch_sub(&pPool->queued, 1);
+   return pFuture;
+}
+
+/**
+ * Complete @param pFuture with @param success and wake its waiter, if any
+ */
+static void future_complete(struct thread_future *pFuture, bool success)
+{
+   struct thread_pool *pPool = pFuture->pool;
+
+   pFuture->thread_complete_success = success;
+
+   // Only take the lock when a thread is blocked on this future
+   if (FUTURE_WAITED == atomic_exchange(&pFuture->state, FUTURE_DONE))
+   {
+      pthread_mutex_lock(&pPool->lock);
+      pthread_cond_broadcast(&pPool->doneCond);
+      pthread_mutex_unlock(&pPool->lock);
+   }
+}
+
+static void pool_run_task(struct thread_future *pFuture)
+{
+   future_complete(pFuture, pFuture->task(pFuture->arg));
+}
+
+static void *pool_worker_thread(void *arg)
+{
+   struct pool_worker *pWorker = (struct pool_worker *)arg;
+   struct thread_pool *pPool = pWorker->pool;
+   struct thread_future *pFuture;
+
+   pCurrentWorker = pWorker;
+   while (true)
+   {
+      pFuture = pool_next_task(pPool, pWorker);
+      if (NULL != pFuture)
+      {
+         pool_run_task(pFuture);
+         continue;
+      }
+
+      // Sleep until work is queued, announcing it first so submitters know to signal
+      pthread_mutex_lock(&pPool->lock);
+      atomic_fetch_add(&pPool->idle, 1);
+      while ((0 == atomic_load(&pPool->queued)) && !atomic_load(&pPool->stopping))
+         pthread_cond_wait(&pPool->workCond, &pPool->lock);
+      atomic_fetch_sub(&pPool->idle, 1);
+      pthread_mutex_unlock(&pPool->lock);
+
+      // Finish everything queued before stopping
+      if ((0 == atomic_load(&pPool->queued)) && atomic_load(&pPool->stopping))
+         break;
+   }
+
+   pCurrentWorker = NULL;
+   return NULL;
+}
+
+/**
+ * Stop the first @param nStarted workers of @param pPool once they have run every queued
+ * task, then free the pool and the first @param nDeques deques
+ */
+static void pool_free(struct thread_pool *pPool, unsigned int nDeques, unsigned int nStarted)
+{
+   unsigned int index;
+
+   pthread_mutex_lock(&pPool->lock);
+   atomic_store(&pPool->stopping, true);
+   pthread_cond_broadcast(&pPool->workCond);
+   pthread_mutex_unlock(&pPool->lock);
+
+   for (index = 0; index < nStarted; index++)
+      pthread_join(pPool->workers[index].thread, NULL);
+
+   for (index = 0; index < nDeques; index++)
+   {
+      pthread_mutex_destroy(&pPool->workers[index].deque.lock);
+      free(pPool->workers[index].deque.items);
+   }
+
+   pthread_cond_destroy(&pPool->doneCond);
+   pthread_cond_destroy(&pPool->workCond);
+   pthread_mutex_destroy(&pPool->lock);
+   free(pPool->workers);
+   free(pPool);
+}
+
+struct thread_pool *thread_pool_create(unsigned int num_threads)
+{
+   struct thread_pool *pPool;
+   unsigned int index;
+   long nCpus;
+   int res;
+
+   if (0 == num_threads)
+   {
+      nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+      num_threads = (nCpus > 0) ? nCpus : 1;
+   }
+
+   pPool = (struct thread_pool *)calloc(1, sizeof(struct thread_pool));
+   if (NULL == pPool)
+   {
+      ERROR_LOG("Failed to allocate memory for thread pool");
+      return NULL;
+   }
+   pPool->workers = (struct pool_worker *)calloc(num_threads, sizeof(struct pool_worker));
+   if (NULL == pPool->workers)
+   {
+      ERROR_LOG("Failed to allocate memory for %u pool workers", num_threads);
+      free(pPool);
+      return NULL;
+   }
+   pthread_mutex_init(&pPool->lock, NULL);
+   pthread_cond_init(&pPool->workCond, NULL);
+   pthread_cond_init(&pPool->doneCond, NULL);
+
+   // Every deque must exist before any worker looks for work to steal
+   for (index = 0; index < num_threads; index++)
+   {
+      pPool->workers[index].pool = pPool;
+      if (!deque_init(&pPool->workers[index].deque))
+      {
+         ERROR_LOG("Failed to allocate memory for pool worker deque");
+         pool_free(pPool, index + 1, 0);
+         return NULL;
+      }
+   }
+   pPool->nWorkers = num_threads;
+
+   for (index = 0; index < num_threads; index++)
+   {
+      res = pthread_create(&pPool->workers[index].thread, NULL, &pool_worker_thread, &pPool->workers[index]);
+      if (0 != res)
+      {
+         ERROR_LOG("Failed to create pool worker thread");
+         pool_free(pPool, num_threads, index);
+         return NULL;
+      }
+   }
+
+   DEBUG_LOG("Created pool of %u threads", pPool->nWorkers);
+   return pPool;
+}
+
+static struct thread_future *future_alloc(struct thread_pool *pPool, thread_task_fn task, void *arg)
+{
+   struct thread_future *pFuture;
+
+   pFuture = (struct thread_future *)malloc(sizeof(struct thread_future));
+   if (NULL == pFuture)
+   {
+      ERROR_LOG("Failed to allocate memory for future");
+      return NULL;
+   }
+   pFuture->task = task;
+   pFuture->arg = arg;
+   pFuture->pool = pPool;
+   atomic_init(&pFuture->state, FUTURE_PENDING);
+   pFuture->thread_complete_success = false;
+   return pFuture;
+}
+
+/**
+ * Queue @param pFuture on a worker of @param pPool and wake a worker to run it
+ * @return false if out of memory
+ */
+static bool pool_queue(struct thread_pool *pPool, struct thread_future *pFuture)
+{
+   struct pool_worker *pWorker;
+
+   // Keep tasks queued by a task local to its worker, spread the others
+   pWorker = pCurrentWorker;
+   if ((NULL == pWorker) || (pWorker->pool != pPool))
+      pWorker = &pPool->workers[atomic_fetch_add(&pPool->nextWorker, 1) % pPool->nWorkers];
+   if (!deque_push(&pWorker->deque, pFuture))
+   {
+      ERROR_LOG("Failed to allocate memory for task queue");
       return false;
    }
+   atomic_fetch_add(&pPool->queued, 1);
+
+   // Wake a worker if any are asleep, queued is counted first so none can miss it
+   if (atomic_load(&pPool->idle) > 0)
+   {
+      pthread_mutex_lock(&pPool->lock);
+      pthread_cond_signal(&pPool->workCond);
+      pthread_mutex_unlock(&pPool->lock);
+   }
 
    return true;
 }
 
+struct thread_future *thread_pool_submit(struct thread_pool *pool, thread_task_fn task, void *arg)
+{
+   struct thread_future *pFuture;
+
+   // Tasks still running while the pool is destroyed may queue more
+   if (atomic_load(&pool->stopping) && ((NULL == pCurrentWorker) || (pCurrentWorker->pool != pool)))
+   {
+      ERROR_LOG("Task submitted to a pool being destroyed");
+      return NULL;
+   }
+
+   pFuture = future_alloc(pool, task, arg);
+   if ((NULL != pFuture) && !pool_queue(pool, pFuture))
+   {
+      free(pFuture);
+      return NULL;
+   }
+   return pFuture;
+}
+
+/**
+ * Pool task running threadfunc() on the thread_data in @param arg, then freeing it
+ */
+static bool obtaining_mutex_task(void *arg)
+{
+   struct thread_data *pThreadData = (struct thread_data *)threadfunc(arg);
+   bool success = pThreadData->thread_complete_success;
+
+   free(pThreadData);
+   return success;
+}
+
+struct thread_future *thread_pool_submit_obtaining_mutex(struct thread_pool *pool, pthread_mutex_t *mutex,
+                                                         int wait_to_obtain_ms, int wait_to_release_ms)
+{
+   struct thread_data *pThreadDataParam;
+   struct thread_future *pFuture;
+
+   pThreadDataParam = (struct thread_data *)malloc(sizeof(struct thread_data));
+   if (NULL == pThreadDataParam)
+   {
+      ERROR_LOG("Failed to allocated memory for thread data structure");
+      return NULL;
+   }
+   pThreadDataParam->wait_before_lock_ms = wait_to_obtain_ms;
+   pThreadDataParam->wait_after_lock_ms = wait_to_release_ms;
+   pThreadDataParam->thread_mutex = mutex;
+   pThreadDataParam->thread_complete_success = false;
+
+   pFuture = thread_pool_submit(pool, &obtaining_mutex_task, pThreadDataParam);
+   if (NULL == pFuture)
+      free(pThreadDataParam);
+   return pFuture;
+}
+
+bool thread_future_done(struct thread_future *future)
+{
+   return FUTURE_DONE == atomic_load(&future->state);
+}
+
+bool thread_future_wait(struct thread_future *future)
+{
+   struct thread_pool *pPool = future->pool;
+   struct thread_future *pOther;
+   int state = FUTURE_PENDING;
+   bool success;
+
+   // A worker helps out instead of blocking, so tasks waiting on tasks can't starve the pool
+   if ((NULL != pCurrentWorker) && (pCurrentWorker->pool == pPool))
+   {
+      while (FUTURE_DONE != atomic_load(&future->state))
+      {
+         pOther = pool_next_task(pPool, pCurrentWorker);
+         if (NULL == pOther)
+            break;
+         pool_run_task(pOther);
+      }
+   }
+
+   // Nothing left queued, the task is running on another worker
+   if (atomic_compare_exchange_strong(&future->state, &state, FUTURE_WAITED))
+   {
+      pthread_mutex_lock(&pPool->lock);
+      while (FUTURE_DONE != atomic_load(&future->state))
+         pthread_cond_wait(&pPool->doneCond, &pPool->lock);
+      pthread_mutex_unlock(&pPool->lock);
+   }
+
+   success = future->thread_complete_success;
+   free(future);
+   return success;
+}
+
+void thread_pool_destroy(struct thread_pool *pool)
+{
+   pool_free(pool, pool->nWorkers, pool->nWorkers);
+}
+
+/**
+ * Pool task of a due timer, records how late it started and runs the timer's task
+ */
+static bool timer_task(void *arg)
+{
+   struct timer_entry *pEntry = (struct timer_entry *)arg;
+   struct timer_wheel *pWheel = pEntry->pWheel;
+   struct timer_jitter *pJitter = &pWheel->jitter;
+   struct timespec now;
+   long long lateNs;
+   bool success;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   lateNs = timespec_diff_ns(&now, &pEntry->deadline);
+
+   pthread_mutex_lock(&pWheel->lock);
+   if ((0 == pJitter->count) || (lateNs < pJitter->min_ns))
+      pJitter->min_ns = lateNs;
+   if ((0 == pJitter->count) || (lateNs > pJitter->max_ns))
+      pJitter->max_ns = lateNs;
+   pJitter->total_ns += lateNs;
+   pJitter->count++;
+   pthread_mutex_unlock(&pWheel->lock);
+
+   success = pEntry->task(pEntry->arg);
+
+   // The wheel may be freed as soon as outstanding is 0
+   pthread_mutex_lock(&pWheel->lock);
+   if (0 == --pWheel->outstanding)
+      pthread_cond_broadcast(&pWheel->idleCond);
+   pthread_mutex_unlock(&pWheel->lock);
+
+   free(pEntry);
+   return success;
+}
+
+/**
+ * Queue the tasks of the timers in the list at @param pEntry on the pool of @param pWheel
+ */
+static void wheel_dispatch(struct timer_wheel *pWheel, struct timer_entry *pEntry)
+{
+   struct timer_entry *pNext;
+
+   for (; NULL != pEntry; pEntry = pNext)
+   {
+      pNext = pEntry->pNext;
+      if (!pool_queue(pWheel->pool, pEntry->pFuture))
+      {
+         if (NULL != pEntry->cancel)
+            pEntry->cancel(pEntry->arg);
+         future_complete(pEntry->pFuture, false);
+         pthread_mutex_lock(&pWheel->lock);
+         if (0 == --pWheel->outstanding)
+            pthread_cond_broadcast(&pWheel->idleCond);
+         pthread_mutex_unlock(&pWheel->lock);
+         free(pEntry);
+      }
+   }
+}
+
+/**
+ * Tick of @param pWheel that @param pTime falls in
+ */
+static uint64_t wheel_tick_of(const struct timer_wheel *pWheel, const struct timespec *pTime)
+{
+   long long ns = timespec_diff_ns(pTime, &pWheel->start);
+
+   return (ns > 0) ? (uint64_t)(ns / pWheel->tickNs) : 0;
+}
+
+/**
+ * Earliest tick of a timer on @param pWheel, called with the lock held
+ * @return UINT64_MAX if no timer is pending
+ */
+static uint64_t wheel_next_tick(const struct timer_wheel *pWheel)
+{
+   const struct timer_entry *pEntry;
+   uint64_t nextTick = UINT64_MAX;
+   uint64_t tick;
+
+   // Slots are visited in tick order, so a timer due in the current revolution ends the search
+   for (tick = pWheel->tick + 1; (0 < pWheel->pending) && (tick <= pWheel->tick + WHEEL_SLOTS); tick++)
+   {
+      for (pEntry = pWheel->slots[tick % WHEEL_SLOTS]; NULL != pEntry; pEntry = pEntry->pNext)
+      {
+         if (pEntry->tick == tick)
+            return tick;
+         if (pEntry->tick < nextTick)
+            nextTick = pEntry->tick;
+      }
+   }
+   return nextTick;
+}
+
+static void *timer_wheel_thread(void *arg)
+{
+   struct timer_wheel *pWheel = (struct timer_wheel *)arg;
+   struct timer_entry *pDue;
+   struct timer_entry **ppEntry;
+   struct timer_entry *pEntry;
+   struct timespec now;
+   struct timespec next;
+   uint64_t nowTick;
+   uint64_t tick;
+
+   pthread_mutex_lock(&pWheel->lock);
+   while (!pWheel->stopping)
+   {
+      // Collect the timers of every tick passed since the last pass, each slot once
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      nowTick = wheel_tick_of(pWheel, &now);
+      pDue = NULL;
+      for (tick = pWheel->tick + 1; (tick <= nowTick) && (tick <= pWheel->tick + WHEEL_SLOTS); tick++)
+      {
+         ppEntry = &pWheel->slots[tick % WHEEL_SLOTS];
+         while (NULL != (pEntry = *ppEntry))
+         {
+            if (pEntry->tick <= nowTick)
+            {
+               *ppEntry = pEntry->pNext;
+               pEntry->pNext = pDue;
+               pDue = pEntry;
+               pWheel->pending--;
+            }
+            else
+            {
+               ppEntry = &pEntry->pNext;
+            }
+         }
+      }
+      if (nowTick > pWheel->tick)
+         pWheel->tick = nowTick;
+      pWheel->nextTick = wheel_next_tick(pWheel);
+
+      if (NULL != pDue)
+      {
+         pthread_mutex_unlock(&pWheel->lock);
+         wheel_dispatch(pWheel, pDue);
+         pthread_mutex_lock(&pWheel->lock);
+         continue;
+      }
+
+      // Sleep until the tick of the earliest timer, submit wakes the thread for an earlier one
+      if (UINT64_MAX == pWheel->nextTick)
+      {
+         pthread_cond_wait(&pWheel->cond, &pWheel->lock);
+      }
+      else
+      {
+         next = pWheel->start;
+         timespec_add_ns(&next, (long long)pWheel->nextTick * pWheel->tickNs);
+         pthread_cond_timedwait(&pWheel->cond, &pWheel->lock, &next);
+      }
+   }
+   pthread_mutex_unlock(&pWheel->lock);
+
+   return NULL;
+}
+
+struct timer_wheel *timer_wheel_create(struct thread_pool *pool, unsigned int tick_ms)
+{
+   struct timer_wheel *pWheel;
+   pthread_condattr_t attr;
+   int res;
+
+   pWheel = (struct timer_wheel *)calloc(1, sizeof(struct timer_wheel));
+   if (NULL == pWheel)
+   {
+      ERROR_LOG("Failed to allocate memory for timer wheel");
+      return NULL;
+   }
+   pWheel->pool = pool;
+   pWheel->tickNs = ((0 == tick_ms) ? 1 : tick_ms) * NSEC_PER_MSEC;
+   pWheel->nextTick = UINT64_MAX;
+   clock_gettime(CLOCK_MONOTONIC, &pWheel->start);
+
+   // Tick deadlines are CLOCK_MONOTONIC so setting the clock doesn't move them
+   pthread_mutex_init(&pWheel->lock, NULL);
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&pWheel->cond, &attr);
+   pthread_condattr_destroy(&attr);
+   pthread_cond_init(&pWheel->idleCond, NULL);
+
+   res = pthread_create(&pWheel->thread, NULL, &timer_wheel_thread, pWheel);
+   if (0 != res)
+   {
+      ERROR_LOG("Failed to create timer wheel thread");
+      pthread_cond_destroy(&pWheel->idleCond);
+      pthread_cond_destroy(&pWheel->cond);
+      pthread_mutex_destroy(&pWheel->lock);
+      free(pWheel);
+      return NULL;
+   }
+
+   return pWheel;
+}
+
+/**
+ * Queue @param task for @param delay_ms on @param pWheel, calling @param cancel with
+ * @param arg if the timer is cancelled
+ */
+static struct thread_future *wheel_submit(struct timer_wheel *pWheel, unsigned int delay_ms, thread_task_fn task,
+                                          void *arg, void (*cancel)(void *arg))
+{
+   struct timer_entry *pEntry;
+   struct thread_future *pFuture;
+
+   pEntry = (struct timer_entry *)malloc(sizeof(struct timer_entry));
+   pFuture = (NULL != pEntry) ? future_alloc(pWheel->pool, &timer_task, pEntry) : NULL;
+   if (NULL == pFuture)
+   {
+      ERROR_LOG("Failed to allocate memory for timer");
+      free(pEntry);
+      return NULL;
+   }
+   pEntry->task = task;
+   pEntry->arg = arg;
+   pEntry->cancel = cancel;
+   pEntry->pWheel = pWheel;
+   pEntry->pFuture = pFuture;
+   clock_gettime(CLOCK_MONOTONIC, &pEntry->deadline);
+   timespec_add_ns(&pEntry->deadline, (long long)delay_ms * NSEC_PER_MSEC);
+
+   pthread_mutex_lock(&pWheel->lock);
+   if (pWheel->stopping)
+   {
+      pthread_mutex_unlock(&pWheel->lock);
+      ERROR_LOG("Timer submitted to a wheel being destroyed");
+      free(pFuture);
+      free(pEntry);
+      return NULL;
+   }
+   pWheel->outstanding++;
+
+   // Round the deadline up to a tick, a timer due by the last tick processed runs now
+   pEntry->tick = wheel_tick_of(pWheel, &pEntry->deadline);
+   if (timespec_diff_ns(&pEntry->deadline, &pWheel->start) > (long long)pEntry->tick * pWheel->tickNs)
+      pEntry->tick++;
+   if (pEntry->tick <= pWheel->tick)
+   {
+      pthread_mutex_unlock(&pWheel->lock);
+      pEntry->pNext = NULL;
+      wheel_dispatch(pWheel, pEntry);
+      return pFuture;
+   }
+
+   pEntry->pNext = pWheel->slots[pEntry->tick % WHEEL_SLOTS];
+   pWheel->slots[pEntry->tick % WHEEL_SLOTS] = pEntry;
+   pWheel->pending++;
+   if (pEntry->tick < pWheel->nextTick)
+   {
+      pWheel->nextTick = pEntry->tick;
+      pthread_cond_signal(&pWheel->cond);
+   }
+   pthread_mutex_unlock(&pWheel->lock);
+
+   return pFuture;
+}
+
+struct thread_future *timer_wheel_submit(struct timer_wheel *wheel, unsigned int delay_ms, thread_task_fn task, void *arg)
+{
+   return wheel_submit(wheel, delay_ms, task, arg, NULL);
+}
+
+struct thread_future *timer_wheel_submit_obtaining_mutex(struct timer_wheel *wheel, pthread_mutex_t *mutex,
+                                                         int wait_to_obtain_ms, int wait_to_release_ms)
+{
+   struct thread_data *pThreadDataParam;
+   struct thread_future *pFuture;
+
+   pThreadDataParam = (struct thread_data *)malloc(sizeof(struct thread_data));
+   if (NULL == pThreadDataParam)
+   {
+      ERROR_LOG("Failed to allocated memory for thread data structure");
+      return NULL;
+   }
+
+   // The wheel waits out wait_to_obtain_ms, the worker only sleeps while holding the mutex
+   pThreadDataParam->wait_before_lock_ms = 0;
+   pThreadDataParam->wait_after_lock_ms = wait_to_release_ms;
+   pThreadDataParam->thread_mutex = mutex;
+   pThreadDataParam->thread_complete_success = false;
+
+   pFuture = wheel_submit(wheel, wait_to_obtain_ms, &obtaining_mutex_task, pThreadDataParam, &free);
+   if (NULL == pFuture)
+      free(pThreadDataParam);
+   return pFuture;
+}
+
+void timer_wheel_jitter(struct timer_wheel *wheel, struct timer_jitter *jitter)
+{
+   pthread_mutex_lock(&wheel->lock);
+   *jitter = wheel->jitter;
+   pthread_mutex_unlock(&wheel->lock);
+}
+
+void timer_wheel_destroy(struct timer_wheel *wheel)
+{
+   struct timer_entry *pDue = NULL;
+   struct timer_entry *pCancelled = NULL;
+   struct timer_entry *pEntry;
+   struct timer_entry *pNext;
+   struct timespec now;
+   unsigned int slot;
+
+   pthread_mutex_lock(&wheel->lock);
+   wheel->stopping = true;
+   pthread_cond_signal(&wheel->cond);
+   pthread_mutex_unlock(&wheel->lock);
+   pthread_join(wheel->thread, NULL);
+
+   // Timers already due still run, the rest never do
+   pthread_mutex_lock(&wheel->lock);
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   for (slot = 0; slot < WHEEL_SLOTS; slot++)
+   {
+      for (pEntry = wheel->slots[slot]; NULL != pEntry; pEntry = pNext)
+      {
+         pNext = pEntry->pNext;
+         if (timespec_diff_ns(&pEntry->deadline, &now) <= 0)
+         {
+            pEntry->pNext = pDue;
+            pDue = pEntry;
+         }
+         else
+         {
+            pEntry->pNext = pCancelled;
+            pCancelled = pEntry;
+            wheel->outstanding--;
+         }
+      }
+      wheel->slots[slot] = NULL;
+   }
+   wheel->pending = 0;
+   pthread_mutex_unlock(&wheel->lock);
+
+   wheel_dispatch(wheel, pDue);
+
+   // Cancelled futures complete as failed
+   for (pEntry = pCancelled; NULL != pEntry; pEntry = pNext)
+   {
+      pNext = pEntry->pNext;
+      if (NULL != pEntry->cancel)
+         pEntry->cancel(pEntry->arg);
+      future_complete(pEntry->pFuture, false);
+      free(pEntry);
+   }
+
+   // Wait for the tasks of due timers, they update the wheel when they finish
+   pthread_mutex_lock(&wheel->lock);
+   while (wheel->outstanding > 0)
+      pthread_cond_wait(&wheel->idleCond, &wheel->lock);
+   pthread_mutex_unlock(&wheel->lock);
+
+   DEBUG_LOG("Timer wheel ran %lu timers, late by %lld to %lld ns", wheel->jitter.count,
+             wheel->jitter.min_ns, wheel->jitter.max_ns);
+
+   pthread_cond_destroy(&wheel->idleCond);
+   pthread_cond_destroy(&wheel->cond);
+   pthread_mutex_destroy(&wheel->lock);
+   free(wheel);
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+   __asm__ __volatile__("yield");
+#endif
+}
+
+/**
+ * @return true if waiting threads should spin before parking.  With a single CPU the
+ *    holder can't run while a waiter spins, so they park straight away.
+ */
+static bool spin_allowed(void)
+{
+   static atomic_int nCpus;
+   int cpus = atomic_load_explicit(&nCpus, memory_order_relaxed);
+
+   if (0 == cpus)
+   {
+      cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      atomic_store_explicit(&nCpus, cpus, memory_order_relaxed);
+   }
+   return cpus > 1;
+}
+
+static inline void futex_wait(void *pWord, unsigned int value)
+{
+   syscall(SYS_futex, pWord, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static inline void futex_wake(void *pWord, int count)
+{
+   syscall(SYS_futex, pWord, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+int adaptive_mutex_init(adaptive_mutex_t *mutex)
+{
+   atomic_init(&mutex->state, 0);
+   atomic_init(&mutex->spins, 0);
+   return 0;
+}
+
+int adaptive_mutex_trylock(adaptive_mutex_t *mutex)
+{
+   int unlocked = 0;
+
+   return atomic_compare_exchange_strong_explicit(&mutex->state, &unlocked, 1, memory_order_acquire,
+                                                  memory_order_relaxed) ? 0 : EBUSY;
+}
+
+int adaptive_mutex_lock(adaptive_mutex_t *mutex)
+{
+   int spins = atomic_load_explicit(&mutex->spins, memory_order_relaxed);
+   int maxSpins = (2 * spins) + 10;
+   int count;
+   int state;
+
+   if (0 == adaptive_mutex_trylock(mutex))
+      return 0;
+
+   // Spin while the holder is likely to release soon, as glibc's adaptive mutex does
+   if (maxSpins > MUTEX_MAX_SPINS)
+      maxSpins = MUTEX_MAX_SPINS;
+   if (!spin_allowed())
+      maxSpins = 0;
+   for (count = 0; count < maxSpins; count++)
+   {
+      cpu_relax();
+      if ((0 == atomic_load_explicit(&mutex->state, memory_order_relaxed)) && (0 == adaptive_mutex_trylock(mutex)))
+      {
+         atomic_store_explicit(&mutex->spins, spins + ((count - spins) / 8), memory_order_relaxed);
+         return 0;
+      }
+   }
+   atomic_store_explicit(&mutex->spins, spins + ((count - spins) / 8), memory_order_relaxed);
+
+   // Park, marking the mutex so the unlock knows to wake a thread
+   state = atomic_exchange_explicit(&mutex->state, 2, memory_order_acquire);
+   while (0 != state)
+   {
+      futex_wait(&mutex->state, 2);
+      state = atomic_exchange_explicit(&mutex->state, 2, memory_order_acquire);
+   }
+   return 0;
+}
+
+int adaptive_mutex_unlock(adaptive_mutex_t *mutex)
+{
+   // Only pay for the system call when a thread may be parked
+   if (2 == atomic_exchange_explicit(&mutex->state, 0, memory_order_release))
+      futex_wake(&mutex->state, 1);
+   return 0;
+}
+
+int adaptive_mutex_destroy(adaptive_mutex_t *mutex)
+{
+   return (0 == atomic_load(&mutex->state)) ? 0 : EBUSY;
+}
+
+int rwlock_init(rwlock_t *rwlock)
+{
+   atomic_init(&rwlock->state, 0);
+   atomic_init(&rwlock->writers, 0);
+   atomic_init(&rwlock->readSeq, 0);
+   atomic_init(&rwlock->writeSeq, 0);
+   atomic_init(&rwlock->readWaiters, 0);
+   atomic_init(&rwlock->writeWaiters, 0);
+   return 0;
+}
+
+/**
+ * Let readers parked behind writers in again, called when writers reaches 0
+ */
+static void rwlock_wake_readers(rwlock_t *pLock)
+{
+   atomic_fetch_add(&pLock->readSeq, 1);
+   if (atomic_load(&pLock->readWaiters) > 0)
+      futex_wake(&pLock->readSeq, INT_MAX);
+}
+
+/**
+ * Let a parked writer retry, called when the lock frees up with writers waiting
+ */
+static void rwlock_wake_writer(rwlock_t *pLock)
+{
+   atomic_fetch_add(&pLock->writeSeq, 1);
+   if (atomic_load(&pLock->writeWaiters) > 0)
+      futex_wake(&pLock->writeSeq, 1);
+}
+
+int rwlock_tryrdlock(rwlock_t *rwlock)
+{
+   unsigned int state = atomic_load_explicit(&rwlock->state, memory_order_relaxed);
+
+   // Readers keep out while any writer holds or waits for the lock
+   while ((0 == atomic_load(&rwlock->writers)) && (RWLOCK_WRITER != state))
+   {
+      if (atomic_compare_exchange_weak_explicit(&rwlock->state, &state, state + 1, memory_order_acquire,
+                                                memory_order_relaxed))
+         return 0;
+   }
+   return EBUSY;
+}
+
+int rwlock_rdlock(rwlock_t *rwlock)
+{
+   int spins = spin_allowed() ? RWLOCK_SPINS : 1;
+   unsigned int seq;
+   int count;
+
+   while (true)
+   {
+      for (count = 0; count < spins; count++)
+      {
+         if (0 == rwlock_tryrdlock(rwlock))
+            return 0;
+         cpu_relax();
+      }
+
+      // Counted as waiting before reading the sequence, so a wake can't be missed
+      atomic_fetch_add(&rwlock->readWaiters, 1);
+      seq = atomic_load(&rwlock->readSeq);
+      if (0 != atomic_load(&rwlock->writers))
+         futex_wait(&rwlock->readSeq, seq);
+      atomic_fetch_sub(&rwlock->readWaiters, 1);
+   }
+}
+
+int rwlock_trywrlock(rwlock_t *rwlock)
+{
+   unsigned int unlocked = 0;
+
+   atomic_fetch_add(&rwlock->writers, 1);
+   if (atomic_compare_exchange_strong_explicit(&rwlock->state, &unlocked, RWLOCK_WRITER, memory_order_acquire,
+                                               memory_order_relaxed))
+      return 0;
+
+   // Readers may have parked seeing this writer
+   if (1 == atomic_fetch_sub(&rwlock->writers, 1))
+      rwlock_wake_readers(rwlock);
+   return EBUSY;
+}
+
+int rwlock_wrlock(rwlock_t *rwlock)
+{
+   int spins = spin_allowed() ? RWLOCK_SPINS : 1;
+   unsigned int unlocked;
+   unsigned int seq;
+   int count;
+
+   // Announced first, new readers now wait for this writer
+   atomic_fetch_add(&rwlock->writers, 1);
+   while (true)
+   {
+      for (count = 0; count < spins; count++)
+      {
+         unlocked = 0;
+         if (atomic_compare_exchange_weak_explicit(&rwlock->state, &unlocked, RWLOCK_WRITER, memory_order_acquire,
+                                                   memory_order_relaxed))
+            return 0;
+         cpu_relax();
+      }
+
+      atomic_fetch_add(&rwlock->writeWaiters, 1);
+      seq = atomic_load(&rwlock->writeSeq);
+      if (0 != atomic_load(&rwlock->state))
+         futex_wait(&rwlock->writeSeq, seq);
+      atomic_fetch_sub(&rwlock->writeWaiters, 1);
+   }
+}
+
+int rwlock_unlock(rwlock_t *rwlock)
+{
+   if (RWLOCK_WRITER == atomic_load_explicit(&rwlock->state, memory_order_relaxed))
+   {
+      atomic_store_explicit(&rwlock->state, 0, memory_order_release);
+
+      // Hand over to the next writer, readers only get in once no writer is left
+      if (1 == atomic_fetch_sub(&rwlock->writers, 1))
+         rwlock_wake_readers(rwlock);
+      else
+         rwlock_wake_writer(rwlock);
+      return 0;
+   }
+
+   // The last reader out lets a waiting writer in
+   if ((1 == atomic_fetch_sub_explicit(&rwlock->state, 1, memory_order_release)) &&
+       (0 != atomic_load(&rwlock->writers)))
+      rwlock_wake_writer(rwlock);
+   return 0;
+}
+
+int rwlock_destroy(rwlock_t *rwlock)
+{
+   return ((0 == atomic_load(&rwlock->state)) && (0 == atomic_load(&rwlock->writers))) ? 0 : EBUSY;
+}
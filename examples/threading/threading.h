@@ -10,6 +10,7 @@
  */
 
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <pthread.h>
 
 /**
@@ -51,3 +52,175 @@ struct thread_data{
 * @return true if the thread could be started, false if a failure occurred.
 */
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+ * A pool of worker threads that runs submitted tasks, so short tasks don't pay for
+ * creating a thread each.  Every worker keeps its own deque of tasks: tasks submitted
+ * from a worker go on that worker's deque, tasks submitted from other threads are
+ * spread across the workers, and a worker that runs dry steals from the others.
+ */
+struct thread_pool;
+
+/**
+ * Result of a task submitted to a thread pool.  Every future must be passed to
+ * thread_future_wait() exactly once, which frees it.
+ */
+struct thread_future;
+
+/**
+ * A task run by a thread pool, returns true if it completed with success
+ */
+typedef bool (*thread_task_fn)(void *arg);
+
+/**
+* Create a pool of @param num_threads worker threads, or one per online CPU if 0.
+* @return the pool, or NULL if it could not be created.
+*/
+struct thread_pool *thread_pool_create(unsigned int num_threads);
+
+/**
+* Queue @param task to run with @param arg on a worker of @param pool.
+* @return future to wait on for the result, or NULL if out of memory or the pool is
+* being destroyed.
+*/
+struct thread_future *thread_pool_submit(struct thread_pool *pool, thread_task_fn task, void *arg);
+
+/**
+* Queue a task on @param pool that sleeps @param wait_to_obtain_ms, obtains @param mutex,
+* holds it for @param wait_to_release_ms and releases it, as the thread started by
+* start_thread_obtaining_mutex does.
+* @return future to wait on for the result, or NULL on failure.
+*/
+struct thread_future *thread_pool_submit_obtaining_mutex(struct thread_pool *pool, pthread_mutex_t *mutex,
+                                                         int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+* @return true if the task of @param future has completed, without blocking.
+*/
+bool thread_future_done(struct thread_future *future);
+
+/**
+* Wait for the task of @param future to complete and free @param future.  Called from a
+* worker of the same pool, the worker runs other queued tasks while it waits.
+* @return thread_complete_success of the task.
+*/
+bool thread_future_wait(struct thread_future *future);
+
+/**
+* Run every task already queued on @param pool, stop its workers and free it.  No task may
+* be submitted once this is called.
+*/
+void thread_pool_destroy(struct thread_pool *pool);
+
+/**
+ * A timer wheel runs tasks on a thread pool once their delay has passed.  A single wheel
+ * thread waits for the tick of the earliest timer, rather than a thread sleeping for every
+ * delay, so a delay is rounded up to a whole tick.
+ */
+struct timer_wheel;
+
+/**
+ * How late timer tasks started on the pool, after their deadline
+ */
+struct timer_jitter
+{
+    unsigned long count;
+    long long min_ns;
+    long long max_ns;
+    long long total_ns;
+};
+
+/**
+* Create a timer wheel with ticks of @param tick_ms milliseconds queuing due tasks on
+* @param pool, which must outlive the wheel.
+* @return the wheel, or NULL if it could not be created.
+*/
+struct timer_wheel *timer_wheel_create(struct thread_pool *pool, unsigned int tick_ms);
+
+/**
+* Queue @param task to run with @param arg on the pool of @param wheel once
+* @param delay_ms milliseconds have passed.
+* @return future to wait on for the result, or NULL on failure.
+*/
+struct thread_future *timer_wheel_submit(struct timer_wheel *wheel, unsigned int delay_ms, thread_task_fn task, void *arg);
+
+/**
+* As thread_pool_submit_obtaining_mutex, with @param wheel waiting out @param wait_to_obtain_ms
+* so no worker is parked until the mutex is wanted.
+* @return future to wait on for the result, or NULL on failure.
+*/
+struct thread_future *timer_wheel_submit_obtaining_mutex(struct timer_wheel *wheel, pthread_mutex_t *mutex,
+                                                         int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+* Copy the start latency of every timer task of @param wheel so far to @param jitter.
+*/
+void timer_wheel_jitter(struct timer_wheel *wheel, struct timer_jitter *jitter);
+
+/**
+* Stop @param wheel and free it once the tasks of due timers have finished.  Timers past their
+* deadline still run, timers not yet due are cancelled and their futures complete with
+* thread_complete_success false.
+*/
+void timer_wheel_destroy(struct timer_wheel *wheel);
+
+/**
+ * Mutex for very short critical sections.  A contended lock spins for about as long as
+ * the lock has recently taken to free up, then parks on a futex, so it neither burns
+ * CPU for long holds nor sleeps through short ones.  Used like a pthread_mutex_t
+ * without attributes: not recursive, unlocked only by its owner.
+ */
+typedef struct
+{
+    atomic_int state;   // 0 unlocked, 1 locked, 2 locked with threads parked
+    atomic_int spins;   // average spins a recent contended lock needed
+} adaptive_mutex_t;
+
+#define ADAPTIVE_MUTEX_INITIALIZER {0, 0}
+
+int adaptive_mutex_init(adaptive_mutex_t *mutex);
+int adaptive_mutex_lock(adaptive_mutex_t *mutex);
+
+/**
+* @return 0 if @param mutex was locked, EBUSY if it is held
+*/
+int adaptive_mutex_trylock(adaptive_mutex_t *mutex);
+int adaptive_mutex_unlock(adaptive_mutex_t *mutex);
+int adaptive_mutex_destroy(adaptive_mutex_t *mutex);
+
+/**
+ * Reader-writer lock that prefers writers: once a writer is waiting no new reader gets
+ * in, so a steady stream of readers can't starve writers.  Waiters spin briefly, then
+ * park on a futex.  Used like a pthread_rwlock_t without attributes.
+ */
+typedef struct
+{
+    atomic_uint state;          // RWLOCK_WRITER while write locked, else the number of readers
+    atomic_uint writers;        // writers holding or waiting for the lock
+    atomic_uint readSeq;        // futex readers park on, bumped when writers reaches 0
+    atomic_uint writeSeq;       // futex writers park on, bumped when the lock frees up
+    atomic_uint readWaiters;
+    atomic_uint writeWaiters;
+} rwlock_t;
+
+#define RWLOCK_INITIALIZER {0, 0, 0, 0, 0, 0}
+
+int rwlock_init(rwlock_t *rwlock);
+int rwlock_rdlock(rwlock_t *rwlock);
+
+/**
+* @return 0 if @param rwlock was read locked, EBUSY if a writer holds or waits for it
+*/
+int rwlock_tryrdlock(rwlock_t *rwlock);
+int rwlock_wrlock(rwlock_t *rwlock);
+
+/**
+* @return 0 if @param rwlock was write locked, EBUSY if it is held
+*/
+int rwlock_trywrlock(rwlock_t *rwlock);
+
+/**
+* Release a read or write lock of @param rwlock held by the caller
+*/
+int rwlock_unlock(rwlock_t *rwlock);
+int rwlock_destroy(rwlock_t *rwlock);
@@ -0,0 +1,1402 @@
+/**
+ * @file finder.c
+ * @author Kenneth A. Jones
+ * @date 2022-03-29
+ *
+ * @brief Native replacement for the find | grep pipeline of finder.sh.
+ *
+ *    finder [-j threads] [-i index] <directory> <search string>
+ *    finder -w -i index [-j threads] <directory>
+ *
+ *    Walks the directory tree once and prints the same summary as finder.sh: the
+ *    number of regular files and the number of lines containing the search string.
+ *    The string is matched literally.  Directories are read with getdents64() and
+ *    every directory and file is a task for a pool of worker threads.  Each worker
+ *    keeps its own deque of tasks, takes new work from the back of it and steals
+ *    from the front of other workers' deques when it runs dry.  Files are mapped
+ *    with mmap() and searched by memchr() for the first byte of the string, only
+ *    comparing the rest where that byte occurs.
+ *
+ *    With -i the walk also keeps a persistent index file of every file's path,
+ *    mtime, size and the set of 16 bit hashes of the 3 byte sequences it contains.
+ *    Files whose mtime and size match the index are not read unless every hash of
+ *    the search string is in their set, and only files that changed are hashed
+ *    again.  With -w finder stays running as a watcher: it adds an inotify watch
+ *    to every directory and refreshes the index whenever the tree changes.  While
+ *    a watcher is alive its index is current, so searches with -i skip the walk
+ *    and only read the candidate files.  The watcher holds a lock on the index
+ *    file name with .lock appended for as long as it runs, which is how searches
+ *    know it is alive.  Keep the index file outside the tree.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+// ============================================================================
+// INCLUDES
+// ============================================================================
+#define _GNU_SOURCE // O_DIRECTORY, O_NOFOLLOW
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+
+// ============================================================================
+// PRIVATE MACROS AND DEFINES
+// ============================================================================
+
+// Buffer for one getdents64() call
+#define DIRENT_BUFFER_SIZE (32 * 1024)
+
+// Initial capacity of a worker's task deque
+#define DEQUE_MIN_CAPACITY 64
+
+// Most worker threads started by default
+#define MAX_DEFAULT_THREADS 16
+
+// Index file identification
+#define INDEX_MAGIC "AESDFIDX"
+#define INDEX_VERSION 1
+
+// Number of distinct 3 byte sequence hashes
+#define GRAM_SPACE 65536
+
+// Files with more distinct hashes than this are not given a set, they match any search
+#define INDEX_MAX_GRAMS 16384
+#define INDEX_ALL_GRAMS UINT32_MAX
+
+// Every part of the index file starts 8 byte aligned
+#define INDEX_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+// Quiet time after a change before the watcher refreshes the index
+#define WATCH_SETTLE_MS 200
+
+// Appended to the index file name for the file the watcher holds locked
+#define WATCH_LOCK_SUFFIX ".lock"
+
+// ============================================================================
+// PRIVATE TYPEDEFS
+// ============================================================================
+
+// Record returned by getdents64()
+struct linux_dirent64
+{
+   uint64_t d_ino;
+   int64_t d_off;
+   unsigned short d_reclen;
+   unsigned char d_type;
+   char d_name[];
+};
+
+// A directory to list or a file to search, path is relative to the root directory
+typedef struct
+{
+   bool isDir;
+   char path[];
+} task_t;
+
+// Ring of tasks, the owner works at the tail and thieves take from the head
+typedef struct
+{
+   pthread_mutex_t lock;
+   task_t **items;
+   size_t head;
+   size_t capacity;
+   atomic_size_t count;
+} deque_t;
+
+// One file of the index
+typedef struct
+{
+   const char *path;
+   int64_t mtimeSec;
+   int64_t mtimeNsec;
+   uint64_t size;
+   uint32_t nGrams;           // INDEX_ALL_GRAMS if no set is kept
+   const uint16_t *grams;     // sorted set of hashes
+   bool owned;                // path and grams were allocated, rather than part of a loaded index
+} index_entry_t;
+
+typedef struct
+{
+   index_entry_t *entries;
+   size_t count;
+   size_t capacity;
+} entry_list_t;
+
+// Index loaded from a file, entries sorted by path
+typedef struct
+{
+   char *data;
+   const char *root;
+   pid_t livePid;
+   entry_list_t list;
+} index_t;
+
+// Index file header, followed by the root path, then nEntries records each followed by
+// its path and hashes, every part padded to 8 bytes
+typedef struct
+{
+   char magic[8];
+   uint32_t version;
+   int32_t livePid;           // watcher keeping the index current, 0 if none
+   uint32_t nEntries;
+   uint32_t rootLen;          // including the terminating NUL
+} index_header_t;
+
+typedef struct
+{
+   int64_t mtimeSec;
+   int64_t mtimeNsec;
+   uint64_t size;
+   uint32_t nGrams;
+   uint16_t pathLen;          // not including the terminating NUL
+   uint16_t reserved;
+} index_record_t;
+
+typedef struct finder finder_t;
+
+typedef struct
+{
+   pthread_t thread;
+   unsigned int id;
+   deque_t deque;
+   finder_t *pFinder;
+   unsigned long files;
+   unsigned long lines;
+   unsigned long gone;          // candidates deleted since the index was saved
+   bool failed;
+   // Index entries of the files seen, and scratch space to hash them
+   entry_list_t entries;
+   uint64_t gramBitmap[GRAM_SPACE / 64];
+} worker_t;
+
+struct finder
+{
+   int rootFd;
+   const char *rootPath;
+   const char *needle;          // NULL when only indexing
+   size_t needleLen;
+   uint16_t *needleGrams;
+   uint32_t needleNGrams;
+   // Index of the previous walk when indexing, NULL when not
+   const index_t *pIndex;
+   // Only reading the candidates of a live index, which may lag behind the tree
+   bool candidates;
+   // inotify instance directories are added to when watching, -1 when not
+   int inotifyFd;
+   atomic_bool watchFailed;
+   worker_t *workers;
+   unsigned int nWorkers;
+   // Tasks queued or running, the walk is over when it drops to zero
+   atomic_long pending;
+   // Workers waiting for work, and what they wait on
+   atomic_uint idle;
+   pthread_mutex_t idleLock;
+   pthread_cond_t idleCond;
+};
+
+// ============================================================================
+// STATIC FUNCTION PROTOTYPES
+// ============================================================================
+
+static bool deque_init(deque_t *pDeque);
+static bool deque_push(deque_t *pDeque, task_t *pTask);
+static task_t *deque_pop(deque_t *pDeque);
+static task_t *deque_steal(deque_t *pDeque);
+static bool queue_task(worker_t *pWorker, const char *parent, const char *name, bool isDir);
+static task_t *next_task(worker_t *pWorker);
+static bool any_queued(finder_t *pFinder);
+static void add_watch(finder_t *pFinder, const char *path);
+static void list_directory(worker_t *pWorker, const char *path);
+static void search_file(worker_t *pWorker, const char *path);
+static unsigned long count_matching_lines(const char *pData, size_t size, const char *needle, size_t len);
+static void *worker_thread(void *arg);
+static bool finder_run(finder_t *pFinder, const index_t *pCandidates, unsigned long *pFiles, unsigned long *pLines);
+static uint32_t collect_grams(uint64_t *bitmap, const unsigned char *pData, size_t size, uint16_t **ppGrams);
+static bool entry_may_match(const finder_t *pFinder, const index_entry_t *pEntry);
+static bool entry_list_add(entry_list_t *pList, const index_entry_t *pEntry);
+static void entry_list_free(entry_list_t *pList);
+static bool merge_entries(finder_t *pFinder, entry_list_t *pMerged);
+static const index_entry_t *index_lookup(const index_t *pIndex, const char *path);
+static bool index_load(const char *file, index_t *pIndex);
+static bool index_save(const char *file, const char *root, pid_t livePid, const entry_list_t *pList);
+static void index_clear_live(const char *file);
+static void index_free(index_t *pIndex);
+static int watch_lock(const char *indexFile);
+static bool watcher_alive(const char *indexFile, pid_t livePid);
+static int watch_index(finder_t *pFinder, const char *indexFile);
+
+// ============================================================================
+// STATIC VARIABLES
+// ============================================================================
+
+// Set by SIGINT and SIGTERM to stop the watcher
+static volatile sig_atomic_t stopWatching;
+
+// ============================================================================
+// GLOBAL FUNCTIONS
+// ============================================================================
+
+int main(int argc, char **argv)
+{
+   finder_t finder;
+   index_t index;
+   entry_list_t merged = {0};
+   long nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+   unsigned int nThreads = (nCpus < 1) ? 1 : ((nCpus > MAX_DEFAULT_THREADS) ? MAX_DEFAULT_THREADS : nCpus);
+   const char *indexFile = NULL;
+   bool watch = false;
+   unsigned long files = 0;
+   unsigned long lines = 0;
+   bool success;
+   unsigned int workerIndex;
+   struct stat st;
+   int opt;
+
+   while ((opt = getopt(argc, argv, "+j:i:w")) != -1)
+   {
+      switch (opt)
+      {
+      case 'j':
+         nThreads = strtoul(optarg, NULL, 0);
+         if (nThreads < 1)
+            nThreads = 1;
+         break;
+      case 'i':
+         indexFile = optarg;
+         break;
+      case 'w':
+         watch = true;
+         break;
+      default:
+         fprintf(stderr, "Usage: finder [-j threads] [-i index] <directory> <search string>\n"
+                         "       finder -w -i index [-j threads] <directory>\n");
+         return 1;
+      }
+   }
+   if (watch && (indexFile == NULL))
+   {
+      fprintf(stderr, "finder: -w needs an index file given with -i\n");
+      return 1;
+   }
+
+   // Same checks and messages as finder.sh
+   if (argc - optind == 0)
+   {
+      printf("Error: No arguments provided. Usage finder.sh <DIRECTORY PATH> <SEARCH STRING>\n");
+      return 1;
+   }
+   if (!watch && (argc - optind < 2))
+   {
+      printf("Error: Not enough arguments provided.  2 arguments required\n");
+      return 1;
+   }
+   if ((argv[optind][0] == '\0') || (stat(argv[optind], &st) < 0) || !S_ISDIR(st.st_mode))
+   {
+      printf("Error: %s is not a valid directory\n", argv[optind]);
+      return 1;
+   }
+   if (!watch && (argv[optind + 1][0] == '\0'))
+   {
+      printf("Error: Argument 2 cannot be empty\n");
+      return 1;
+   }
+
+   memset(&finder, 0, sizeof(finder));
+   finder.nWorkers = nThreads;
+   finder.inotifyFd = -1;
+   pthread_mutex_init(&finder.idleLock, NULL);
+   pthread_cond_init(&finder.idleCond, NULL);
+
+   finder.rootFd = open(argv[optind], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+   finder.rootPath = realpath(argv[optind], NULL);
+   finder.workers = calloc(nThreads, sizeof(worker_t));
+   if ((finder.rootFd < 0) || (finder.rootPath == NULL) || (finder.workers == NULL))
+   {
+      perror(argv[optind]);
+      return 1;
+   }
+
+   for (workerIndex = 0; workerIndex < nThreads; workerIndex++)
+   {
+      finder.workers[workerIndex].id = workerIndex;
+      finder.workers[workerIndex].pFinder = &finder;
+      if (!deque_init(&finder.workers[workerIndex].deque))
+      {
+         perror("finder");
+         return 1;
+      }
+   }
+
+   if (watch)
+      return watch_index(&finder, indexFile);
+
+   finder.needle = argv[optind + 1];
+   finder.needleLen = strlen(finder.needle);
+
+   if (indexFile == NULL)
+   {
+      success = finder_run(&finder, NULL, &files, &lines);
+   }
+   else
+   {
+      // Hashes every candidate file must hold
+      finder.needleNGrams = collect_grams(finder.workers[0].gramBitmap, (const unsigned char *)finder.needle,
+                                          finder.needleLen, &finder.needleGrams);
+
+      // An index of another tree is of no use
+      if (index_load(indexFile, &index) && (strcmp(index.root, finder.rootPath) != 0))
+      {
+         index_free(&index);
+         memset(&index, 0, sizeof(index));
+      }
+
+      if ((index.livePid != 0) && watcher_alive(indexFile, index.livePid))
+      {
+         // The watcher keeps the index current, only read the candidates
+         success = finder_run(&finder, &index, &files, &lines);
+      }
+      else
+      {
+         // Walk the tree, rehashing only files that changed since the index was saved
+         finder.pIndex = &index;
+         success = finder_run(&finder, NULL, &files, &lines);
+         if (merge_entries(&finder, &merged) && !index_save(indexFile, finder.rootPath, 0, &merged))
+            fprintf(stderr, "finder: failed to save index %s: %s\n", indexFile, strerror(errno));
+         entry_list_free(&merged);
+      }
+      index_free(&index);
+      free(finder.needleGrams);
+   }
+   close(finder.rootFd);
+
+   printf("The number of files are %lu and the number of matching lines are %lu\n", files, lines);
+   return success ? 0 : 1;
+}
+
+// ============================================================================
+// STATIC FUNCTIONS
+// ============================================================================
+
+static bool deque_init(deque_t *pDeque)
+{
+   pthread_mutex_init(&pDeque->lock, NULL);
+   pDeque->capacity = DEQUE_MIN_CAPACITY;
+   pDeque->items = malloc(pDeque->capacity * sizeof(task_t *));
+   return pDeque->items != NULL;
+}
+
+/**
+ * @brief Add @param pTask at the tail of @param pDeque, growing it when full
+ *
+ * @return false if out of memory
+ */
+static bool deque_push(deque_t *pDeque, task_t *pTask)
+{
+   task_t **items;
+   size_t count;
+   size_t index;
+
+   pthread_mutex_lock(&pDeque->lock);
+   count = atomic_load(&pDeque->count);
+   if (count == pDeque->capacity)
+   {
+      items = malloc(2 * pDeque->capacity * sizeof(task_t *));
+      if (items == NULL)
+      {
+         pthread_mutex_unlock(&pDeque->lock);
+         return false;
+      }
+      for (index = 0; index < count; index++)
+         items[index] = pDeque->items[(pDeque->head + index) % pDeque->capacity];
+      free(pDeque->items);
+      pDeque->items = items;
+      pDeque->head = 0;
+      pDeque->capacity *= 2;
+   }
+   pDeque->items[(pDeque->head + count) % pDeque->capacity] = pTask;
+   atomic_store(&pDeque->count, count + 1);
+   pthread_mutex_unlock(&pDeque->lock);
+   return true;
+}
+
+/**
+ * @brief Take the newest task of @param pDeque, used by its owner
+ */
+static task_t *deque_pop(deque_t *pDeque)
+{
+   task_t *pTask = NULL;
+   size_t count;
+
+   if (atomic_load(&pDeque->count) == 0)
+      return NULL;
+
+   pthread_mutex_lock(&pDeque->lock);
+   count = atomic_load(&pDeque->count);
+   if (count > 0)
+   {
+      pTask = pDeque->items[(pDeque->head + count - 1) % pDeque->capacity];
+      atomic_store(&pDeque->count, count - 1);
+   }
+   pthread_mutex_unlock(&pDeque->lock);
+   return pTask;
+}
+
+/**
+ * @brief Take the oldest task of @param pDeque, used by other workers.  Old tasks
+ *    are nearer the root, so a thief tends to take a large piece of the tree.
+ */
+static task_t *deque_steal(deque_t *pDeque)
+{
+   task_t *pTask = NULL;
+   size_t count;
+
+   if (atomic_load(&pDeque->count) == 0)
+      return NULL;
+
+   pthread_mutex_lock(&pDeque->lock);
+   count = atomic_load(&pDeque->count);
+   if (count > 0)
+   {
+      pTask = pDeque->items[pDeque->head];
+      pDeque->head = (pDeque->head + 1) % pDeque->capacity;
+      atomic_store(&pDeque->count, count - 1);
+   }
+   pthread_mutex_unlock(&pDeque->lock);
+   return pTask;
+}
+
+/**
+ * @brief Queue @param name in directory @param parent, or @param name alone if parent
+ *    is NULL, on the deque of @param pWorker and wake an idle worker to steal it
+ *
+ * @return false if out of memory
+ */
+static bool queue_task(worker_t *pWorker, const char *parent, const char *name, bool isDir)
+{
+   finder_t *pFinder = pWorker->pFinder;
+   size_t parentLen = (parent == NULL) ? 0 : strlen(parent);
+   size_t nameLen = strlen(name);
+   task_t *pTask;
+
+   pTask = malloc(sizeof(task_t) + parentLen + nameLen + 2);
+   if (pTask == NULL)
+      return false;
+   pTask->isDir = isDir;
+   if ((parent == NULL) || (strcmp(parent, ".") == 0))
+   {
+      memcpy(pTask->path, name, nameLen + 1);
+   }
+   else
+   {
+      memcpy(pTask->path, parent, parentLen);
+      pTask->path[parentLen] = '/';
+      memcpy(&pTask->path[parentLen + 1], name, nameLen + 1);
+   }
+
+   // Count the task before anyone can finish it
+   atomic_fetch_add(&pFinder->pending, 1);
+   if (!deque_push(&pWorker->deque, pTask))
+   {
+      atomic_fetch_sub(&pFinder->pending, 1);
+      free(pTask);
+      return false;
+   }
+
+   if (atomic_load(&pFinder->idle) > 0)
+   {
+      pthread_mutex_lock(&pFinder->idleLock);
+      pthread_cond_signal(&pFinder->idleCond);
+      pthread_mutex_unlock(&pFinder->idleLock);
+   }
+   return true;
+}
+
+static bool any_queued(finder_t *pFinder)
+{
+   unsigned int index;
+
+   for (index = 0; index < pFinder->nWorkers; index++)
+   {
+      if (atomic_load(&pFinder->workers[index].deque.count) > 0)
+         return true;
+   }
+   return false;
+}
+
+/**
+ * @brief Get the next task for @param pWorker, from its own deque or stolen from another,
+ *    sleeping while there is nothing to take but tasks are still running
+ *
+ * @return the task, or NULL once every task is done
+ */
+static task_t *next_task(worker_t *pWorker)
+{
+   finder_t *pFinder = pWorker->pFinder;
+   task_t *pTask;
+   unsigned int index;
+
+   while (true)
+   {
+      pTask = deque_pop(&pWorker->deque);
+      for (index = 1; (pTask == NULL) && (index < pFinder->nWorkers); index++)
+         pTask = deque_steal(&pFinder->workers[(pWorker->id + index) % pFinder->nWorkers].deque);
+      if (pTask != NULL)
+         return pTask;
+
+      // Idle is counted before checking for work so a push in between always signals
+      pthread_mutex_lock(&pFinder->idleLock);
+      atomic_fetch_add(&pFinder->idle, 1);
+      while ((atomic_load(&pFinder->pending) > 0) && !any_queued(pFinder))
+         pthread_cond_wait(&pFinder->idleCond, &pFinder->idleLock);
+      atomic_fetch_sub(&pFinder->idle, 1);
+      pthread_mutex_unlock(&pFinder->idleLock);
+
+      if (atomic_load(&pFinder->pending) == 0)
+         return NULL;
+   }
+}
+
+/**
+ * @brief Add an inotify watch for directory @param path of the tree
+ */
+static void add_watch(finder_t *pFinder, const char *path)
+{
+   char fullPath[PATH_MAX];
+   uint32_t mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                   IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+   if (strcmp(path, ".") == 0)
+      snprintf(fullPath, sizeof(fullPath), "%s", pFinder->rootPath);
+   else
+      snprintf(fullPath, sizeof(fullPath), "%s/%s", pFinder->rootPath, path);
+
+   // Without every watch the index can't be trusted to be current
+   if (inotify_add_watch(pFinder->inotifyFd, fullPath, mask) < 0)
+   {
+      fprintf(stderr, "finder: can't watch %s: %s\n", fullPath, strerror(errno));
+      atomic_store(&pFinder->watchFailed, true);
+   }
+}
+
+/**
+ * @brief Queue every subdirectory and regular file of directory @param path
+ */
+static void list_directory(worker_t *pWorker, const char *path)
+{
+   char buffer[DIRENT_BUFFER_SIZE] __attribute__((aligned(8)));
+   struct linux_dirent64 *pEntry;
+   struct stat st;
+   unsigned char type;
+   long nRead;
+   long offs;
+   int fd;
+
+   fd = openat(pWorker->pFinder->rootFd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+   if (fd < 0)
+   {
+      fprintf(stderr, "finder: %s: %s\n", path, strerror(errno));
+      pWorker->failed = true;
+      return;
+   }
+
+   // Watch the directory, adding an existing watch again is harmless
+   if (pWorker->pFinder->inotifyFd >= 0)
+      add_watch(pWorker->pFinder, path);
+
+   while ((nRead = syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0)
+   {
+      for (offs = 0; offs < nRead; offs += pEntry->d_reclen)
+      {
+         pEntry = (struct linux_dirent64 *)&buffer[offs];
+         if ((strcmp(pEntry->d_name, ".") == 0) || (strcmp(pEntry->d_name, "..") == 0))
+            continue;
+
+         // Not every file system fills in the type
+         type = pEntry->d_type;
+         if (type == DT_UNKNOWN)
+         {
+            if (fstatat(fd, pEntry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+               continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : (S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN);
+         }
+
+         // Like find -type f and grep -r, symbolic links are not followed
+         if ((type != DT_DIR) && (type != DT_REG))
+            continue;
+         if (type == DT_REG)
+            pWorker->files++;
+         if (!queue_task(pWorker, path, pEntry->d_name, type == DT_DIR))
+         {
+            fprintf(stderr, "finder: out of memory\n");
+            pWorker->failed = true;
+         }
+      }
+   }
+   if (nRead < 0)
+   {
+      fprintf(stderr, "finder: %s: %s\n", path, strerror(errno));
+      pWorker->failed = true;
+   }
+
+   close(fd);
+}
+
+/**
+ * @brief Add the number of lines of file @param path containing the search string
+ *    to the count of @param pWorker.  When indexing, also record the file's index
+ *    entry, reusing the previous one if the file did not change, and skip the
+ *    search if the entry shows the string can't be in the file.
+ */
+static void search_file(worker_t *pWorker, const char *path)
+{
+   finder_t *pFinder = pWorker->pFinder;
+   const index_entry_t *pOld;
+   index_entry_t entry;
+   uint16_t *grams = NULL;
+   struct stat st;
+   void *pData = MAP_FAILED;
+   bool search;
+   int fd;
+
+   fd = openat(pFinder->rootFd, path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+   if (fd < 0)
+   {
+      // A candidate deleted since the watcher last saved the index is no longer in the tree
+      if (pFinder->candidates && (errno == ENOENT))
+      {
+         pWorker->gone++;
+         return;
+      }
+      fprintf(stderr, "finder: %s: %s\n", path, strerror(errno));
+      pWorker->failed = true;
+      return;
+   }
+   if ((fstat(fd, &st) < 0) || !S_ISREG(st.st_mode))
+   {
+      close(fd);
+      return;
+   }
+   search = (pFinder->needle != NULL) && ((size_t)st.st_size >= pFinder->needleLen);
+
+   if (st.st_size > 0)
+   {
+      pData = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (pData == MAP_FAILED)
+      {
+         fprintf(stderr, "finder: %s: %s\n", path, strerror(errno));
+         pWorker->failed = true;
+         close(fd);
+         return;
+      }
+      madvise(pData, st.st_size, MADV_SEQUENTIAL);
+   }
+
+   if (pFinder->pIndex != NULL)
+   {
+      pOld = index_lookup(pFinder->pIndex, path);
+      if ((pOld != NULL) && (pOld->mtimeSec == st.st_mtim.tv_sec) &&
+          (pOld->mtimeNsec == st.st_mtim.tv_nsec) && (pOld->size == (uint64_t)st.st_size))
+      {
+         entry = *pOld;
+         entry.owned = false;
+      }
+      else
+      {
+         entry.path = strdup(path);
+         entry.mtimeSec = st.st_mtim.tv_sec;
+         entry.mtimeNsec = st.st_mtim.tv_nsec;
+         entry.size = st.st_size;
+         entry.nGrams = collect_grams(pWorker->gramBitmap, pData, st.st_size, &grams);
+         entry.grams = grams;
+         entry.owned = true;
+      }
+
+      if ((entry.path == NULL) || !entry_list_add(&pWorker->entries, &entry))
+      {
+         fprintf(stderr, "finder: out of memory indexing %s\n", path);
+         pWorker->failed = true;
+         if (entry.owned)
+         {
+            free((void *)entry.path);
+            free(grams);
+         }
+      }
+      search = search && entry_may_match(pFinder, &entry);
+   }
+
+   if (search)
+      pWorker->lines += count_matching_lines(pData, st.st_size, pFinder->needle, pFinder->needleLen);
+
+   if (pData != MAP_FAILED)
+      munmap(pData, st.st_size);
+   close(fd);
+}
+
+/**
+ * @brief Count the lines of the @param size bytes at @param pData containing the
+ *    @param len byte string @param needle.  memchr() skips ahead to each occurrence
+ *    of the first byte, and after a match the rest of its line is skipped.
+ */
+static unsigned long count_matching_lines(const char *pData, size_t size, const char *needle, size_t len)
+{
+   const char *pEnd = pData + size;
+   const char *pHit;
+   unsigned long lines = 0;
+
+   while ((size_t)(pEnd - pData) >= len)
+   {
+      pHit = memchr(pData, needle[0], (pEnd - pData) - len + 1);
+      if (pHit == NULL)
+         break;
+
+      if (memcmp(pHit + 1, needle + 1, len - 1) != 0)
+      {
+         pData = pHit + 1;
+         continue;
+      }
+
+      lines++;
+      pData = memchr(pHit + len, '\n', pEnd - (pHit + len));
+      if (pData == NULL)
+         break;
+      pData++;
+   }
+
+   return lines;
+}
+
+static void *worker_thread(void *arg)
+{
+   worker_t *pWorker = (worker_t *)arg;
+   finder_t *pFinder = pWorker->pFinder;
+   task_t *pTask;
+
+   while ((pTask = next_task(pWorker)) != NULL)
+   {
+      if (pTask->isDir)
+         list_directory(pWorker, pTask->path);
+      else
+         search_file(pWorker, pTask->path);
+      free(pTask);
+
+      // Wake everyone once the last task is done
+      if (atomic_fetch_sub(&pFinder->pending, 1) == 1)
+      {
+         pthread_mutex_lock(&pFinder->idleLock);
+         pthread_cond_broadcast(&pFinder->idleCond);
+         pthread_mutex_unlock(&pFinder->idleLock);
+      }
+   }
+
+   return NULL;
+}
+
+/**
+ * @brief Run the worker pool over the tree of @param pFinder, or only over the files of
+ *    @param pCandidates that may hold the search string when not NULL, and add up the
+ *    files seen and matching lines found.  With candidates the files are those of the
+ *    index, less any found deleted.
+ *
+ * @return false if any directory or file could not be read
+ */
+static bool finder_run(finder_t *pFinder, const index_t *pCandidates, unsigned long *pFiles, unsigned long *pLines)
+{
+   worker_t *pWorker;
+   bool success = true;
+   unsigned int index;
+   size_t entry;
+
+   *pFiles = 0;
+   *pLines = 0;
+   for (index = 0; index < pFinder->nWorkers; index++)
+   {
+      pWorker = &pFinder->workers[index];
+      pWorker->files = 0;
+      pWorker->lines = 0;
+      pWorker->gone = 0;
+      pWorker->failed = false;
+   }
+   pFinder->candidates = (pCandidates != NULL);
+
+   // Seed the walk with the root directory or the candidate files
+   pWorker = &pFinder->workers[0];
+   if (pCandidates == NULL)
+   {
+      if (!queue_task(pWorker, NULL, ".", true))
+         return false;
+   }
+   else
+   {
+      for (entry = 0; entry < pCandidates->list.count; entry++)
+      {
+         if (entry_may_match(pFinder, &pCandidates->list.entries[entry]) &&
+             !queue_task(pWorker, NULL, pCandidates->list.entries[entry].path, false))
+            success = false;
+      }
+   }
+
+   // The calling thread works as worker 0
+   for (index = 1; index < pFinder->nWorkers; index++)
+   {
+      if (pthread_create(&pFinder->workers[index].thread, NULL, worker_thread, &pFinder->workers[index]) != 0)
+      {
+         // Carry on with the workers already running
+         pFinder->nWorkers = index;
+         break;
+      }
+   }
+   worker_thread(pWorker);
+
+   for (index = 0; index < pFinder->nWorkers; index++)
+   {
+      if (index > 0)
+         pthread_join(pFinder->workers[index].thread, NULL);
+      *pFiles += pFinder->workers[index].files;
+      *pLines += pFinder->workers[index].lines;
+      if (pCandidates != NULL)
+         *pFiles -= pFinder->workers[index].gone;
+      success = success && !pFinder->workers[index].failed;
+   }
+   if (pCandidates != NULL)
+      *pFiles += pCandidates->list.count;
+
+   return success;
+}
+
+static inline uint16_t gram_hash(const unsigned char *p)
+{
+   return (uint16_t)((((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2]) * 2654435761u >> 16);
+}
+
+/**
+ * @brief Collect the distinct hashes of every 3 byte sequence of the @param size bytes at
+ *    @param pData into a sorted array stored at @param ppGrams, using the zeroed
+ *    @param bitmap as scratch space and leaving it zeroed
+ *
+ * @return number of hashes, or INDEX_ALL_GRAMS with no array if there are too many to be
+ *    worth keeping or no memory for them
+ */
+static uint32_t collect_grams(uint64_t *bitmap, const unsigned char *pData, size_t size, uint16_t **ppGrams)
+{
+   uint16_t *grams;
+   uint64_t bits;
+   uint32_t nGrams = 0;
+   size_t offs;
+   size_t word;
+
+   *ppGrams = NULL;
+   for (offs = 0; (offs + 3) <= size; offs++)
+   {
+      uint16_t hash = gram_hash(&pData[offs]);
+      bitmap[hash / 64] |= (uint64_t)1 << (hash % 64);
+   }
+   for (word = 0; word < (GRAM_SPACE / 64); word++)
+      nGrams += __builtin_popcountll(bitmap[word]);
+
+   grams = ((nGrams > 0) && (nGrams <= INDEX_MAX_GRAMS)) ? malloc(nGrams * sizeof(uint16_t)) : NULL;
+   if ((nGrams > 0) && (grams == NULL))
+      nGrams = INDEX_ALL_GRAMS;
+
+   // Walking the bitmap in order gives a sorted set
+   offs = 0;
+   for (word = 0; word < (GRAM_SPACE / 64); word++)
+   {
+      for (bits = bitmap[word]; (bits != 0) && (grams != NULL); bits &= bits - 1)
+         grams[offs++] = (uint16_t)((word * 64) + __builtin_ctzll(bits));
+      bitmap[word] = 0;
+   }
+
+   *ppGrams = grams;
+   return nGrams;
+}
+
+/**
+ * @brief Check whether the file of @param pEntry can contain the search string
+ *
+ * @return false only if a hash of the search string is missing from the file's set
+ */
+static bool entry_may_match(const finder_t *pFinder, const index_entry_t *pEntry)
+{
+   uint32_t needle = 0;
+   uint32_t file = 0;
+
+   if (pFinder->needleNGrams == INDEX_ALL_GRAMS)
+      return true;
+   if (pEntry->nGrams == INDEX_ALL_GRAMS)
+      return pEntry->size >= pFinder->needleLen;
+
+   // Both sets are sorted, walk them together
+   while (needle < pFinder->needleNGrams)
+   {
+      while ((file < pEntry->nGrams) && (pEntry->grams[file] < pFinder->needleGrams[needle]))
+         file++;
+      if ((file == pEntry->nGrams) || (pEntry->grams[file] != pFinder->needleGrams[needle]))
+         return false;
+      needle++;
+   }
+
+   return pEntry->size >= pFinder->needleLen;
+}
+
+static bool entry_list_add(entry_list_t *pList, const index_entry_t *pEntry)
+{
+   index_entry_t *entries;
+   size_t capacity;
+
+   if (pList->count == pList->capacity)
+   {
+      capacity = (pList->capacity > 0) ? (2 * pList->capacity) : DEQUE_MIN_CAPACITY;
+      entries = realloc(pList->entries, capacity * sizeof(index_entry_t));
+      if (entries == NULL)
+         return false;
+      pList->entries = entries;
+      pList->capacity = capacity;
+   }
+
+   pList->entries[pList->count++] = *pEntry;
+   return true;
+}
+
+/**
+ * @brief Free @param pList and the paths and hashes its entries own
+ */
+static void entry_list_free(entry_list_t *pList)
+{
+   size_t entry;
+
+   for (entry = 0; entry < pList->count; entry++)
+   {
+      if (pList->entries[entry].owned)
+      {
+         free((void *)pList->entries[entry].path);
+         free((void *)pList->entries[entry].grams);
+      }
+   }
+   free(pList->entries);
+   memset(pList, 0, sizeof(entry_list_t));
+}
+
+static int compare_entries(const void *pA, const void *pB)
+{
+   return strcmp(((const index_entry_t *)pA)->path, ((const index_entry_t *)pB)->path);
+}
+
+/**
+ * @brief Move the index entries every worker collected into @param pMerged, sorted by path
+ *
+ * @return false if out of memory, the entries are then freed
+ */
+static bool merge_entries(finder_t *pFinder, entry_list_t *pMerged)
+{
+   entry_list_t *pEntries;
+   bool success = true;
+   unsigned int index;
+   size_t entry;
+
+   memset(pMerged, 0, sizeof(entry_list_t));
+   for (index = 0; index < pFinder->nWorkers; index++)
+   {
+      pEntries = &pFinder->workers[index].entries;
+      for (entry = 0; entry < pEntries->count; entry++)
+      {
+         if (!entry_list_add(pMerged, &pEntries->entries[entry]))
+         {
+            success = false;
+            break;
+         }
+         pEntries->entries[entry].owned = false;
+      }
+      entry_list_free(pEntries);
+   }
+
+   if (!success)
+   {
+      entry_list_free(pMerged);
+      return false;
+   }
+
+   qsort(pMerged->entries, pMerged->count, sizeof(index_entry_t), compare_entries);
+   return true;
+}
+
+/**
+ * @brief Find the entry of @param path in @param pIndex
+ *
+ * @return the entry or NULL if the file is not in the index
+ */
+static const index_entry_t *index_lookup(const index_t *pIndex, const char *path)
+{
+   index_entry_t key = {.path = path};
+
+   if (pIndex->list.count == 0)
+      return NULL;
+   return bsearch(&key, pIndex->list.entries, pIndex->list.count, sizeof(index_entry_t), compare_entries);
+}
+
+/**
+ * @brief Load the index saved in @param file into @param pIndex.  The entries point
+ *    into the loaded file data, which is checked so a damaged file is only rejected.
+ *
+ * @return false if the file can't be read or is not a valid index, @param pIndex is then empty
+ */
+static bool index_load(const char *file, index_t *pIndex)
+{
+   const index_header_t *pHeader;
+   const index_record_t *pRecord;
+   index_entry_t entry;
+   struct stat st;
+   size_t offs;
+   size_t size;
+   ssize_t nRead;
+   uint32_t index;
+   int fd;
+
+   memset(pIndex, 0, sizeof(index_t));
+   fd = open(file, O_RDONLY | O_CLOEXEC);
+   if (fd < 0)
+      return false;
+   if ((fstat(fd, &st) < 0) || (st.st_size < (off_t)sizeof(index_header_t)))
+   {
+      close(fd);
+      return false;
+   }
+
+   // malloc() alignment keeps every 8 byte aligned part of the file aligned in memory
+   size = st.st_size;
+   pIndex->data = malloc(size);
+   for (offs = 0; (pIndex->data != NULL) && (offs < size); offs += nRead)
+   {
+      nRead = read(fd, &pIndex->data[offs], size - offs);
+      if (nRead <= 0)
+         break;
+   }
+   close(fd);
+   if ((pIndex->data == NULL) || (offs != size))
+      goto fail;
+
+   pHeader = (const index_header_t *)pIndex->data;
+   offs = INDEX_ALIGN(sizeof(index_header_t) + pHeader->rootLen);
+   if ((memcmp(pHeader->magic, INDEX_MAGIC, sizeof(pHeader->magic)) != 0) ||
+       (pHeader->version != INDEX_VERSION) || (pHeader->rootLen == 0) || (offs > size) ||
+       (pIndex->data[sizeof(index_header_t) + pHeader->rootLen - 1] != '\0') ||
+       (pHeader->nEntries > (size / sizeof(index_record_t))))
+      goto fail;
+   pIndex->root = &pIndex->data[sizeof(index_header_t)];
+   pIndex->livePid = pHeader->livePid;
+
+   for (index = 0; index < pHeader->nEntries; index++)
+   {
+      if ((offs + sizeof(index_record_t)) > size)
+         goto fail;
+      pRecord = (const index_record_t *)&pIndex->data[offs];
+      offs += sizeof(index_record_t);
+
+      if (((offs + pRecord->pathLen + 1) > size) || (pIndex->data[offs + pRecord->pathLen] != '\0'))
+         goto fail;
+      entry.path = &pIndex->data[offs];
+      offs = INDEX_ALIGN(offs + pRecord->pathLen + 1);
+
+      entry.nGrams = pRecord->nGrams;
+      entry.grams = NULL;
+      if (entry.nGrams != INDEX_ALL_GRAMS)
+      {
+         if ((entry.nGrams > GRAM_SPACE) || ((offs + (entry.nGrams * sizeof(uint16_t))) > size))
+            goto fail;
+         entry.grams = (const uint16_t *)&pIndex->data[offs];
+         offs = INDEX_ALIGN(offs + (entry.nGrams * sizeof(uint16_t)));
+      }
+
+      entry.mtimeSec = pRecord->mtimeSec;
+      entry.mtimeNsec = pRecord->mtimeNsec;
+      entry.size = pRecord->size;
+      entry.owned = false;
+      if (!entry_list_add(&pIndex->list, &entry))
+         goto fail;
+   }
+
+   return true;
+
+fail:
+   index_free(pIndex);
+   memset(pIndex, 0, sizeof(index_t));
+   return false;
+}
+
+/**
+ * @brief Write @param len bytes at @param pData to @param fp followed by zeros up to
+ *    the next 8 byte boundary
+ */
+static bool write_padded(FILE *fp, const void *pData, size_t len)
+{
+   static const char zeros[8];
+
+   return (fwrite(pData, 1, len, fp) == len) &&
+          (fwrite(zeros, 1, INDEX_ALIGN(len) - len, fp) == (INDEX_ALIGN(len) - len));
+}
+
+/**
+ * @brief Save the entries of @param pList, sorted by path, as the index of directory
+ *    @param root in @param file.  @param livePid is the watcher keeping it current, or 0.
+ *    The index is written to a temporary file and renamed over the old one, so a
+ *    concurrent search always reads a whole index.
+ *
+ * @return false if the file could not be written
+ */
+static bool index_save(const char *file, const char *root, pid_t livePid, const entry_list_t *pList)
+{
+   char tmpFile[PATH_MAX];
+   index_header_t header;
+   index_record_t record;
+   const index_entry_t *pEntry;
+   bool success;
+   size_t entry;
+   FILE *fp;
+
+   snprintf(tmpFile, sizeof(tmpFile), "%s.tmp.%d", file, (int)getpid());
+   fp = fopen(tmpFile, "we");
+   if (fp == NULL)
+      return false;
+
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+   header.version = INDEX_VERSION;
+   header.livePid = livePid;
+   header.nEntries = pList->count;
+   header.rootLen = strlen(root) + 1;
+   success = (fwrite(&header, sizeof(header), 1, fp) == 1) && write_padded(fp, root, header.rootLen);
+
+   for (entry = 0; success && (entry < pList->count); entry++)
+   {
+      pEntry = &pList->entries[entry];
+      memset(&record, 0, sizeof(record));
+      record.mtimeSec = pEntry->mtimeSec;
+      record.mtimeNsec = pEntry->mtimeNsec;
+      record.size = pEntry->size;
+      record.nGrams = pEntry->nGrams;
+      record.pathLen = strlen(pEntry->path);
+      success = (fwrite(&record, sizeof(record), 1, fp) == 1) &&
+                write_padded(fp, pEntry->path, record.pathLen + 1) &&
+                ((record.nGrams == INDEX_ALL_GRAMS) ||
+                 write_padded(fp, pEntry->grams, record.nGrams * sizeof(uint16_t)));
+   }
+
+   success = (fclose(fp) == 0) && success;
+   if (success)
+      success = (rename(tmpFile, file) == 0);
+   if (!success)
+      unlink(tmpFile);
+   return success;
+}
+
+/**
+ * @brief Mark the index in @param file as not kept current, rewriting only its header,
+ *    so searches walk the tree instead of trusting it
+ */
+static void index_clear_live(const char *file)
+{
+   index_header_t header;
+   int32_t livePid = 0;
+   int fd;
+
+   fd = open(file, O_RDWR | O_CLOEXEC);
+   if (fd < 0)
+      return;
+   if ((pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header)) &&
+       (memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) == 0) && (header.version == INDEX_VERSION) &&
+       (header.livePid != 0) &&
+       (pwrite(fd, &livePid, sizeof(livePid), offsetof(index_header_t, livePid)) != (ssize_t)sizeof(livePid)))
+      fprintf(stderr, "finder: failed to update index %s: %s\n", file, strerror(errno));
+   close(fd);
+}
+
+static void index_free(index_t *pIndex)
+{
+   entry_list_free(&pIndex->list);
+   free(pIndex->data);
+   pIndex->data = NULL;
+}
+
+/**
+ * @brief Lock the lock file of @param indexFile for as long as this process runs, and
+ *    write the process ID to it.  The file is emptied before it is locked, so the ID
+ *    of a watcher that died is never read under the lock of a new one.
+ *
+ * @return the open lock file, -1 if it could not be locked
+ */
+static int watch_lock(const char *indexFile)
+{
+   char path[PATH_MAX];
+   char pid[16];
+   int len;
+   int fd;
+
+   if (snprintf(path, sizeof(path), "%s" WATCH_LOCK_SUFFIX, indexFile) >= (int)sizeof(path))
+      return -1;
+   fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+   if (fd < 0)
+      return -1;
+   len = snprintf(pid, sizeof(pid), "%d\n", (int)getpid());
+   if ((flock(fd, LOCK_SH) < 0) || (write(fd, pid, len) != len))
+   {
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+/**
+ * @brief A process ID can be reused once its process has gone, but a lock is released
+ *    as soon as its holder exits, however it exits.
+ *
+ * @return true if the watcher @param livePid that saved @param indexFile still holds
+ *    its lock file
+ */
+static bool watcher_alive(const char *indexFile, pid_t livePid)
+{
+   char path[PATH_MAX];
+   char pid[16];
+   ssize_t len;
+   bool alive;
+   int fd;
+
+   if (snprintf(path, sizeof(path), "%s" WATCH_LOCK_SUFFIX, indexFile) >= (int)sizeof(path))
+      return false;
+   fd = open(path, O_RDONLY | O_CLOEXEC);
+   if (fd < 0)
+      return false;
+
+   // Held by some watcher, then check it is the one that saved the index
+   alive = (flock(fd, LOCK_EX | LOCK_NB) < 0) && (errno == EWOULDBLOCK);
+   if (alive)
+   {
+      len = pread(fd, pid, sizeof(pid) - 1, 0);
+      pid[(len > 0) ? len : 0] = '\0';
+      alive = (strtol(pid, NULL, 10) == livePid);
+   }
+   close(fd);
+   return alive;
+}
+
+static void stop_handler(int signo)
+{
+   (void)signo;
+   stopWatching = 1;
+}
+
+/**
+ * @brief Keep the index in @param indexFile current until SIGINT or SIGTERM.  Each pass
+ *    walks the tree, adding an inotify watch to every directory and rehashing files
+ *    whose mtime or size changed, then saves the index marked live.  The first change
+ *    after a pass marks the index not live, so searches walk the tree rather than miss
+ *    it, and the next pass starts once the tree has been quiet for WATCH_SETTLE_MS.
+ *
+ * @return exit status for main()
+ */
+static int watch_index(finder_t *pFinder, const char *indexFile)
+{
+   char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+   struct sigaction action;
+   struct pollfd pfd;
+   entry_list_t merged;
+   index_t index;
+   unsigned long files;
+   unsigned long lines;
+   int timeout;
+   pid_t livePid;
+   int rtnVal;
+   int lockFd;
+
+   pFinder->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+   if (pFinder->inotifyFd < 0)
+   {
+      perror("inotify_init1");
+      return 1;
+   }
+
+   // No SA_RESTART so poll() returns on a signal
+   memset(&action, 0, sizeof(action));
+   action.sa_handler = stop_handler;
+   sigaction(SIGINT, &action, NULL);
+   sigaction(SIGTERM, &action, NULL);
+
+   // Searches only trust the index while its lock is held, an index saved as live by a
+   // watcher that was killed must not be trusted in the meantime either
+   index_clear_live(indexFile);
+   lockFd = watch_lock(indexFile);
+   if (lockFd < 0)
+      fprintf(stderr, "finder: failed to lock %s" WATCH_LOCK_SUFFIX ", searches will walk the tree\n", indexFile);
+
+   pfd.fd = pFinder->inotifyFd;
+   pfd.events = POLLIN;
+   while (!stopWatching)
+   {
+      // Refresh against the index of the last pass
+      if (index_load(indexFile, &index) && (strcmp(index.root, pFinder->rootPath) != 0))
+      {
+         index_free(&index);
+         memset(&index, 0, sizeof(index));
+      }
+      pFinder->pIndex = &index;
+      atomic_store(&pFinder->watchFailed, false);
+      finder_run(pFinder, NULL, &files, &lines);
+
+      // Only an index with every directory watched may be trusted without a walk
+      if (merge_entries(pFinder, &merged))
+      {
+         livePid = ((lockFd < 0) || atomic_load(&pFinder->watchFailed)) ? 0 : getpid();
+         if (!index_save(indexFile, pFinder->rootPath, livePid, &merged))
+            fprintf(stderr, "finder: failed to save index %s: %s\n", indexFile, strerror(errno));
+         entry_list_free(&merged);
+      }
+      pFinder->pIndex = NULL;
+      index_free(&index);
+
+      // Wait for a change, then for the tree to settle
+      timeout = -1;
+      while (!stopWatching)
+      {
+         rtnVal = poll(&pfd, 1, timeout);
+         if (rtnVal == 0)
+            break;
+         if (rtnVal > 0)
+         {
+            while (read(pFinder->inotifyFd, events, sizeof(events)) > 0)
+               ;
+            if (timeout < 0)
+               index_clear_live(indexFile);
+            timeout = WATCH_SETTLE_MS;
+         }
+         else if (errno != EINTR)
+         {
+            perror("poll");
+            stopWatching = 1;
+         }
+      }
+   }
+
+   // Searches must walk the tree again once nobody keeps the index current
+   index_clear_live(indexFile);
+   if (lockFd >= 0)
+      close(lockFd);
+   close(pFinder->inotifyFd);
+   return 0;
+}
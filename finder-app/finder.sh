@@ -40,6 +40,20 @@ fi
 filesdir=$1
 searchstr=$2
 
+# Use the native finder when it's installed alongside this script or on the PATH, it walks the
+# tree once and counts matching lines rather than grep matches.  Set FINDER_INDEX to the path
+# of an index file, outside filesdir, to have repeated searches reuse it
+finderbin="$(dirname "$0")/finder"
+if [ ! -x "$finderbin" ]; then
+   finderbin=$(command -v finder)
+fi
+if [ -n "$finderbin" ]; then
+   if [ -n "$FINDER_INDEX" ]; then
+      exec "$finderbin" -i "$FINDER_INDEX" "$filesdir" "$searchstr"
+   fi
+   exec "$finderbin" "$filesdir" "$searchstr"
+fi
+
 # Get the number of files in the directory and number of matchines.   Print results
 echo "The number of files are $(find "$filesdir" -type f | wc -l) and the number of matching lines are $(grep -or "$searchstr" "$filesdir" | wc -w)"
 exit 0
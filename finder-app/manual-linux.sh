@@ -122,7 +122,7 @@ sudo mknod -m 666 dev/null c 1 3
 sudo mknod -m 600 dev/console c 5 1 
 
 # TODO: Clean and build the writer utility
-echo "<----- Cleaning and build writer app ----->"
+echo "<----- Cleaning and build writer and finder apps ----->"
 cd $FINDER_APP_DIR
 make clean
 make CROSS_COMPILE=${CROSS_COMPILE}
@@ -135,6 +135,7 @@ cp -f $FINDER_APP_DIR/conf/ -r ${OUTDIR}/rootfs/home
 cp -f $FINDER_APP_DIR/finder.sh ${OUTDIR}/rootfs/home
 cp -f $FINDER_APP_DIR/finder-test.sh ${OUTDIR}/rootfs/home
 cp -f $FINDER_APP_DIR/writer ${OUTDIR}/rootfs/home
+cp -f $FINDER_APP_DIR/finder ${OUTDIR}/rootfs/home
 
 # TODO: Chown the root directory
 echo "<----- Setting root filesystem owner and group ----->"
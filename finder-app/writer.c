@@ -5,6 +5,18 @@
  *
  * @brief Simple application that writes a specified string to a specified file.
  *
+ *    writer <file> <string>
+ *       Write string to file, as required by the assignment.
+ *    writer [-s | -m] [-d] [-p bytes] [-b bytes] <file> [string...]
+ *       -s  copy standard input to file
+ *       -m  write every string to file, each followed by a newline
+ *       -d  write with O_DIRECT, falling back to buffered if the file system refuses it
+ *       -p  preallocate bytes of the file with fallocate() before writing
+ *       -b  size of the output buffer, default 1 MiB
+ *
+ *    Output is gathered in a large aligned buffer, or handed straight to writev() for
+ *    -m without -d, so bulk output takes a few large writes instead of one per string.
+ *
  * @copyright Copyright (c) 2022
  *
  */
@@ -12,28 +24,61 @@
 // ============================================================================
 // INCLUDES
 // ============================================================================
+#define _GNU_SOURCE // O_DIRECT, fallocate
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
-#include <syslog.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "aesdlog.h"
+
 // ============================================================================
 // PRIVATE MACROS AND DEFINES
 // ============================================================================
 
 #define MAX_ARGC 3
 
+// Default output buffer size
+#define DEFAULT_BUFFER_SIZE (1024 * 1024)
+
+// Alignment of the buffer and of every O_DIRECT write, a multiple of any logical block size
+#define DIRECT_ALIGN 4096
+
+// Mode of a created file, as the original creat() call
+#define FILE_MODE 0755
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 // ============================================================================
 // PRIVATE TYPEDEFS
 // ============================================================================
 
+// Buffered output file
+typedef struct
+{
+   int fd;
+   bool direct;      // fd has O_DIRECT set
+   char *buf;        // DIRECT_ALIGN aligned
+   size_t size;      // capacity of buf, a multiple of DIRECT_ALIGN
+   size_t used;      // bytes in buf
+} output_t;
+
 // ============================================================================
 // STATIC VARIABLES
 // ============================================================================
 
+static const char newline = '\n';
+
 // ============================================================================
 // GLOBAL VARIABLES
 // ============================================================================
@@ -42,56 +87,322 @@
 // STATIC FUNCTION PROTOTYPES
 // ============================================================================
 
+static void usage(void);
+static bool write_all(output_t *pOut, const char *pData, size_t len);
+static bool output_flush(output_t *pOut, bool final);
+static bool output_append(output_t *pOut, const char *pData, size_t len);
+static bool write_stdin(output_t *pOut);
+static bool write_strings(output_t *pOut, char **strings, int count);
+
 // ============================================================================
 // GLOBAL FUNCTIONS
 // ============================================================================
 
 int main(int argc, char **argv)
 {
+   output_t out = {.fd = -1};
+   bool fromStdin = false;
+   bool many = false;
+   bool direct = false;
+   off_t prealloc = 0;
+   size_t bufSize = DEFAULT_BUFFER_SIZE;
+   bool success;
+   int flags;
+   int opt;
+
    // Create logger
-   openlog(NULL, 0, LOG_USER);
+   aesdlog_init(NULL, LOG_USER, LOG_DEBUG, 0);
 
-   // Validate enough arguments have been passed
-   if (argc < MAX_ARGC)
+   // Options must come before the file so "writer file -string" still writes -string
+   while ((opt = getopt(argc, argv, "+smdp:b:")) != -1)
    {
-      syslog(LOG_ERR, "Error: Invalid number of arguments passed <path to file> <text string>");
-      closelog(); // Close sys log
-      return 1; // Return error
+      switch (opt)
+      {
+      case 's':
+         fromStdin = true;
+         break;
+      case 'm':
+         many = true;
+         break;
+      case 'd':
+         direct = true;
+         break;
+      case 'p':
+         prealloc = strtoll(optarg, NULL, 0);
+         break;
+      case 'b':
+         bufSize = strtoul(optarg, NULL, 0);
+         break;
+      default:
+         usage();
+         return 1;
+      }
    }
 
-   // Assuming arg1 is valid, open file with write permissions.
-   int fd = creat(argv[1], 0755);
-   if (fd < 0)
+   // Validate enough arguments have been passed, the plain form needs a string
+   if ((fromStdin && many) || (argc - optind < ((fromStdin || many) ? 1 : MAX_ARGC - 1)))
    {
-      syslog(LOG_ERR, "Error: Creating file \"%s\"", argv[1]);
-      closelog(); // Close sys log
+      AESD_LOG(LOG_ERR, "Error: Invalid number of arguments passed <path to file> <text string>");
+      usage();
       return 1;
    }
 
-   fd = open(argv[1], O_WRONLY);
-   if (fd < 0)
+   // Round the buffer to whole O_DIRECT blocks
+   bufSize = (bufSize + DIRECT_ALIGN - 1) & ~((size_t)DIRECT_ALIGN - 1);
+   if (bufSize == 0)
+      bufSize = DIRECT_ALIGN;
+   out.size = bufSize;
+   if (posix_memalign((void **)&out.buf, DIRECT_ALIGN, out.size) != 0)
    {
-      syslog(LOG_ERR, "Error: Failed to open \"%s\"", argv[1]);
-      closelog(); // Close sys log
+      AESD_LOG(LOG_ERR, "Error: Out of memory for a %zu byte buffer", out.size);
       return 1;
    }
 
-   // Write string to file
-   syslog(LOG_DEBUG, "Writing \"%s\" to \"%s\"", argv[2], argv[1]);
-   if (write(fd, (char*)argv[2], strlen(argv[2])) < 0)
+   // Assuming arg1 is valid, create or truncate file with write permissions.
+   flags = O_WRONLY | O_CREAT | O_TRUNC;
+   out.fd = open(argv[optind], flags | (direct ? O_DIRECT : 0), FILE_MODE);
+   if ((out.fd < 0) && direct && (errno == EINVAL))
+   {
+      AESD_LOG(LOG_WARNING, "O_DIRECT not supported for \"%s\", writing buffered", argv[optind]);
+      out.fd = open(argv[optind], flags, FILE_MODE);
+   }
+   else
    {
-      syslog(LOG_ERR, "Error: Failed to write \"%s\" to \"%s\"", argv[2], argv[1]);
-      close(fd); // Close file
-      closelog(); // Close sys log
+      out.direct = direct;
+   }
+   if (out.fd < 0)
+   {
+      AESD_LOG(LOG_ERR, "Error: Failed to open \"%s\": %s", argv[optind], strerror(errno));
+      free(out.buf);
+      return 1;
+   }
+
+   // Reserve the blocks up front, without changing the size the file ends up with
+   if ((prealloc > 0) && (fallocate(out.fd, FALLOC_FL_KEEP_SIZE, 0, prealloc) < 0))
+      AESD_LOG(LOG_WARNING, "fallocate of %lld bytes failed: %s", (long long)prealloc, strerror(errno));
+
+   if (fromStdin)
+   {
+      AESD_LOG(LOG_DEBUG, "Writing standard input to \"%s\"", argv[optind]);
+      success = write_stdin(&out);
+   }
+   else if (many)
+   {
+      AESD_LOG(LOG_DEBUG, "Writing %d strings to \"%s\"", argc - optind - 1, argv[optind]);
+      success = write_strings(&out, &argv[optind + 1], argc - optind - 1);
+   }
+   else
+   {
+      // Write string to file
+      AESD_LOG(LOG_DEBUG, "Writing \"%s\" to \"%s\"", argv[optind + 1], argv[optind]);
+      success = output_append(&out, argv[optind + 1], strlen(argv[optind + 1]));
+   }
+   success = success && output_flush(&out, true);
+
+   if (close(out.fd) < 0)
+      success = false;
+   free(out.buf);
+
+   if (!success)
+   {
+      AESD_LOG(LOG_ERR, "Error: Failed to write to \"%s\": %s", argv[optind], strerror(errno));
       return 1;
    }
 
    // Successfully wrote message to file.
-   close(fd); // Close file
-   closelog(); // Close sys log
    return 0;
 }
 
 // ============================================================================
 // STATIC FUNCTIONS
 // ============================================================================
+
+static void usage(void)
+{
+   fprintf(stderr, "Usage: writer <file> <string>\n"
+                   "       writer [-s | -m] [-d] [-p bytes] [-b bytes] <file> [string...]\n");
+}
+
+/**
+ * @brief Write all @param len bytes at @param pData to the file of @param pOut.  If the
+ *    file system rejects an O_DIRECT write the rest is written buffered.
+ *
+ * @return false on a write error
+ */
+static bool write_all(output_t *pOut, const char *pData, size_t len)
+{
+   ssize_t nWritten;
+
+   while (len > 0)
+   {
+      nWritten = write(pOut->fd, pData, len);
+      if (nWritten < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         if (pOut->direct && (errno == EINVAL))
+         {
+            fcntl(pOut->fd, F_SETFL, fcntl(pOut->fd, F_GETFL) & ~O_DIRECT);
+            pOut->direct = false;
+            continue;
+         }
+         return false;
+      }
+      pData += nWritten;
+      len -= nWritten;
+   }
+
+   return true;
+}
+
+/**
+ * @brief Write the buffer of @param pOut.  With O_DIRECT only whole blocks are written
+ *    until @param final, when the unaligned tail is written with O_DIRECT cleared.
+ *
+ * @return false on a write error
+ */
+static bool output_flush(output_t *pOut, bool final)
+{
+   size_t aligned = pOut->used;
+
+   if (pOut->direct)
+      aligned &= ~((size_t)DIRECT_ALIGN - 1);
+
+   if (!write_all(pOut, pOut->buf, aligned))
+      return false;
+   memmove(pOut->buf, &pOut->buf[aligned], pOut->used - aligned);
+   pOut->used -= aligned;
+
+   if (final && (pOut->used > 0))
+   {
+      if (pOut->direct)
+      {
+         fcntl(pOut->fd, F_SETFL, fcntl(pOut->fd, F_GETFL) & ~O_DIRECT);
+         pOut->direct = false;
+      }
+      if (!write_all(pOut, pOut->buf, pOut->used))
+         return false;
+      pOut->used = 0;
+   }
+
+   return true;
+}
+
+/**
+ * @brief Copy @param len bytes at @param pData to the buffer of @param pOut, writing it
+ *    out each time it fills
+ *
+ * @return false on a write error
+ */
+static bool output_append(output_t *pOut, const char *pData, size_t len)
+{
+   size_t chunk;
+
+   while (len > 0)
+   {
+      chunk = pOut->size - pOut->used;
+      if (chunk > len)
+         chunk = len;
+      memcpy(&pOut->buf[pOut->used], pData, chunk);
+      pOut->used += chunk;
+      pData += chunk;
+      len -= chunk;
+
+      if ((pOut->used == pOut->size) && !output_flush(pOut, false))
+         return false;
+   }
+
+   return true;
+}
+
+/**
+ * @brief Copy standard input to @param pOut, reading straight into the output buffer
+ *
+ * @return false on a read or write error
+ */
+static bool write_stdin(output_t *pOut)
+{
+   ssize_t nRead;
+
+   while (true)
+   {
+      nRead = read(STDIN_FILENO, &pOut->buf[pOut->used], pOut->size - pOut->used);
+      if (nRead < 0)
+      {
+         if (errno == EINTR)
+            continue;
+         return false;
+      }
+      if (nRead == 0)
+         return true;
+
+      pOut->used += nRead;
+      if ((pOut->used == pOut->size) && !output_flush(pOut, false))
+         return false;
+   }
+}
+
+/**
+ * @brief Write @param count @param strings to @param pOut, each followed by a newline.
+ *    Buffered output gathers them with writev() without copying, O_DIRECT output copies
+ *    them to the aligned buffer.
+ *
+ * @return false on a write error
+ */
+static bool write_strings(output_t *pOut, char **strings, int count)
+{
+   struct iovec iov[IOV_MAX];
+   struct iovec *pIov;
+   ssize_t nWritten;
+   int nIov;
+   int index = 0;
+
+   if (pOut->direct)
+   {
+      for (index = 0; index < count; index++)
+      {
+         if (!output_append(pOut, strings[index], strlen(strings[index])) ||
+             !output_append(pOut, &newline, 1))
+            return false;
+      }
+      return true;
+   }
+
+   while (index < count)
+   {
+      // Gather as many strings as fit in one call
+      for (nIov = 0; (index < count) && (nIov + 2 <= IOV_MAX); index++)
+      {
+         iov[nIov].iov_base = strings[index];
+         iov[nIov++].iov_len = strlen(strings[index]);
+         iov[nIov].iov_base = (void *)&newline;
+         iov[nIov++].iov_len = 1;
+      }
+
+      // Resume after short writes
+      pIov = iov;
+      while (nIov > 0)
+      {
+         nWritten = writev(pOut->fd, pIov, nIov);
+         if (nWritten < 0)
+         {
+            if (errno == EINTR)
+               continue;
+            return false;
+         }
+         while ((nIov > 0) && ((size_t)nWritten >= pIov->iov_len))
+         {
+            nWritten -= pIov->iov_len;
+            pIov++;
+            nIov--;
+         }
+         if (nIov > 0)
+         {
+            pIov->iov_base = (char *)pIov->iov_base + nWritten;
+            pIov->iov_len -= nWritten;
+         }
+      }
+   }
+
+   return true;
+}
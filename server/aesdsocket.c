@@ -37,6 +37,8 @@
 #include <time.h>
 #include <sys/time.h>
 #include <poll.h>
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "../examples/lockprof/lockprof.h"
 
 // ============================================================================
 // PRIVATE MACROS AND DEFINES
@@ -61,6 +63,8 @@
 #define USE_AESD_CHAR_DEVICE 1
 #ifdef USE_AESD_CHAR_DEVICE
     #define STORAGE_DATA_PATH "/dev/aesdchar"
+    // Command moving the read position to a record, "AESDCHAR_IOCSEEKTO:X,Y"
+    #define SEEKTO_CMD "AESDCHAR_IOCSEEKTO:"
 #else
     #define STORAGE_DATA_PATH "/var/tmp/aesdsocketdata"
 #endif
@@ -103,7 +107,7 @@ static int serverfd = -1;
 static int clientfd = -1;
 static struct addrinfo *pServerInfo;
 static bool appShutdown = false;
-static pthread_mutex_t writeMutex = PTHREAD_MUTEX_INITIALIZER; // Initialize mutex'
+static lockprof_mutex_t writeMutex = LOCKPROF_MUTEX_INITIALIZER("aesdsocket write"); // Initialize mutex'
 
 // ============================================================================
 // GLOBAL VARIABLES
@@ -135,6 +139,14 @@ static void cleanup(void);
  */
 static void sig_handler(int signo);
 
+/**
+ * @brief Log a line of a lock profile dump
+ *
+ * @param line - Line of the dump
+ * @param ctx - Unused
+ */
+static void log_lockprof(const char *line, void *ctx);
+
 /**
  * @brief Handles all socket communication
  * 
@@ -257,6 +269,10 @@ int main(int argc, char **argv)
         daemon(0, 0);
     }
 
+    // Dump lock contention on SIGUSR1, started after daemon() as threads don't survive its fork
+    if (!lockprof_start_dumper(SIGUSR1, log_lockprof, NULL))
+        log_message(LOG_ERR, "Error: could not start lock profile dumper\n");
+
     // Listen for connection
     if (listen(serverfd, MAX_CONNECTIONS) < 0)
     {
@@ -423,7 +439,7 @@ void cleanup(void)
         close(clientfd);
 
     // Remove mutex
-    pthread_mutex_destroy(&writeMutex);
+    lockprof_mutex_destroy(&writeMutex);
 
     log_message(LOG_INFO, "Terminated\n");
 
@@ -437,6 +453,11 @@ void sig_handler(int signo)
     appShutdown = true;
 }
 
+void log_lockprof(const char *line, void *ctx)
+{
+    log_message(LOG_INFO, "%s\n", line);
+}
+
 void *handle_socket_comms(void *pThreadParams)
 {
     char buf[1024];
@@ -447,6 +468,7 @@ void *handle_socket_comms(void *pThreadParams)
     int streamPos = 0;
     THREAD_PARAMS_T *pTP = (THREAD_PARAMS_T *)pThreadParams;
     int fd = -1;
+    bool locked = false;
 
     pTP->threadStatus = SCKT_THREAD_RUNNING;
     pBuf = (char *)malloc(sizeof(char) * BUFFER_SIZE);
@@ -496,6 +518,7 @@ void *handle_socket_comms(void *pThreadParams)
     // Write data to file
     if (!write_lock())
         goto on_error;
+    locked = true;
 
     fd = open(STORAGE_DATA_PATH, O_RDWR | O_CREAT | O_APPEND, 0644);
     if (fd == -1)
@@ -504,15 +527,32 @@ void *handle_socket_comms(void *pThreadParams)
         goto on_error;
     }
 
-    // Save data received from client
-    nWrite = write(fd, pBuf, streamPos);
-    if (nWrite == -1)
+#ifdef USE_AESD_CHAR_DEVICE
+    if ((streamPos > strlen(SEEKTO_CMD)) && (strncmp(pBuf, SEEKTO_CMD, strlen(SEEKTO_CMD)) == 0))
     {
-        log_message(LOG_ERR, "Thread %d -- Error: writing to file\n", pTP->threadId);
-        goto on_error;
+        // Seek command, resume reading at the requested record instead of the start
+        struct aesd_seekto seekto;
+        pBuf[streamPos - 1] = '\0'; // Replace new line
+        if ((sscanf(&pBuf[strlen(SEEKTO_CMD)], "%u,%u", &seekto.write_cmd, &seekto.write_cmd_offset) != 2) ||
+            (ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) != 0))
+        {
+            log_message(LOG_ERR, "Thread %d -- Error: invalid seek command \"%s\"\n", pTP->threadId, pBuf);
+            goto on_error;
+        }
     }
+    else
+#endif
+    {
+        // Save data received from client
+        nWrite = write(fd, pBuf, streamPos);
+        if (nWrite == -1)
+        {
+            log_message(LOG_ERR, "Thread %d -- Error: writing to file\n", pTP->threadId);
+            goto on_error;
+        }
 
-    lseek(fd, 0, SEEK_SET); // go to begining of file
+        lseek(fd, 0, SEEK_SET); // go to begining of file
+    }
 
     // Write data to socket
     int rdPos = 0;
@@ -560,7 +600,8 @@ void *handle_socket_comms(void *pThreadParams)
 on_error:
     if (fd != -1)
         close(fd);      // Close file
-    write_unlock(); // Release lock
+    if (locked)
+        write_unlock(); // Release lock, only if taken
     free(pBuf); // Done with allocated memory
     pTP->threadResult = -1;
     pTP->threadStatus = SCKT_THREAD_DONE;
@@ -604,7 +645,7 @@ void *handle_timer(void *args)
 
 bool write_lock(void)
 {
-    if (pthread_mutex_lock(&writeMutex) != 0)
+    if (lockprof_mutex_lock(&writeMutex) != 0)
     {
         log_message(LOG_ERR, "Error: Could not acquire lock\n");
         return false;
@@ -614,7 +655,7 @@ bool write_lock(void)
 
 bool write_unlock(void)
 {
-    if (pthread_mutex_unlock(&writeMutex) != 0)
+    if (lockprof_mutex_unlock(&writeMutex) != 0)
     {
         log_message(LOG_ERR, "Error: Could not release lock\n");
         return false;
@@ -0,0 +1,170 @@
+#include "unity.h"
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../examples/threading/threading.h"
+
+#define LOCK_THREADS 4
+#define LOCK_ITERATIONS 20000
+
+// One operation in WRITE_EVERY takes the rwlock for writing
+#define WRITE_EVERY 8
+
+static adaptive_mutex_t adaptiveMutex = ADAPTIVE_MUTEX_INITIALIZER;
+static rwlock_t rwlock = RWLOCK_INITIALIZER;
+
+// Protected by the lock under test
+static unsigned long counter;
+
+// Threads inside the critical section, a thread seeing any other counts an overlap
+static atomic_int readersInside;
+static atomic_int writersInside;
+static atomic_int overlaps;
+
+static void *adaptive_mutex_thread(void *arg)
+{
+    int index;
+
+    (void)arg;
+    for (index = 0; index < LOCK_ITERATIONS; index++)
+    {
+        adaptive_mutex_lock(&adaptiveMutex);
+        if (atomic_fetch_add(&writersInside, 1) != 0)
+            atomic_fetch_add(&overlaps, 1);
+        counter++;
+        atomic_fetch_sub(&writersInside, 1);
+        adaptive_mutex_unlock(&adaptiveMutex);
+    }
+    return NULL;
+}
+
+static void *rwlock_thread(void *arg)
+{
+    int index;
+
+    (void)arg;
+    for (index = 0; index < LOCK_ITERATIONS; index++)
+    {
+        if ((index % WRITE_EVERY) == 0)
+        {
+            rwlock_wrlock(&rwlock);
+            if ((atomic_fetch_add(&writersInside, 1) != 0) || (atomic_load(&readersInside) != 0))
+                atomic_fetch_add(&overlaps, 1);
+            counter++;
+            atomic_fetch_sub(&writersInside, 1);
+        }
+        else
+        {
+            rwlock_rdlock(&rwlock);
+            atomic_fetch_add(&readersInside, 1);
+            if (atomic_load(&writersInside) != 0)
+                atomic_fetch_add(&overlaps, 1);
+            atomic_fetch_sub(&readersInside, 1);
+        }
+        rwlock_unlock(&rwlock);
+    }
+    return NULL;
+}
+
+static void *rwlock_writer_thread(void *arg)
+{
+    (void)arg;
+    rwlock_wrlock(&rwlock);
+    counter++;
+    rwlock_unlock(&rwlock);
+    return NULL;
+}
+
+static void run_threads(void *(*thread_fn)(void *))
+{
+    pthread_t threads[LOCK_THREADS];
+    int index;
+
+    counter = 0;
+    atomic_store(&readersInside, 0);
+    atomic_store(&writersInside, 0);
+    atomic_store(&overlaps, 0);
+    for (index = 0; index < LOCK_THREADS; index++)
+        TEST_ASSERT_TRUE_MESSAGE(pthread_create(&threads[index], NULL, thread_fn, NULL) == 0, "pthread_create failed");
+    for (index = 0; index < LOCK_THREADS; index++)
+        pthread_join(threads[index], NULL);
+}
+
+/**
+* Threads incrementing a counter under the adaptive mutex must never overlap or lose
+* an increment.
+*/
+void test_adaptive_mutex_mutual_exclusion()
+{
+    run_threads(&adaptive_mutex_thread);
+    TEST_ASSERT_EQUAL_UINT32(0, atomic_load(&overlaps));
+    TEST_ASSERT_EQUAL_UINT32(LOCK_THREADS * LOCK_ITERATIONS, counter);
+    TEST_ASSERT_EQUAL_UINT32(0, adaptive_mutex_destroy(&adaptiveMutex));
+}
+
+/**
+* A writer of the rwlock must never share it with another writer or a reader.
+*/
+void test_rwlock_mutual_exclusion()
+{
+    run_threads(&rwlock_thread);
+    TEST_ASSERT_EQUAL_UINT32(0, atomic_load(&overlaps));
+    TEST_ASSERT_EQUAL_UINT32(LOCK_THREADS * ((LOCK_ITERATIONS + WRITE_EVERY - 1) / WRITE_EVERY), counter);
+    TEST_ASSERT_EQUAL_UINT32(0, rwlock_destroy(&rwlock));
+}
+
+/**
+* trylock returns EBUSY while the mutex is held, as does destroy.
+*/
+void test_adaptive_mutex_trylock()
+{
+    adaptive_mutex_t mutex;
+
+    TEST_ASSERT_EQUAL_UINT32(0, adaptive_mutex_init(&mutex));
+    TEST_ASSERT_EQUAL_UINT32(0, adaptive_mutex_trylock(&mutex));
+    TEST_ASSERT_EQUAL_UINT32(EBUSY, adaptive_mutex_trylock(&mutex));
+    TEST_ASSERT_EQUAL_UINT32(EBUSY, adaptive_mutex_destroy(&mutex));
+    TEST_ASSERT_EQUAL_UINT32(0, adaptive_mutex_unlock(&mutex));
+    TEST_ASSERT_EQUAL_UINT32(0, adaptive_mutex_trylock(&mutex));
+    TEST_ASSERT_EQUAL_UINT32(0, adaptive_mutex_unlock(&mutex));
+    TEST_ASSERT_EQUAL_UINT32(0, adaptive_mutex_destroy(&mutex));
+}
+
+/**
+* Readers share the rwlock and keep writers out, a writer keeps everyone out, and once a
+* writer is waiting tryrdlock returns EBUSY even though only readers hold the lock.
+*/
+void test_rwlock_trylock()
+{
+    pthread_t writer;
+
+    counter = 0;
+    TEST_ASSERT_EQUAL_UINT32(0, rwlock_init(&rwlock));
+    TEST_ASSERT_EQUAL_UINT32(0, rwlock_tryrdlock(&rwlock));
+    TEST_ASSERT_EQUAL_UINT32(0, rwlock_tryrdlock(&rwlock));
+    TEST_ASSERT_EQUAL_UINT32(EBUSY, rwlock_trywrlock(&rwlock));
+    TEST_ASSERT_EQUAL_UINT32(EBUSY, rwlock_destroy(&rwlock));
+    TEST_ASSERT_EQUAL_UINT32(0, rwlock_unlock(&rwlock));
+    TEST_ASSERT_EQUAL_UINT32(0, rwlock_unlock(&rwlock));
+
+    TEST_ASSERT_EQUAL_UINT32(0, rwlock_trywrlock(&rwlock));
+    TEST_ASSERT_EQUAL_UINT32(EBUSY, rwlock_tryrdlock(&rwlock));
+    TEST_ASSERT_EQUAL_UINT32(EBUSY, rwlock_trywrlock(&rwlock));
+    TEST_ASSERT_EQUAL_UINT32(0, rwlock_unlock(&rwlock));
+
+    // A writer blocked behind a reader shuts out new readers
+    TEST_ASSERT_EQUAL_UINT32(0, rwlock_rdlock(&rwlock));
+    TEST_ASSERT_TRUE_MESSAGE(pthread_create(&writer, NULL, &rwlock_writer_thread, NULL) == 0, "pthread_create failed");
+    while (atomic_load(&rwlock.writers) == 0)
+        sched_yield();
+    TEST_ASSERT_EQUAL_UINT32(EBUSY, rwlock_tryrdlock(&rwlock));
+    TEST_ASSERT_EQUAL_UINT32(0, counter);
+    TEST_ASSERT_EQUAL_UINT32(0, rwlock_unlock(&rwlock));
+    pthread_join(writer, NULL);
+    TEST_ASSERT_EQUAL_UINT32(1, counter);
+
+    TEST_ASSERT_EQUAL_UINT32(0, rwlock_destroy(&rwlock));
+}
@@ -0,0 +1,114 @@
+#include "unity.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../../examples/threading/threading.h"
+
+#define NESTED_CHILDREN 8
+#define NESTED_PARENTS 4
+#define DRAIN_TASKS 64
+
+struct nested_parent
+{
+    struct thread_pool *pool;
+    atomic_int *pRan;
+};
+
+static bool count_task(void *arg)
+{
+    atomic_fetch_add((atomic_int *)arg, 1);
+    return true;
+}
+
+static bool slow_count_task(void *arg)
+{
+    struct timespec delay = {0, 1000000};
+
+    nanosleep(&delay, NULL);
+    atomic_fetch_add((atomic_int *)arg, 1);
+    return true;
+}
+
+/**
+* Submit children to the pool the parent runs on and wait for them all
+*/
+static bool nested_parent_task(void *arg)
+{
+    struct nested_parent *pParent = (struct nested_parent *)arg;
+    struct thread_future *futures[NESTED_CHILDREN];
+    bool success = true;
+    int index;
+
+    for (index = 0; index < NESTED_CHILDREN; index++)
+    {
+        futures[index] = thread_pool_submit(pParent->pool, &count_task, pParent->pRan);
+        if (futures[index] == NULL)
+            return false;
+    }
+    for (index = 0; index < NESTED_CHILDREN; index++)
+        success = thread_future_wait(futures[index]) && success;
+    return success;
+}
+
+/**
+* Tasks that submit tasks to their own pool and wait for them must not deadlock, even
+* with a single worker, which has to run the children itself while it waits.
+*/
+void test_thread_pool_nested_submit_and_wait()
+{
+    struct nested_parent parent;
+    struct thread_future *futures[NESTED_PARENTS];
+    atomic_int ran = 0;
+    unsigned int workers;
+    int index;
+
+    for (workers = 1; workers <= 2; workers++)
+    {
+        atomic_store(&ran, 0);
+        parent.pool = thread_pool_create(workers);
+        parent.pRan = &ran;
+        TEST_ASSERT_TRUE_MESSAGE(parent.pool != NULL, "thread_pool_create failed");
+
+        for (index = 0; index < NESTED_PARENTS; index++)
+        {
+            futures[index] = thread_pool_submit(parent.pool, &nested_parent_task, &parent);
+            TEST_ASSERT_TRUE_MESSAGE(futures[index] != NULL, "thread_pool_submit failed");
+        }
+        for (index = 0; index < NESTED_PARENTS; index++)
+            TEST_ASSERT_TRUE_MESSAGE(thread_future_wait(futures[index]), "a nested task failed");
+
+        TEST_ASSERT_EQUAL_UINT32(NESTED_PARENTS * NESTED_CHILDREN, atomic_load(&ran));
+        thread_pool_destroy(parent.pool);
+    }
+}
+
+/**
+* Destroying a pool must run every task still queued before the workers exit, and
+* complete their futures.
+*/
+void test_thread_pool_destroy_drains_queue()
+{
+    struct thread_future *futures[DRAIN_TASKS];
+    struct thread_pool *pool;
+    atomic_int ran = 0;
+    int index;
+
+    pool = thread_pool_create(2);
+    TEST_ASSERT_TRUE_MESSAGE(pool != NULL, "thread_pool_create failed");
+    for (index = 0; index < DRAIN_TASKS; index++)
+    {
+        futures[index] = thread_pool_submit(pool, &slow_count_task, &ran);
+        TEST_ASSERT_TRUE_MESSAGE(futures[index] != NULL, "thread_pool_submit failed");
+    }
+
+    thread_pool_destroy(pool);
+    TEST_ASSERT_EQUAL_UINT32(DRAIN_TASKS, atomic_load(&ran));
+
+    for (index = 0; index < DRAIN_TASKS; index++)
+    {
+        TEST_ASSERT_TRUE_MESSAGE(thread_future_done(futures[index]), "future not done after destroy");
+        TEST_ASSERT_TRUE_MESSAGE(thread_future_wait(futures[index]), "queued task failed");
+    }
+}
@@ -0,0 +1,139 @@
+#include "unity.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../../examples/threading/threading.h"
+
+#define ORDER_TIMERS 8
+#define ORDER_SPACING_MS 15
+
+struct order_timer
+{
+    int expected;
+    atomic_int *pNext;
+    int ran;
+};
+
+static bool order_task(void *arg)
+{
+    struct order_timer *pTimer = (struct order_timer *)arg;
+
+    pTimer->ran = atomic_fetch_add(pTimer->pNext, 1);
+    return true;
+}
+
+static bool count_task(void *arg)
+{
+    atomic_fetch_add((atomic_int *)arg, 1);
+    return true;
+}
+
+/**
+* Timers submitted out of order must run in the order of their delays, and the start
+* latency of their tasks is reported.
+*/
+void test_timer_wheel_order()
+{
+    // Delays in units of ORDER_SPACING_MS, in submission order
+    static const int delays[ORDER_TIMERS] = {5, 1, 7, 3, 8, 2, 6, 4};
+    struct thread_future *futures[ORDER_TIMERS];
+    struct order_timer timers[ORDER_TIMERS];
+    struct timer_jitter jitter;
+    struct thread_pool *pool;
+    struct timer_wheel *wheel;
+    atomic_int next = 0;
+    char message[128];
+    int index;
+
+    pool = thread_pool_create(1);
+    TEST_ASSERT_TRUE_MESSAGE(pool != NULL, "thread_pool_create failed");
+    wheel = timer_wheel_create(pool, 1);
+    TEST_ASSERT_TRUE_MESSAGE(wheel != NULL, "timer_wheel_create failed");
+
+    for (index = 0; index < ORDER_TIMERS; index++)
+    {
+        timers[index].expected = delays[index] - 1;
+        timers[index].pNext = &next;
+        timers[index].ran = -1;
+        futures[index] = timer_wheel_submit(wheel, delays[index] * ORDER_SPACING_MS, &order_task, &timers[index]);
+        TEST_ASSERT_TRUE_MESSAGE(futures[index] != NULL, "timer_wheel_submit failed");
+    }
+    for (index = 0; index < ORDER_TIMERS; index++)
+    {
+        TEST_ASSERT_TRUE_MESSAGE(thread_future_wait(futures[index]), "timer task failed");
+        TEST_ASSERT_EQUAL_UINT32(timers[index].expected, timers[index].ran);
+    }
+
+    timer_wheel_jitter(wheel, &jitter);
+    TEST_ASSERT_EQUAL_UINT32(ORDER_TIMERS, jitter.count);
+    TEST_ASSERT_TRUE_MESSAGE(jitter.min_ns >= 0, "timer task started before its deadline");
+    snprintf(message, sizeof(message), "timer jitter over %lu timers: min %lld ns, mean %lld ns, max %lld ns",
+             jitter.count, jitter.min_ns, jitter.total_ns / (long long)jitter.count, jitter.max_ns);
+    TEST_MESSAGE(message);
+
+    timer_wheel_destroy(wheel);
+    thread_pool_destroy(pool);
+}
+
+/**
+* Destroying the wheel must cancel timers not yet due, completing their futures as
+* failed without running their tasks.
+*/
+void test_timer_wheel_destroy_cancels()
+{
+    struct thread_future *pending;
+    struct thread_future *held;
+    struct thread_pool *pool;
+    struct timer_wheel *wheel;
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    atomic_int ran = 0;
+
+    pool = thread_pool_create(1);
+    TEST_ASSERT_TRUE_MESSAGE(pool != NULL, "thread_pool_create failed");
+    wheel = timer_wheel_create(pool, 1);
+    TEST_ASSERT_TRUE_MESSAGE(wheel != NULL, "timer_wheel_create failed");
+
+    pending = timer_wheel_submit(wheel, 60000, &count_task, &ran);
+    TEST_ASSERT_TRUE_MESSAGE(pending != NULL, "timer_wheel_submit failed");
+    held = timer_wheel_submit_obtaining_mutex(wheel, &mutex, 60000, 0);
+    TEST_ASSERT_TRUE_MESSAGE(held != NULL, "timer_wheel_submit_obtaining_mutex failed");
+
+    timer_wheel_destroy(wheel);
+    TEST_ASSERT_TRUE_MESSAGE(thread_future_done(pending), "cancelled future not done");
+    TEST_ASSERT_TRUE_MESSAGE(!thread_future_wait(pending), "cancelled timer reported success");
+    TEST_ASSERT_TRUE_MESSAGE(!thread_future_wait(held), "cancelled mutex timer reported success");
+    TEST_ASSERT_EQUAL_UINT32(0, atomic_load(&ran));
+
+    thread_pool_destroy(pool);
+}
+
+/**
+* A timer whose deadline has passed must still run when the wheel is destroyed, even if
+* the wheel thread has not reached its tick yet.
+*/
+void test_timer_wheel_destroy_runs_due()
+{
+    struct timespec delay = {0, 20000000};
+    struct thread_future *due;
+    struct thread_pool *pool;
+    struct timer_wheel *wheel;
+    atomic_int ran = 0;
+
+    pool = thread_pool_create(1);
+    TEST_ASSERT_TRUE_MESSAGE(pool != NULL, "thread_pool_create failed");
+
+    // A 1 ms delay rounds up to the first 10 s tick, long after the deadline
+    wheel = timer_wheel_create(pool, 10000);
+    TEST_ASSERT_TRUE_MESSAGE(wheel != NULL, "timer_wheel_create failed");
+    due = timer_wheel_submit(wheel, 1, &count_task, &ran);
+    TEST_ASSERT_TRUE_MESSAGE(due != NULL, "timer_wheel_submit failed");
+    nanosleep(&delay, NULL);
+
+    timer_wheel_destroy(wheel);
+    TEST_ASSERT_TRUE_MESSAGE(thread_future_wait(due), "due timer did not run");
+    TEST_ASSERT_EQUAL_UINT32(1, atomic_load(&ran));
+
+    thread_pool_destroy(pool);
+}
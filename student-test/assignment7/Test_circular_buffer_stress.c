@@ -0,0 +1,110 @@
+#include "unity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define CB_MODEL_CHECK(condition, message) TEST_ASSERT_TRUE_MESSAGE(condition, message)
+#include "circular-buffer-model.h"
+
+// Defaults, override with the AESD_STRESS_SEED and AESD_STRESS_STEPS environment variables
+#define STRESS_DEFAULT_SEED 7
+#define STRESS_DEFAULT_STEPS 200000
+
+#define BENCH_RECORDS 1000000
+#define BENCH_RECORD_SIZE 32
+
+static unsigned long env_or_default(const char *name, unsigned long value)
+{
+    const char *pValue = getenv(name);
+
+    return (pValue != NULL) ? strtoul(pValue, NULL, 0) : value;
+}
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+    return ((end->tv_sec - start->tv_sec) * 1e9) + (end->tv_nsec - start->tv_nsec);
+}
+
+/**
+* Run a long sequence of random add, find and deinit operations against the circular
+* buffer, the byte ring and a simple reference model, checking after every operation
+* that they agree.  Covers wraparound, eviction, records stored inline and externally
+* and ring reads spanning records and the end of the ring storage.
+*/
+void test_circular_buffer_model_check()
+{
+    static struct cb_model model;
+    unsigned long seed = env_or_default("AESD_STRESS_SEED", STRESS_DEFAULT_SEED);
+    unsigned long steps = env_or_default("AESD_STRESS_STEPS", STRESS_DEFAULT_STEPS);
+    unsigned long step;
+    uint8_t in[CB_MODEL_STEP_SIZE];
+    uint8_t index;
+    char message[64];
+
+    snprintf(message, sizeof(message), "model check seed %lu, %lu steps", seed, steps);
+    TEST_MESSAGE(message);
+    srand(seed);
+
+    cb_model_init(&model);
+    for (step = 0; step < steps; step++)
+    {
+        for (index = 0; index < CB_MODEL_STEP_SIZE; index++)
+            in[index] = (uint8_t)rand();
+        cb_model_step(&model, in);
+    }
+
+    // Every offset must still be found after the run
+    for (step = 0; step <= cb_model_total(&model); step++)
+        cb_model_find(&model, step);
+    for (step = 0; step <= cb_model_ring_total(&model); step++)
+        cb_model_ring_find(&model, step, CB_MODEL_RING_CAPACITY);
+    cb_model_reset(&model);
+}
+
+/**
+* Measure add and find throughput of the circular buffer.  Reported only, there is
+* no pass threshold since the result depends on the machine.
+*/
+void test_circular_buffer_throughput()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry;
+    struct aesd_buffer_entry *pEntry;
+    struct timespec start;
+    struct timespec end;
+    char record[BENCH_RECORD_SIZE];
+    size_t entry_offset;
+    size_t found = 0;
+    unsigned long index;
+    double addNs;
+    double findNs;
+    char message[128];
+
+    memset(record, 'a', sizeof(record));
+    aesd_circular_buffer_init(&buffer);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (index = 0; index < BENCH_RECORDS; index++)
+    {
+        aesd_buffer_entry_set(&entry, record, sizeof(record));
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    addNs = elapsed_ns(&start, &end) / BENCH_RECORDS;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (index = 0; index < BENCH_RECORDS; index++)
+    {
+        pEntry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer,
+                    index % (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED * BENCH_RECORD_SIZE), &entry_offset);
+        found += (pEntry != NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    findNs = elapsed_ns(&start, &end) / BENCH_RECORDS;
+
+    TEST_ASSERT_EQUAL_UINT32(BENCH_RECORDS, found);
+    aesd_circular_buffer_deinit(&buffer);
+
+    snprintf(message, sizeof(message), "add %.1f ns/record, find %.1f ns/lookup", addNs, findNs);
+    TEST_MESSAGE(message);
+}
@@ -0,0 +1,214 @@
+#include "unity.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../aesd-record-queue/aesd-record-queue.h"
+
+// A small queue so the records wrap around it thousands of times
+#define RQ_TEST_CAPACITY 4
+#define RQ_TEST_PRODUCERS 4
+#define RQ_TEST_RECORDS 20000
+
+// Every third record is too long to be stored inline and is malloc()ed
+#define RQ_TEST_EXTERNAL_EVERY 3
+#define RQ_TEST_HEADER_SIZE 16
+
+struct rq_test
+{
+    struct aesd_spsc_queue spsc;
+    struct aesd_mpsc_queue mpsc;
+    bool multi;
+};
+
+struct rq_producer
+{
+    struct rq_test *pTest;
+    unsigned int id;
+};
+
+static bool rq_test_push(struct rq_test *pTest, const struct aesd_buffer_entry *entry)
+{
+    return pTest->multi ? aesd_mpsc_queue_push(&pTest->mpsc, entry) : aesd_spsc_queue_push(&pTest->spsc, entry);
+}
+
+static bool rq_test_pop(struct rq_test *pTest, struct aesd_buffer_entry *entry)
+{
+    return pTest->multi ? aesd_mpsc_queue_pop(&pTest->mpsc, entry) : aesd_spsc_queue_pop(&pTest->spsc, entry);
+}
+
+/**
+* Size of record @param seq, short enough to be inline or one past the inline size
+* plus a little so external records vary in length too
+*/
+static size_t rq_test_record_size(unsigned long seq)
+{
+    if ((seq % RQ_TEST_EXTERNAL_EVERY) != 0)
+        return RQ_TEST_HEADER_SIZE;
+    return AESD_BUFFER_ENTRY_INLINE_SIZE + 1 + (seq % 16);
+}
+
+/**
+* Fill @param record with the producer id and sequence number, padded with a byte
+* derived from both so a torn or mixed up copy shows
+*/
+static void rq_test_record_fill(char *record, unsigned int id, unsigned long seq)
+{
+    size_t size = rq_test_record_size(seq);
+    char header[RQ_TEST_HEADER_SIZE + 1];
+
+    snprintf(header, sizeof(header), "P%02u %011lu", id, seq);
+    memcpy(record, header, RQ_TEST_HEADER_SIZE);
+    memset(record + RQ_TEST_HEADER_SIZE, 'a' + ((id + seq) % 26), size - RQ_TEST_HEADER_SIZE);
+}
+
+static void *rq_test_producer(void *arg)
+{
+    struct rq_producer *pProducer = (struct rq_producer *)arg;
+    struct aesd_buffer_entry entry;
+    char record[RQ_TEST_HEADER_SIZE];
+    char *pRecord;
+    unsigned long seq;
+
+    for (seq = 0; seq < RQ_TEST_RECORDS; seq++)
+    {
+        if (rq_test_record_size(seq) > AESD_BUFFER_ENTRY_INLINE_SIZE)
+        {
+            // Ownership moves to the consumer, which frees it
+            pRecord = malloc(rq_test_record_size(seq));
+            if (pRecord == NULL)
+                abort();
+        }
+        else
+        {
+            pRecord = record;
+        }
+        rq_test_record_fill(pRecord, pProducer->id, seq);
+        aesd_buffer_entry_set(&entry, pRecord, rq_test_record_size(seq));
+
+        while (!rq_test_push(pProducer->pTest, &entry))
+            sched_yield();
+    }
+    return NULL;
+}
+
+/**
+* Check a popped record against the next one expected from its producer, writing the
+* first mismatch to @param message.  Assertions are left to the caller so the queue is
+* always drained and the producers never block on a full queue.
+*/
+static bool rq_test_check(const struct aesd_buffer_entry *entry, unsigned int producers,
+                          unsigned long *nextSeq, char *message, size_t messageSize)
+{
+    char header[RQ_TEST_HEADER_SIZE + 1];
+    char expected[AESD_BUFFER_ENTRY_INLINE_SIZE + 1 + 16];
+    unsigned int id;
+    unsigned long seq;
+
+    if (entry->size < RQ_TEST_HEADER_SIZE)
+    {
+        snprintf(message, messageSize, "record of %zu bytes is too short", entry->size);
+        return false;
+    }
+    memcpy(header, entry->buffptr, RQ_TEST_HEADER_SIZE);
+    header[RQ_TEST_HEADER_SIZE] = '\0';
+    if ((sscanf(header, "P%u %lu", &id, &seq) != 2) || (id >= producers))
+    {
+        snprintf(message, messageSize, "unexpected record header \"%s\"", header);
+        return false;
+    }
+    if (seq != nextSeq[id])
+    {
+        snprintf(message, messageSize, "producer %u record %lu popped, expected %lu", id, seq, nextSeq[id]);
+        return false;
+    }
+    if ((entry->size != rq_test_record_size(seq)) ||
+        (aesd_buffer_entry_is_inline(entry) != (entry->size <= AESD_BUFFER_ENTRY_INLINE_SIZE)))
+    {
+        snprintf(message, messageSize, "producer %u record %lu has size %zu, %s", id, seq, entry->size,
+                 aesd_buffer_entry_is_inline(entry) ? "inline" : "external");
+        return false;
+    }
+    rq_test_record_fill(expected, id, seq);
+    if (memcmp(entry->buffptr, expected, entry->size) != 0)
+    {
+        snprintf(message, messageSize, "producer %u record %lu contents differ", id, seq);
+        return false;
+    }
+    nextSeq[id]++;
+    return true;
+}
+
+/**
+* Run @param producers threads pushing RQ_TEST_RECORDS records each through @param pTest
+* while this thread pops, and check every producer's records arrive complete and in order
+*/
+static void rq_test_run(struct rq_test *pTest, unsigned int producers)
+{
+    struct rq_producer producer[RQ_TEST_PRODUCERS];
+    pthread_t thread[RQ_TEST_PRODUCERS];
+    unsigned long nextSeq[RQ_TEST_PRODUCERS] = {0};
+    unsigned long popped = 0;
+    struct aesd_buffer_entry entry;
+    struct aesd_buffer_entry spare;
+    char message[128] = "";
+    bool success = true;
+    unsigned int index;
+
+    for (index = 0; index < producers; index++)
+    {
+        producer[index].pTest = pTest;
+        producer[index].id = index;
+        TEST_ASSERT_TRUE_MESSAGE(pthread_create(&thread[index], NULL, &rq_test_producer, &producer[index]) == 0,
+                                 "pthread_create failed");
+    }
+
+    while (popped < (unsigned long)producers * RQ_TEST_RECORDS)
+    {
+        if (!rq_test_pop(pTest, &entry))
+        {
+            sched_yield();
+            continue;
+        }
+        popped++;
+        if (success)
+            success = rq_test_check(&entry, producers, nextSeq, message, sizeof(message));
+        if (!aesd_buffer_entry_is_inline(&entry))
+            free((void *)entry.buffptr);
+    }
+
+    for (index = 0; index < producers; index++)
+        pthread_join(thread[index], NULL);
+    TEST_ASSERT_TRUE_MESSAGE(success, message);
+    TEST_ASSERT_TRUE_MESSAGE(!rq_test_pop(pTest, &spare), "queue not empty after every record was popped");
+}
+
+/**
+* One producer and one consumer through a four entry single producer queue, mixing
+* inline and external records.  Each record must arrive exactly once, in order and intact.
+*/
+void test_record_queue_spsc_fifo()
+{
+    static struct rq_test test;
+
+    test.multi = false;
+    TEST_ASSERT_TRUE_MESSAGE(aesd_spsc_queue_init(&test.spsc, RQ_TEST_CAPACITY), "aesd_spsc_queue_init failed");
+    rq_test_run(&test, 1);
+    aesd_spsc_queue_deinit(&test.spsc);
+}
+
+/**
+* Several producers through a four entry multi producer queue.  Records from different
+* producers may interleave, but each producer's own records must stay in order.
+*/
+void test_record_queue_mpsc_fifo_per_producer()
+{
+    static struct rq_test test;
+
+    test.multi = true;
+    TEST_ASSERT_TRUE_MESSAGE(aesd_mpsc_queue_init(&test.mpsc, RQ_TEST_CAPACITY), "aesd_mpsc_queue_init failed");
+    rq_test_run(&test, RQ_TEST_PRODUCERS);
+    aesd_mpsc_queue_deinit(&test.mpsc);
+}
@@ -0,0 +1,350 @@
+/**
+ * @file circular-buffer-model.h
+ * @author Kenneth A. Jones
+ * @date 2022-03-26
+ *
+ * @brief Reference model of struct aesd_circular_buffer and struct aesd_byte_ring
+ *      shared by the randomized stress test and the fuzz target.
+ *
+ *      The model keeps its own copy of every record held by the buffer and the
+ *      ring.  Each step decodes one operation from a few input bytes, applies it
+ *      to the buffer or the ring and to the model and checks they agree.  Define
+ *      CB_MODEL_CHECK(condition, message) before including this file to choose
+ *      how a mismatch is reported.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef CIRCULAR_BUFFER_MODEL_H
+#define CIRCULAR_BUFFER_MODEL_H
+
+// ============================================================================
+// INCLUDES
+// ============================================================================
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+#ifndef CB_MODEL_CHECK
+#error "Define CB_MODEL_CHECK(condition, message) before including circular-buffer-model.h"
+#endif
+
+// ============================================================================
+// PUBLIC MACROS AND DEFINES
+// ============================================================================
+
+// Largest record added by the model
+#define CB_MODEL_MAX_RECORD 200
+
+// Storage of the byte ring, small enough that records are dropped to free bytes
+#define CB_MODEL_RING_CAPACITY 512
+
+// Input bytes consumed by one cb_model_step()
+#define CB_MODEL_STEP_SIZE 3
+
+// ============================================================================
+// PUBLIC TYPEDEFS
+// ============================================================================
+
+struct cb_model
+{
+    struct aesd_circular_buffer buffer;
+    // Records held, oldest first
+    char data[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED][CB_MODEL_MAX_RECORD];
+    size_t size[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    // Storage handed to the buffer, NULL for records stored inline
+    const char *external[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint8_t count;
+
+    struct aesd_byte_ring ring;
+    char ringStorage[CB_MODEL_RING_CAPACITY];
+    // Records held by the ring, oldest first
+    char ringData[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED][CB_MODEL_MAX_RECORD];
+    size_t ringSize[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint8_t ringCount;
+};
+
+// ============================================================================
+// PUBLIC FUNCTIONS
+// ============================================================================
+
+static inline void cb_model_init(struct cb_model *model)
+{
+    memset(model, 0, sizeof(struct cb_model));
+    aesd_circular_buffer_init(&model->buffer);
+    aesd_byte_ring_init(&model->ring, model->ringStorage, CB_MODEL_RING_CAPACITY);
+}
+
+/**
+ * @brief Total number of bytes held by @param model
+ */
+static inline size_t cb_model_total(const struct cb_model *model)
+{
+    size_t total = 0;
+    uint8_t index;
+
+    for (index = 0; index < model->count; index++)
+        total += model->size[index];
+    return total;
+}
+
+/**
+ * @brief Add the @param size byte record at @param data, inline if @param inline_ok and
+ *  it fits, otherwise in its own allocation.  Empty records must be rejected.
+ */
+static inline void cb_model_add(struct cb_model *model, const char *data, size_t size, bool inline_ok)
+{
+    struct aesd_buffer_entry entry;
+    const char *expected = NULL;
+    const char *evicted;
+    char *pRecord;
+
+    if (inline_ok && aesd_buffer_entry_set(&entry, data, size))
+    {
+        pRecord = NULL;
+    }
+    else
+    {
+        pRecord = malloc((size != 0) ? size : 1);
+        CB_MODEL_CHECK(pRecord != NULL, "out of memory");
+        memcpy(pRecord, data, size);
+        entry.buffptr = pRecord;
+        entry.size = size;
+    }
+
+    // Empty records are rejected and stay owned by the caller
+    if (size == 0)
+    {
+        evicted = aesd_circular_buffer_add_entry(&model->buffer, &entry);
+        CB_MODEL_CHECK(evicted == NULL, "an empty record evicted another");
+        free(pRecord);
+        return;
+    }
+
+    // Drop the oldest record from the model if the buffer is full
+    if (model->count == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+    {
+        expected = model->external[0];
+        model->count--;
+        memmove(model->data[0], model->data[1], model->count * sizeof(model->data[0]));
+        memmove(&model->size[0], &model->size[1], model->count * sizeof(model->size[0]));
+        memmove(&model->external[0], &model->external[1], model->count * sizeof(model->external[0]));
+    }
+    memcpy(model->data[model->count], data, size);
+    model->size[model->count] = size;
+    model->external[model->count] = pRecord;
+    model->count++;
+
+    evicted = aesd_circular_buffer_add_entry(&model->buffer, &entry);
+    CB_MODEL_CHECK(evicted == expected, "add returned the wrong evicted record");
+    free((void *)evicted);
+    CB_MODEL_CHECK(model->buffer.full == (model->count == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED),
+                   "full flag does not match the record count");
+}
+
+/**
+ * @brief Look up @param char_offset in the buffer and check it against the model
+ */
+static inline void cb_model_find(struct cb_model *model, size_t char_offset)
+{
+    struct aesd_buffer_entry *pEntry;
+    size_t entry_offset = 0;
+    size_t start = 0;
+    uint8_t index;
+
+    pEntry = aesd_circular_buffer_find_entry_offset_for_fpos(&model->buffer, char_offset, &entry_offset);
+
+    // Find the record holding char_offset in the model
+    for (index = 0; index < model->count; index++)
+    {
+        if (char_offset < (start + model->size[index]))
+            break;
+        start += model->size[index];
+    }
+    if (index == model->count)
+    {
+        CB_MODEL_CHECK(pEntry == NULL, "found an entry past the end of the data");
+        return;
+    }
+
+    CB_MODEL_CHECK(pEntry != NULL, "no entry found for an offset within the data");
+    CB_MODEL_CHECK(entry_offset == (char_offset - start), "wrong offset within the entry");
+    CB_MODEL_CHECK(pEntry->size == model->size[index], "entry has the wrong size");
+    CB_MODEL_CHECK(memcmp(pEntry->buffptr, model->data[index], pEntry->size) == 0,
+                   "entry has the wrong contents");
+    if (model->external[index] != NULL)
+        CB_MODEL_CHECK(pEntry->buffptr == model->external[index], "entry lost its external storage");
+    else
+        CB_MODEL_CHECK(aesd_buffer_entry_is_inline(pEntry), "entry lost its inline storage");
+}
+
+/**
+ * @brief Total number of bytes held by the ring of @param model
+ */
+static inline size_t cb_model_ring_total(const struct cb_model *model)
+{
+    size_t total = 0;
+    uint8_t index;
+
+    for (index = 0; index < model->ringCount; index++)
+        total += model->ringSize[index];
+    return total;
+}
+
+/**
+ * @brief Drop the oldest record of the ring from @param model
+ *
+ * @return size of the dropped record
+ */
+static inline size_t cb_model_ring_drop(struct cb_model *model)
+{
+    size_t size = model->ringSize[0];
+
+    model->ringCount--;
+    memmove(model->ringData[0], model->ringData[1], model->ringCount * sizeof(model->ringData[0]));
+    memmove(&model->ringSize[0], &model->ringSize[1], model->ringCount * sizeof(model->ringSize[0]));
+    return size;
+}
+
+/**
+ * @brief Add the @param size byte record at @param data to the ring.  Empty records
+ *  are accepted but not stored.
+ */
+static inline void cb_model_ring_add(struct cb_model *model, const char *data, size_t size)
+{
+    size_t expected = 0;
+    size_t evicted = ~(size_t)0;
+    bool added;
+
+    if (size == 0)
+    {
+        added = aesd_byte_ring_add(&model->ring, NULL, 0, &evicted);
+        CB_MODEL_CHECK(added && (evicted == 0), "an empty record was not ignored");
+        return;
+    }
+
+    // Drop the oldest records until both an index slot and the bytes are free
+    if (model->ringCount == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+        expected += cb_model_ring_drop(model);
+    while ((cb_model_ring_total(model) + size) > CB_MODEL_RING_CAPACITY)
+        expected += cb_model_ring_drop(model);
+    memcpy(model->ringData[model->ringCount], data, size);
+    model->ringSize[model->ringCount] = size;
+    model->ringCount++;
+
+    added = aesd_byte_ring_add(&model->ring, data, size, &evicted);
+    CB_MODEL_CHECK(added, "ring rejected a record that fits");
+    CB_MODEL_CHECK(evicted == expected, "add dropped the wrong number of bytes");
+    CB_MODEL_CHECK(aesd_byte_ring_size(&model->ring) == cb_model_ring_total(model),
+                   "ring size does not match the records held");
+    CB_MODEL_CHECK(model->ring.full == (model->ringCount == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED),
+                   "ring full flag does not match the record count");
+}
+
+/**
+ * @brief Look up @param char_offset in the ring, read up to @param count bytes from it
+ *  and check both against the model
+ */
+static inline void cb_model_ring_find(struct cb_model *model, size_t char_offset, size_t count)
+{
+    static char expected[CB_MODEL_RING_CAPACITY];
+    static char copied[CB_MODEL_RING_CAPACITY];
+    struct aesd_byte_ring_index *pIndex;
+    size_t entry_offset = 0;
+    size_t total = 0;
+    size_t start = 0;
+    size_t nRead;
+    uint8_t index;
+    uint8_t found;
+
+    pIndex = aesd_byte_ring_find_index_for_fpos(&model->ring, char_offset, &entry_offset);
+    if (count > sizeof(copied))
+        count = sizeof(copied);
+    nRead = aesd_byte_ring_read(&model->ring, char_offset, copied, count);
+
+    // Concatenate the records of the model, noting the one holding char_offset
+    found = model->ringCount;
+    for (index = 0; index < model->ringCount; index++)
+    {
+        if ((found == model->ringCount) && (char_offset < (total + model->ringSize[index])))
+        {
+            found = index;
+            start = total;
+        }
+        memcpy(&expected[total], model->ringData[index], model->ringSize[index]);
+        total += model->ringSize[index];
+    }
+    if (found == model->ringCount)
+    {
+        CB_MODEL_CHECK(pIndex == NULL, "found a ring record past the end of the data");
+        CB_MODEL_CHECK(nRead == 0, "read ring bytes past the end of the data");
+        return;
+    }
+
+    CB_MODEL_CHECK(pIndex != NULL, "no ring record found for an offset within the data");
+    CB_MODEL_CHECK(entry_offset == (char_offset - start), "wrong offset within the ring record");
+    CB_MODEL_CHECK(pIndex->size == model->ringSize[found], "ring record has the wrong size");
+    if (count > (total - char_offset))
+        count = total - char_offset;
+    CB_MODEL_CHECK(nRead == count, "ring read returned the wrong number of bytes");
+    CB_MODEL_CHECK(memcmp(copied, &expected[char_offset], nRead) == 0, "ring read returned the wrong bytes");
+}
+
+/**
+ * @brief Free every record in the buffer and start over empty
+ */
+static inline void cb_model_reset(struct cb_model *model)
+{
+    aesd_circular_buffer_deinit(&model->buffer);
+    cb_model_init(model);
+}
+
+/**
+ * @brief Decode one operation from the CB_MODEL_STEP_SIZE bytes at @param in and apply it
+ *
+ *  in[0] < 100: add a record, in[1] selects the size and in[2] the contents
+ *  in[0] < 150: find offset (in[1] << 8 | in[2]) modulo a little past the end
+ *  in[0] < 200: add a record to the ring, as for the buffer
+ *  in[0] < 250: find and read from the ring as for the buffer, in[1] selects the count
+ *  otherwise:   deinit and init the buffer and the ring
+ */
+static inline void cb_model_step(struct cb_model *model, const uint8_t *in)
+{
+    char record[CB_MODEL_MAX_RECORD];
+    size_t size;
+    size_t index;
+
+    if ((in[0] < 100) || ((in[0] >= 150) && (in[0] < 200)))
+    {
+        // Odd operations favour sizes that can be stored inline
+        if (in[0] & 1)
+            size = in[1] % (AESD_BUFFER_ENTRY_INLINE_SIZE + 1);
+        else
+            size = in[1] % (CB_MODEL_MAX_RECORD + 1);
+        for (index = 0; index < size; index++)
+            record[index] = (char)(in[2] + index);
+        if (in[0] < 100)
+            cb_model_add(model, record, size, (in[0] & 2) == 0);
+        else
+            cb_model_ring_add(model, record, size);
+    }
+    else if (in[0] < 150)
+    {
+        cb_model_find(model, (((size_t)in[1] << 8) | in[2]) % (cb_model_total(model) + 8));
+    }
+    else if (in[0] < 250)
+    {
+        cb_model_ring_find(model, (((size_t)in[1] << 8) | in[2]) % (cb_model_ring_total(model) + 8),
+                           ((size_t)in[1] * 3) + 1);
+    }
+    else
+    {
+        cb_model_reset(model);
+    }
+}
+
+#endif /* CIRCULAR_BUFFER_MODEL_H */
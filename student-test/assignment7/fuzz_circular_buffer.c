@@ -0,0 +1,56 @@
+/**
+ * @file fuzz_circular_buffer.c
+ * @author Kenneth A. Jones
+ * @date 2022-03-26
+ *
+ * @brief Fuzz target for struct aesd_circular_buffer and struct aesd_byte_ring.
+ *
+ *      The input is decoded as a sequence of add, find, read and deinit operations
+ *      checked against the reference model in circular-buffer-model.h.  Built by
+ *      CMake with -DAESD_BUILD_FUZZERS=ON for libFuzzer.  Define
+ *      CB_FUZZ_STANDALONE to build a main() reading one input from stdin
+ *      instead, for use with AFL.
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+// ============================================================================
+// INCLUDES
+// ============================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#define CB_MODEL_CHECK(condition, message) \
+    do { if (!(condition)) { fprintf(stderr, "%s\n", message); abort(); } } while (0)
+#include "circular-buffer-model.h"
+
+// ============================================================================
+// PUBLIC FUNCTIONS
+// ============================================================================
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static struct cb_model model;
+    size_t offs;
+
+    cb_model_init(&model);
+    for (offs = 0; (offs + CB_MODEL_STEP_SIZE) <= size; offs += CB_MODEL_STEP_SIZE)
+        cb_model_step(&model, &data[offs]);
+
+    // Free whatever is left so leaks in deinit are reported
+    cb_model_reset(&model);
+    return 0;
+}
+
+#ifdef CB_FUZZ_STANDALONE
+int main(void)
+{
+    static uint8_t data[1 << 20];
+    size_t size;
+
+    size = fread(data, 1, sizeof(data), stdin);
+    return LLVMFuzzerTestOneInput(data, size);
+}
+#endif
@@ -0,0 +1,99 @@
+#include "unity.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../../aesd-char-driver/aesd_ioctl.h"
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+#define AESDCHAR_DEVICE "/dev/aesdchar"
+
+/**
+* Read @param fd until it returns no more data, return the number of bytes read
+*/
+static size_t read_to_eof(int fd)
+{
+    char buf[256];
+    size_t total = 0;
+    ssize_t nRead;
+
+    while ((nRead = read(fd, buf, sizeof(buf))) > 0)
+        total += nRead;
+    return total;
+}
+
+static void write_record(int fd, const char *record)
+{
+    TEST_ASSERT_TRUE_MESSAGE(write(fd, record, strlen(record)) == (ssize_t)strlen(record),
+                             "write to " AESDCHAR_DEVICE " failed");
+}
+
+/**
+* Fill the buffer through @param writer and move @param reader to the end of it
+*/
+static void fill_and_drain(int writer, int reader)
+{
+    char record[32];
+    int index;
+
+    for (index = 0; index < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; index++)
+    {
+        snprintf(record, sizeof(record), "fill record %d\n", index);
+        write_record(writer, record);
+    }
+    read_to_eof(reader);
+}
+
+/**
+* Records evicted while a reader sits at the end of the data must not move its next
+* read: it returns exactly the records written since, then the end of the data.  The
+* eviction is noticed by a read returning 0, or EAGAIN in non blocking follow mode,
+* before the new record is read.  Needs the aesdchar driver loaded, ignored otherwise.
+*/
+void test_aesdchar_read_after_eviction_at_eof()
+{
+    static const char *const records[] = {"evicts the oldest\n", "and the next one\n"};
+    uint32_t follow = 1;
+    char buf[64];
+    ssize_t nRead;
+    int writer;
+    int reader;
+    int pass;
+
+    writer = open(AESDCHAR_DEVICE, O_WRONLY);
+    if (writer < 0)
+    {
+        TEST_IGNORE_MESSAGE("no " AESDCHAR_DEVICE ", aesdchar driver not loaded");
+        return;
+    }
+
+    for (pass = 0; pass < 2; pass++)
+    {
+        // The second pass follows without blocking, so the end of the data is EAGAIN
+        reader = open(AESDCHAR_DEVICE, (pass == 0) ? O_RDONLY : (O_RDONLY | O_NONBLOCK));
+        TEST_ASSERT_TRUE_MESSAGE(reader >= 0, "open " AESDCHAR_DEVICE " failed");
+        if (pass == 1)
+            TEST_ASSERT_TRUE_MESSAGE(ioctl(reader, AESDCHAR_IOCFOLLOW, &follow) == 0, "AESDCHAR_IOCFOLLOW failed");
+        fill_and_drain(writer, reader);
+
+        write_record(writer, records[0]);
+        nRead = read(reader, buf, sizeof(buf));
+        TEST_ASSERT_TRUE_MESSAGE(nRead == (ssize_t)strlen(records[0]), "read after eviction returned the wrong size");
+        TEST_ASSERT_TRUE_MESSAGE(memcmp(buf, records[0], nRead) == 0, "first read after eviction returned the wrong bytes");
+
+        // At the end again, the read that notices the next eviction finds nothing yet
+        nRead = read(reader, buf, sizeof(buf));
+        TEST_ASSERT_TRUE_MESSAGE((nRead == 0) || ((nRead < 0) && (errno == EAGAIN)), "read past the end returned data");
+        write_record(writer, records[1]);
+        nRead = read(reader, buf, sizeof(buf));
+        TEST_ASSERT_TRUE_MESSAGE(nRead == (ssize_t)strlen(records[1]), "read after eviction returned the wrong size");
+        TEST_ASSERT_TRUE_MESSAGE(memcmp(buf, records[1], nRead) == 0, "read after eviction at the end returned the wrong bytes");
+
+        nRead = read(reader, buf, sizeof(buf));
+        TEST_ASSERT_TRUE_MESSAGE((nRead == 0) || ((nRead < 0) && (errno == EAGAIN)), "read past the end returned data");
+        close(reader);
+    }
+    close(writer);
+}